@@ -0,0 +1,250 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Puts the installer's children in cgroups.
+ */
+
+#include "cgroup.h"
+#include "output.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_PARENT CGROUP_ROOT "/vos-installer"
+
+struct _Cgroup
+{
+	char *path;
+	int procs;
+};
+
+static struct
+{
+	char *install; // The install's cgroup, or NULL if not started
+	int home;
+} C = {NULL, -1};
+
+static bool write_file(const char *dir, const char *name, const char *value)
+{
+	char *path = g_build_path("/", dir, name, NULL);
+	int fd = open(path, O_WRONLY|O_CLOEXEC);
+	g_free(path);
+	if(fd < 0)
+		return false;
+	ssize_t len = strlen(value);
+	bool ok = (write(fd, value, len) == len);
+	close(fd);
+	return ok;
+}
+
+static char * read_file(const char *dir, const char *name)
+{
+	char *path = g_build_path("/", dir, name, NULL);
+	char *contents = NULL;
+	g_file_get_contents(path, &contents, NULL, NULL);
+	g_free(path);
+	return contents;
+}
+
+// Enables whichever of the controllers it can for dir's children. One
+// at a time, since a write with one that's unavailable fails entirely.
+static void enable_controllers(const char *dir)
+{
+	static const char *kControllers[] = {"+cpu", "+io", "+memory"};
+	for(size_t i=0; i<G_N_ELEMENTS(kControllers); ++i)
+		write_file(dir, "cgroup.subtree_control", kControllers[i]);
+}
+
+// Returns the path of the installer's cgroup, from its "0::<path>" line
+// in /proc/self/cgroup, or NULL
+static char * own_cgroup(void)
+{
+	char *contents = NULL;
+	if(!g_file_get_contents("/proc/self/cgroup", &contents, NULL, NULL))
+		return NULL;
+	char *path = NULL;
+	char **lines = g_strsplit(contents, "\n", -1);
+	for(size_t i=0; !path && lines[i]!=NULL; ++i)
+		if(g_str_has_prefix(lines[i], "0::"))
+			path = g_build_path("/", CGROUP_ROOT, lines[i] + 3, NULL);
+	g_strfreev(lines);
+	g_free(contents);
+	return path;
+}
+
+static void set_limit(const char *name, const char *value)
+{
+	if(!write_file(C.install, name, value))
+		output_println("Warning: Failed to set the install's %s to %s (%i)", name, value, errno);
+}
+
+gboolean cgroup_start(const CgroupLimits *limits)
+{
+	g_return_val_if_fail(limits, FALSE);
+
+	char *home = own_cgroup();
+	if(!home || !g_file_test(CGROUP_ROOT "/cgroup.controllers", G_FILE_TEST_EXISTS))
+	{
+		g_free(home);
+		return FALSE;
+	}
+	char *homeProcs = g_build_path("/", home, "cgroup.procs", NULL);
+	C.home = open(homeProcs, O_WRONLY|O_CLOEXEC);
+	g_free(homeProcs);
+	g_free(home);
+
+	// Every install is a sibling under the same parent, so the weights
+	// share the host between them
+	enable_controllers(CGROUP_ROOT);
+	char *install = g_strdup(CGROUP_PARENT "/install-XXXXXX");
+	if((mkdir(CGROUP_PARENT, 0755) && errno != EEXIST) || !mkdtemp(install))
+	{
+		g_free(install);
+		if(C.home >= 0)
+			close(C.home);
+		C.home = -1;
+		return FALSE;
+	}
+	enable_controllers(CGROUP_PARENT);
+	enable_controllers(install);
+	C.install = install;
+
+	if(limits->cpuWeight)
+	{
+		char *value = g_strdup_printf("%u", limits->cpuWeight);
+		set_limit("cpu.weight", value);
+		g_free(value);
+	}
+	if(limits->ioWeight)
+	{
+		char *value = g_strdup_printf("default %u", limits->ioWeight);
+		set_limit("io.weight", value);
+		g_free(value);
+	}
+	if(limits->memoryHigh)
+	{
+		char *value = g_strdup_printf("%" G_GUINT64_FORMAT, limits->memoryHigh);
+		set_limit("memory.high", value);
+		g_free(value);
+	}
+	return TRUE;
+}
+
+void cgroup_stop(void)
+{
+	if(C.install)
+		rmdir(C.install);
+	g_free(C.install);
+	C.install = NULL;
+	if(C.home >= 0)
+		close(C.home);
+	C.home = -1;
+	// The shared parent stays, unless this was the last install
+	rmdir(CGROUP_PARENT);
+}
+
+Cgroup * cgroup_new(const char *name)
+{
+	g_return_val_if_fail(name, NULL);
+	if(!C.install)
+		return NULL;
+
+	char *path = g_build_path("/", C.install, name, NULL);
+	char *procs = g_build_path("/", path, "cgroup.procs", NULL);
+	int fd = (mkdir(path, 0755) == 0 || errno == EEXIST) ? open(procs, O_WRONLY|O_CLOEXEC) : -1;
+	g_free(procs);
+	if(fd < 0)
+	{
+		rmdir(path);
+		g_free(path);
+		return NULL;
+	}
+
+	Cgroup *cgroup = g_new0(Cgroup, 1);
+	cgroup->path = path;
+	cgroup->procs = fd;
+	return cgroup;
+}
+
+int cgroup_procs_fd(Cgroup *cgroup)
+{
+	return cgroup ? cgroup->procs : -1;
+}
+
+int cgroup_home_fd(void)
+{
+	return C.home;
+}
+
+// Returns the value of key in a "key value" line of contents, or 0
+static guint64 stat_value(const char *contents, const char *key)
+{
+	guint64 value = 0;
+	size_t len = strlen(key);
+	char **lines = g_strsplit(contents ? contents : "", "\n", -1);
+	for(size_t i=0; lines[i]!=NULL; ++i)
+		if(strncmp(lines[i], key, len) == 0 && lines[i][len] == ' ')
+			value = g_ascii_strtoull(lines[i] + len + 1, NULL, 10);
+	g_strfreev(lines);
+	return value;
+}
+
+static void read_usage(Cgroup *cgroup, CgroupUsage *usage)
+{
+	memset(usage, 0, sizeof(*usage));
+
+	char *cpu = read_file(cgroup->path, "cpu.stat");
+	usage->userUsec = stat_value(cpu, "user_usec");
+	usage->systemUsec = stat_value(cpu, "system_usec");
+	g_free(cpu);
+
+	// A line per device: "<major>:<minor> rbytes=<n> wbytes=<n> ..."
+	char *io = read_file(cgroup->path, "io.stat");
+	char **lines = io ? g_strsplit(io, "\n", -1) : NULL;
+	for(size_t i=0; lines && lines[i]!=NULL; ++i)
+	{
+		char **fields = g_strsplit(lines[i], " ", -1);
+		for(size_t j=1; fields[j]!=NULL; ++j)
+		{
+			if(g_str_has_prefix(fields[j], "rbytes="))
+				usage->readBytes += g_ascii_strtoull(fields[j] + 7, NULL, 10);
+			else if(g_str_has_prefix(fields[j], "wbytes="))
+				usage->writeBytes += g_ascii_strtoull(fields[j] + 7, NULL, 10);
+		}
+		g_strfreev(fields);
+	}
+	g_strfreev(lines);
+	g_free(io);
+
+	char *peak = read_file(cgroup->path, "memory.peak");
+	if(peak)
+		usage->memoryPeak = g_ascii_strtoull(peak, NULL, 10);
+	g_free(peak);
+}
+
+gboolean cgroup_free(Cgroup *cgroup, CgroupUsage *usage)
+{
+	if(!cgroup)
+		return FALSE;
+
+	if(usage)
+		read_usage(cgroup, usage);
+	close(cgroup->procs);
+
+	// Anything a command left running (such as a daemon it started)
+	// keeps the cgroup from being removed. It takes a moment to die.
+	if(rmdir(cgroup->path) && errno == EBUSY && write_file(cgroup->path, "cgroup.kill", "1"))
+		for(int i=0; i<100 && rmdir(cgroup->path) && errno == EBUSY; ++i)
+			g_usleep(10000);
+
+	g_free(cgroup->path);
+	g_free(cgroup);
+	return TRUE;
+}
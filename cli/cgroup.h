@@ -0,0 +1,68 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Puts the installer's children in (v2) cgroups: one for the install,
+ * under a vos-installer cgroup shared by every install on the host, and
+ * one inside that for each step. Installs sharing a host get shares of
+ * CPU and I/O and a memory limit, and what each step used is measured.
+ */
+
+#include <glib.h>
+
+typedef struct _Cgroup Cgroup;
+
+typedef struct
+{
+	guint cpuWeight; // 1-10000, or 0 to leave the default (100)
+	guint ioWeight; // 1-10000, or 0 to leave the default (100)
+	guint64 memoryHigh; // Bytes, or 0 for no limit
+} CgroupLimits;
+
+typedef struct
+{
+	guint64 userUsec;
+	guint64 systemUsec;
+	guint64 readBytes;
+	guint64 writeBytes;
+	guint64 memoryPeak; // 0 if the kernel doesn't track it
+} CgroupUsage;
+
+/*
+ * Makes the install's cgroup, with limits. Controllers that aren't
+ * available are left out, so some limits and usage may not apply.
+ * Returns FALSE if cgroup v2 isn't available, in which case the rest
+ * do nothing.
+ */
+gboolean cgroup_start(const CgroupLimits *limits);
+
+/*
+ * Removes the install's cgroup, once every cgroup in it is freed.
+ */
+void cgroup_stop(void);
+
+/*
+ * Makes a cgroup called name in the install's cgroup. Returns NULL if
+ * cgroups weren't started, or on failure.
+ */
+Cgroup * cgroup_new(const char *name);
+
+/*
+ * Returns the cgroup.procs of cgroup (or -1 if cgroup is NULL), for a
+ * child process to write "0" to, to join it before exec. It stays open
+ * until the cgroup is freed.
+ */
+int cgroup_procs_fd(Cgroup *cgroup);
+
+/*
+ * Returns the cgroup.procs of the cgroup the installer runs in, or -1.
+ */
+int cgroup_home_fd(void);
+
+/*
+ * Stores what cgroup's processes used in usage, kills anything still
+ * running in it, and removes it. Returns FALSE (leaving usage untouched)
+ * if cgroup is NULL.
+ */
+gboolean cgroup_free(Cgroup *cgroup, CgroupUsage *usage);
@@ -0,0 +1,356 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Records and replays the commands an install runs.
+ */
+
+#include "executor.h"
+#include "output.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define SCENARIO_HEADER "# vos-installer scenario 1\n"
+
+typedef struct
+{
+	char *step;
+	char **args;
+	int result;
+	gint64 elapsed;
+	char *output;
+	char *captured;
+	bool used;
+} Command;
+
+static struct
+{
+	GMutex lock;
+	FILE *file; // Recording to, or NULL
+	bool replaying;
+	double scale;
+	GHashTable *commands; // "<step>\t<args[0]>" -> GPtrArray of Command, in order
+	GHashTable *files; // Path -> contents
+	bool hasDest;
+	char *partuuid;
+	char *fstype;
+	guint64 size;
+	bool removable;
+} E;
+
+static void free_command(Command *command)
+{
+	g_free(command->step);
+	g_strfreev(command->args);
+	g_free(command->output);
+	g_free(command->captured);
+	g_free(command);
+}
+
+static char * command_key(const char *step, const char *name)
+{
+	return g_strdup_printf("%s\t%s", step ? step : "", name);
+}
+
+// Writes a record from its fields. Called with the lock held.
+static void write_record(const char * const *fields)
+{
+	for(size_t i=0; fields[i]!=NULL; ++i)
+	{
+		char *escaped = g_strescape(fields[i], NULL);
+		fprintf(E.file, "%s%s", (i > 0) ? "\t" : "", escaped);
+		g_free(escaped);
+	}
+	fputc('\n', E.file);
+	// Kept up to date, so an aborted install's recording is still useful
+	fflush(E.file);
+}
+
+gboolean executor_record(const char *path)
+{
+	g_return_val_if_fail(path && !E.file && !E.replaying, FALSE);
+	FILE *file = fopen(path, "we");
+	if(!file)
+		return FALSE;
+	fputs(SCENARIO_HEADER, file);
+	g_mutex_lock(&E.lock);
+	E.file = file;
+	E.files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	g_mutex_unlock(&E.lock);
+	return TRUE;
+}
+
+// Parses a record's (unescaped) fields. Returns false if it's invalid.
+static bool load_record(char **fields)
+{
+	guint num = g_strv_length(fields);
+	if(num >= 7 && strcmp(fields[0], "run") == 0)
+	{
+		Command *command = g_new0(Command, 1);
+		command->step = g_strdup(fields[1]);
+		command->result = atoi(fields[2]);
+		command->elapsed = g_ascii_strtoll(fields[3], NULL, 10);
+		command->output = g_strdup(fields[4]);
+		command->captured = g_strdup(fields[5]);
+		command->args = g_strdupv(fields + 6);
+		char *key = command_key(command->step, command->args[0]);
+		GPtrArray *list = g_hash_table_lookup(E.commands, key);
+		if(!list)
+		{
+			list = g_ptr_array_new_with_free_func((GDestroyNotify)free_command);
+			g_hash_table_insert(E.commands, key, list);
+		}
+		else
+			g_free(key);
+		g_ptr_array_add(list, command);
+		return true;
+	}
+	else if(num == 5 && strcmp(fields[0], "dest") == 0)
+	{
+		g_free(E.partuuid);
+		g_free(E.fstype);
+		E.partuuid = g_strdup(fields[1]);
+		E.fstype = (*fields[2] != '\0') ? g_strdup(fields[2]) : NULL;
+		E.size = g_ascii_strtoull(fields[3], NULL, 10);
+		E.removable = atoi(fields[4]) != 0;
+		E.hasDest = true;
+		return true;
+	}
+	else if(num == 3 && strcmp(fields[0], "file") == 0)
+	{
+		g_hash_table_replace(E.files, g_strdup(fields[1]), g_strdup(fields[2]));
+		return true;
+	}
+	return false;
+}
+
+gboolean executor_replay(const char *path, double scale)
+{
+	g_return_val_if_fail(path && !E.file && !E.replaying, FALSE);
+	char *contents = NULL;
+	if(!g_file_get_contents(path, &contents, NULL, NULL))
+		return FALSE;
+	if(!g_str_has_prefix(contents, SCENARIO_HEADER))
+	{
+		output_println("%s isn't a scenario", path);
+		g_free(contents);
+		errno = EINVAL;
+		return FALSE;
+	}
+
+	g_mutex_lock(&E.lock);
+	E.commands = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_ptr_array_unref);
+	E.files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	E.scale = MAX(scale, 0);
+	char **lines = g_strsplit(contents + strlen(SCENARIO_HEADER), "\n", -1);
+	g_free(contents);
+	guint invalid = 0;
+	for(size_t i=0; lines[i]!=NULL; ++i)
+	{
+		if(*lines[i] == '\0' || *lines[i] == '#')
+			continue;
+		char **fields = g_strsplit(lines[i], "\t", -1);
+		for(size_t j=0; fields[j]!=NULL; ++j)
+		{
+			char *field = g_strcompress(fields[j]);
+			g_free(fields[j]);
+			fields[j] = field;
+		}
+		if(!load_record(fields))
+			++invalid;
+		g_strfreev(fields);
+	}
+	g_strfreev(lines);
+	E.replaying = true;
+	g_mutex_unlock(&E.lock);
+
+	if(invalid > 0)
+		output_println("Ignoring %u invalid records in %s", invalid, path);
+	return TRUE;
+}
+
+void executor_close(void)
+{
+	g_mutex_lock(&E.lock);
+	if(E.file)
+		fclose(E.file);
+	E.file = NULL;
+	E.replaying = false;
+	if(E.commands)
+		g_hash_table_unref(E.commands);
+	E.commands = NULL;
+	if(E.files)
+		g_hash_table_unref(E.files);
+	E.files = NULL;
+	g_free(E.partuuid);
+	g_free(E.fstype);
+	E.partuuid = E.fstype = NULL;
+	E.hasDest = false;
+	g_mutex_unlock(&E.lock);
+}
+
+gboolean executor_recording(void)
+{
+	return E.file != NULL;
+}
+
+gboolean executor_replaying(void)
+{
+	return E.replaying;
+}
+
+void executor_add_command(const char *step, const char * const *args, int result, gint64 elapsed,
+	const char *output, const char *captured)
+{
+	g_mutex_lock(&E.lock);
+	if(E.file)
+	{
+		char *resultStr = g_strdup_printf("%i", result);
+		char *elapsedStr = g_strdup_printf("%" G_GINT64_FORMAT, elapsed);
+		guint numArgs = g_strv_length((char **)args);
+		const char **fields = g_new0(const char *, numArgs + 7);
+		fields[0] = "run";
+		fields[1] = step ? step : "";
+		fields[2] = resultStr;
+		fields[3] = elapsedStr;
+		fields[4] = output ? output : "";
+		fields[5] = captured ? captured : "";
+		memcpy(fields + 6, args, numArgs * sizeof(char *));
+		write_record(fields);
+		g_free(fields);
+		g_free(resultStr);
+		g_free(elapsedStr);
+	}
+	g_mutex_unlock(&E.lock);
+}
+
+static bool args_equal(const char * const *a, const char * const *b)
+{
+	for(; *a && *b; ++a, ++b)
+		if(strcmp(*a, *b) != 0)
+			return false;
+	return !*a && !*b;
+}
+
+// Number of places a and b have the same arg
+static guint args_common(const char * const *a, const char * const *b)
+{
+	guint common = 0;
+	for(; *a && *b; ++a, ++b)
+		if(strcmp(*a, *b) == 0)
+			++common;
+	return common;
+}
+
+void executor_find_command(const char *step, const char * const *args, ExecutorCommand *command)
+{
+	*command = (ExecutorCommand){0, 0, "", ""};
+	g_mutex_lock(&E.lock);
+	char *key = command_key(step, args[0]);
+	GPtrArray *list = E.commands ? g_hash_table_lookup(E.commands, key) : NULL;
+	g_free(key);
+
+	// The first unused one with the same args, or else the first unused
+	// one with the most args in common (temporary paths differ between
+	// runs, and a step's commands may run at the same time on helper
+	// threads), or else the last one again
+	Command *found = NULL;
+	guint foundCommon = 0;
+	for(guint i=0; list && i<list->len; ++i)
+	{
+		Command *c = g_ptr_array_index(list, i);
+		if(c->used)
+			continue;
+		if(args_equal((const char * const *)c->args, args))
+		{
+			found = c;
+			break;
+		}
+		guint common = args_common((const char * const *)c->args, args);
+		if(!found || common > foundCommon)
+		{
+			found = c;
+			foundCommon = common;
+		}
+	}
+	if(!found && list && list->len > 0)
+		found = g_ptr_array_index(list, list->len - 1);
+
+	if(found)
+	{
+		found->used = true;
+		command->result = found->result;
+		command->latency = found->elapsed * E.scale;
+		command->output = found->output;
+		command->captured = found->captured;
+	}
+	g_mutex_unlock(&E.lock);
+}
+
+void executor_add_dest(const char *partuuid, const char *fstype, guint64 size, gboolean removable)
+{
+	g_mutex_lock(&E.lock);
+	if(E.file)
+	{
+		char *sizeStr = g_strdup_printf("%" G_GUINT64_FORMAT, size);
+		const char *fields[] = {"dest", partuuid ? partuuid : "", fstype ? fstype : "", sizeStr, removable ? "1" : "0", NULL};
+		write_record(fields);
+		g_free(sizeStr);
+	}
+	g_mutex_unlock(&E.lock);
+}
+
+gboolean executor_find_dest(const char **partuuid, const char **fstype, guint64 *size, gboolean *removable)
+{
+	g_mutex_lock(&E.lock);
+	gboolean found = E.hasDest;
+	if(found)
+	{
+		*partuuid = E.partuuid;
+		*fstype = E.fstype;
+		*size = E.size;
+		*removable = E.removable;
+	}
+	g_mutex_unlock(&E.lock);
+	return found;
+}
+
+void executor_add_file(const char *path, const char *contents)
+{
+	g_mutex_lock(&E.lock);
+	if(E.file && !g_hash_table_contains(E.files, path))
+	{
+		g_hash_table_add(E.files, g_strdup(path));
+		const char *fields[] = {"file", path, contents, NULL};
+		write_record(fields);
+	}
+	g_mutex_unlock(&E.lock);
+}
+
+gboolean executor_restore_files(const char *root)
+{
+	g_mutex_lock(&E.lock);
+	gboolean ok = TRUE;
+	GHashTableIter iter;
+	gpointer path, contents;
+	if(E.files)
+		g_hash_table_iter_init(&iter, E.files);
+	while(E.files && g_hash_table_iter_next(&iter, &path, &contents))
+	{
+		char *full = g_build_path("/", root, path, NULL);
+		char *dir = g_path_get_dirname(full);
+		if(g_mkdir_with_parents(dir, 0755) || !g_file_set_contents(full, contents, -1, NULL))
+		{
+			output_println("Failed to restore %s", full);
+			ok = FALSE;
+		}
+		g_free(dir);
+		g_free(full);
+	}
+	g_mutex_unlock(&E.lock);
+	return ok;
+}
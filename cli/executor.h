@@ -0,0 +1,89 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Records what an install did outside the installer (the commands it
+ * ran, the destination device it found, and the files it read from the
+ * target) into a scenario file, or replays a scenario instead of doing
+ * any of it. A replayed install needs no root or disk, and takes only
+ * as long as the installer's own work (scheduling, parsing, output and
+ * progress) plus the commands' recorded time, scaled, so it measures
+ * the installer's overhead from one release to the next.
+ *
+ * A scenario is a "# vos-installer scenario 1" line, and then a line per
+ * record of tab-separated fields, each escaped like g_strescape:
+ *
+ *   run <step> <result> <usec> <output> <stdout> <args>...
+ *   dest <partuuid> <fstype> <size in bytes> <removable 0|1>
+ *   file <path in the target> <contents>
+ *
+ * where result is what run_full returned. Replayed commands match the
+ * step's recorded commands of the same name in order, preferring one
+ * with the same args (which differ when they contain temporary paths).
+ * Commands with no match succeed straight away with no output.
+ */
+
+#include <glib.h>
+
+typedef struct
+{
+	int result;
+	gint64 latency; // Microseconds, already scaled
+	const char *output;
+	const char *captured; // Its stdout, for callers that capture it
+} ExecutorCommand;
+
+/*
+ * Starts recording to the scenario file at path, replacing it. Returns
+ * FALSE on failure.
+ */
+gboolean executor_record(const char *path);
+
+/*
+ * Loads the scenario at path to replay, with the commands' latencies
+ * multiplied by scale (0 to not wait at all). Returns FALSE on failure.
+ */
+gboolean executor_replay(const char *path, double scale);
+
+/*
+ * Stops recording or replaying.
+ */
+void executor_close(void);
+
+gboolean executor_recording(void);
+gboolean executor_replaying(void);
+
+/*
+ * Records a command step ran with args, which took elapsed microseconds
+ * and returned result, with its output (the end of it, as run_full
+ * keeps) and captured stdout (if any).
+ */
+void executor_add_command(const char *step, const char * const *args, int result, gint64 elapsed,
+	const char *output, const char *captured);
+
+/*
+ * Stores the recorded result of the command step runs with args in
+ * command, whose strings last until executor_close.
+ */
+void executor_find_command(const char *step, const char * const *args, ExecutorCommand *command);
+
+/*
+ * Records, or looks up, the properties of the destination device. The
+ * strings stored by executor_find_dest last until executor_close.
+ * executor_find_dest returns FALSE if none were recorded.
+ */
+void executor_add_dest(const char *partuuid, const char *fstype, guint64 size, gboolean removable);
+gboolean executor_find_dest(const char **partuuid, const char **fstype, guint64 *size, gboolean *removable);
+
+/*
+ * Records the contents of a file the installer read from the target,
+ * the first time it's read.
+ */
+void executor_add_file(const char *path, const char *contents);
+
+/*
+ * Writes the recorded files into the directory root, standing in for
+ * the target. Returns FALSE if any can't be written.
+ */
+gboolean executor_restore_files(const char *root);
@@ -0,0 +1,522 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * A parallel file fetcher built on libcurl.
+ */
+
+#include "fetch.h"
+#include "output.h"
+#include "progress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <curl/curl.h>
+
+// Files are requested in ranges of this size, so that a large file can be
+// spread over several connections
+#define CHUNK_SIZE (4 * 1024 * 1024)
+
+// Times a range is retried (continuing from where it stopped) before the
+// file is given up on
+#define MAX_RETRIES 3
+
+// First line of a .part.state file. Followed by the expected size and
+// chunk size, and then the number of bytes done in each chunk.
+#define STATE_MAGIC "vos-fetch 1"
+
+typedef struct _Item Item;
+
+typedef struct
+{
+	Item *item;
+	guint64 start; // File offset of the range
+	guint64 length; // 0 for until the end of the file
+	guint64 done; // Bytes written since start
+	guint retries;
+	CURL *easy;
+	bool checked; // Response code checked
+} Chunk;
+
+struct _Item
+{
+	const FetchItem *src;
+	char *path;
+	char *partPath;
+	char *statePath;
+	int fd;
+	guint numChunks;
+	Chunk *chunks;
+	guint remaining; // Chunks not yet complete
+	guint active; // Chunks currently transferring
+	bool noRanges; // Server ignored a range request
+	bool failed;
+	bool finished;
+};
+
+typedef struct
+{
+	CURLM *multi;
+	GQueue queue; // Chunks waiting for a connection
+	guint active;
+	guint64 total; // Bytes to download
+	guint64 received;
+	gint64 lastProgress;
+	guint64 lastReceived;
+	guint64 reported; // Most bytes received that the install's progress was told about
+} Fetcher;
+
+static bool is_chunk_complete(const Chunk *chunk)
+{
+	return chunk->length > 0 && chunk->done == chunk->length;
+}
+
+// Writes the progress of item next to its partial download. Written whole
+// and renamed into place, so the state never claims more than was written.
+static void save_state(Item *item)
+{
+	GString *state = g_string_new(STATE_MAGIC "\n");
+	g_string_append_printf(state, "%" G_GUINT64_FORMAT " %u\n", item->src->size, CHUNK_SIZE);
+	for(guint i=0; i<item->numChunks; ++i)
+		g_string_append_printf(state, "%" G_GUINT64_FORMAT "\n", item->chunks[i].done);
+	g_file_set_contents(item->statePath, state->str, state->len, NULL);
+	g_string_free(state, TRUE);
+}
+
+// Restores the progress saved by save_state, if it matches item
+static void load_state(Item *item)
+{
+	char *contents = NULL;
+	if(!g_file_get_contents(item->statePath, &contents, NULL, NULL))
+		return;
+
+	char **lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+
+	char *expected = g_strdup_printf("%" G_GUINT64_FORMAT " %u", item->src->size, CHUNK_SIZE);
+	if(g_strv_length(lines) >= item->numChunks + 2
+	&& g_strcmp0(lines[0], STATE_MAGIC) == 0
+	&& g_strcmp0(lines[1], expected) == 0)
+	{
+		for(guint i=0; i<item->numChunks; ++i)
+		{
+			guint64 done = g_ascii_strtoull(lines[i+2], NULL, 10);
+			Chunk *chunk = &item->chunks[i];
+			if(chunk->length == 0 || done <= chunk->length)
+				chunk->done = done;
+		}
+	}
+	g_free(expected);
+	g_strfreev(lines);
+}
+
+// Splits item into chunks, all starting from nothing
+static void reset_chunks(Item *item, bool useRanges)
+{
+	guint64 size = item->src->size;
+	g_free(item->chunks);
+	item->numChunks = (useRanges && size > 0) ? (size + CHUNK_SIZE - 1) / CHUNK_SIZE : 1;
+	item->chunks = g_new0(Chunk, item->numChunks);
+	for(guint i=0; i<item->numChunks; ++i)
+	{
+		Chunk *chunk = &item->chunks[i];
+		chunk->item = item;
+		chunk->start = (guint64)i * CHUNK_SIZE;
+		chunk->length = (item->numChunks == 1) ? size : MIN((guint64)CHUNK_SIZE, size - chunk->start);
+	}
+}
+
+// Returns the hex SHA-256 of the file open at fd, or NULL on failure.
+// Free with g_free.
+static char * checksum_fd(int fd)
+{
+	GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	guchar buf[65536];
+	ssize_t num;
+	off_t offset = 0;
+	while((num = pread(fd, buf, sizeof(buf), offset)) > 0)
+	{
+		g_checksum_update(checksum, buf, num);
+		offset += num;
+	}
+
+	char *sum = (num < 0) ? NULL : g_strdup(g_checksum_get_string(checksum));
+	g_checksum_free(checksum);
+	return sum;
+}
+
+// Checks if the file at path is already the right one
+static bool is_file_valid(const FetchItem *src, const char *path)
+{
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	if(fd < 0)
+		return false;
+
+	struct stat st;
+	bool valid = (fstat(fd, &st) == 0 && (src->size == 0 || (guint64)st.st_size == src->size));
+	if(valid && src->sha256)
+	{
+		char *sum = checksum_fd(fd);
+		valid = (g_strcmp0(sum, src->sha256) == 0);
+		g_free(sum);
+	}
+	close(fd);
+	return valid;
+}
+
+static void free_item(Item *item)
+{
+	if(item->fd >= 0)
+		close(item->fd);
+	g_free(item->path);
+	g_free(item->partPath);
+	g_free(item->statePath);
+	g_free(item->chunks);
+}
+
+// Verifies a fully downloaded item and moves it into place
+static void finish_item(Item *item)
+{
+	item->finished = true;
+	if(item->failed)
+	{
+		save_state(item);
+		return;
+	}
+
+	struct stat st;
+	bool valid = (fstat(item->fd, &st) == 0
+		&& (item->src->size == 0 || (guint64)st.st_size == item->src->size));
+	if(valid && item->src->sha256)
+	{
+		char *sum = checksum_fd(item->fd);
+		valid = (g_strcmp0(sum, item->src->sha256) == 0);
+		g_free(sum);
+	}
+
+	if(valid && fsync(item->fd) == 0 && rename(item->partPath, item->path) == 0)
+	{
+		unlink(item->statePath);
+		return;
+	}
+
+	// A bad download can't be resumed from, so start over next time
+	output_println("Downloaded %s does not match its checksum", item->src->filename);
+	unlink(item->partPath);
+	unlink(item->statePath);
+	item->failed = true;
+}
+
+static size_t on_write(char *data, size_t size, size_t nmemb, void *userdata)
+{
+	Chunk *chunk = userdata;
+	Item *item = chunk->item;
+	size_t len = size * nmemb;
+
+	// A server that doesn't support ranges sends the whole file instead,
+	// which only fits a request starting from the beginning of the file
+	if(!chunk->checked)
+	{
+		chunk->checked = true;
+		long code = 0;
+		curl_easy_getinfo(chunk->easy, CURLINFO_RESPONSE_CODE, &code);
+		bool ranged = (chunk->start + chunk->done > 0 || item->numChunks > 1);
+		if(ranged && code != 206)
+		{
+			item->noRanges = true;
+			return 0;
+		}
+	}
+
+	if(chunk->length > 0 && chunk->done + len > chunk->length)
+		return 0;
+	if(pwrite(item->fd, data, len, chunk->start + chunk->done) != (ssize_t)len)
+		return 0;
+	chunk->done += len;
+	return len;
+}
+
+// Starts a transfer for the rest of chunk
+static bool start_chunk(Fetcher *f, Chunk *chunk)
+{
+	CURL *easy = curl_easy_init();
+	if(!easy)
+		return false;
+
+	chunk->easy = easy;
+	chunk->checked = false;
+	curl_easy_setopt(easy, CURLOPT_URL, chunk->item->src->url);
+	curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, on_write);
+	curl_easy_setopt(easy, CURLOPT_WRITEDATA, chunk);
+	curl_easy_setopt(easy, CURLOPT_PRIVATE, chunk);
+	curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(easy, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, 30L);
+	curl_easy_setopt(easy, CURLOPT_USERAGENT, "vos-install-cli");
+
+	guint64 from = chunk->start + chunk->done;
+	char *range = NULL;
+	if(chunk->length > 0 && chunk->item->numChunks > 1)
+		range = g_strdup_printf("%" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT, from, chunk->start + chunk->length - 1);
+	else if(from > 0)
+		range = g_strdup_printf("%" G_GUINT64_FORMAT "-", from);
+	if(range)
+		curl_easy_setopt(easy, CURLOPT_RANGE, range);
+	g_free(range); // libcurl copies string options
+
+	curl_multi_add_handle(f->multi, easy);
+	chunk->item->active++;
+	f->active++;
+	return true;
+}
+
+// Handles the end of a chunk's transfer
+static void end_chunk(Fetcher *f, Chunk *chunk, CURLcode result)
+{
+	Item *item = chunk->item;
+	curl_multi_remove_handle(f->multi, chunk->easy);
+	curl_easy_cleanup(chunk->easy);
+	chunk->easy = NULL;
+	item->active--;
+	f->active--;
+
+	if(item->noRanges)
+	{
+		// Start over as a single request once every range has stopped
+		if(item->active == 0)
+		{
+			for(GList *l=f->queue.head; l;)
+			{
+				GList *next = l->next;
+				if(((Chunk *)l->data)->item == item)
+					g_queue_delete_link(&f->queue, l);
+				l = next;
+			}
+			reset_chunks(item, false);
+			item->noRanges = false;
+			item->remaining = 1;
+			if(ftruncate(item->fd, 0) == 0)
+				g_queue_push_tail(&f->queue, &item->chunks[0]);
+			else
+				item->failed = true;
+		}
+		return;
+	}
+
+	bool complete = (result == CURLE_OK && (chunk->length == 0 || is_chunk_complete(chunk)));
+	if(complete)
+	{
+		item->remaining--;
+	}
+	else if(!item->failed && chunk->retries++ < MAX_RETRIES)
+	{
+		g_queue_push_tail(&f->queue, chunk);
+		return;
+	}
+	else if(!item->failed)
+	{
+		output_println("Failed to download %s: %s", item->src->filename, curl_easy_strerror(result));
+		item->failed = true;
+		for(GList *l=f->queue.head; l;)
+		{
+			GList *next = l->next;
+			if(((Chunk *)l->data)->item == item)
+				g_queue_delete_link(&f->queue, l);
+			l = next;
+		}
+	}
+
+	if(item->active > 0)
+		save_state(item);
+	else if(item->failed || item->remaining == 0)
+		finish_item(item);
+	else
+		save_state(item);
+}
+
+static void print_progress(Fetcher *f, gint64 now, bool force)
+{
+	if(!force && now - f->lastProgress < G_USEC_PER_SEC)
+		return;
+
+	double seconds = (now - f->lastProgress) / (double)G_USEC_PER_SEC;
+	double rate = seconds > 0 ? (f->received - f->lastReceived) / seconds : 0;
+	output_println("Downloaded %.1f of %.1f MiB (%.2f MiB/s)",
+		f->received / 1048576.0,
+		f->total / 1048576.0,
+		rate / 1048576.0);
+	f->lastProgress = now;
+	f->lastReceived = f->received;
+}
+
+void fetch_init_curl(void)
+{
+	static gsize initialized = 0;
+	if(g_once_init_enter(&initialized))
+	{
+		curl_global_init(CURL_GLOBAL_DEFAULT);
+		g_once_init_leave(&initialized, 1);
+	}
+}
+
+guint fetch_files(const char *dir, const FetchItem *items, guint numItems, guint connections, const volatile bool *cancel)
+{
+	g_return_val_if_fail(dir && (items || numItems == 0), numItems);
+
+	fetch_init_curl();
+
+	Fetcher f = {0};
+	g_queue_init(&f.queue);
+	f.multi = curl_multi_init();
+	if(!f.multi)
+		return numItems;
+	curl_multi_setopt(f.multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)MAX(connections, 1));
+
+	Item *list = g_new0(Item, numItems);
+	guint fetching = 0;
+	for(guint i=0; i<numItems; ++i)
+	{
+		Item *item = &list[i];
+		item->src = &items[i];
+		item->fd = -1;
+		item->path = g_build_path("/", dir, items[i].filename, NULL);
+		item->partPath = g_strconcat(item->path, ".part", NULL);
+		item->statePath = g_strconcat(item->path, ".part.state", NULL);
+
+		if(is_file_valid(item->src, item->path))
+		{
+			item->finished = true;
+			continue;
+		}
+
+		item->fd = open(item->partPath, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+		if(item->fd < 0)
+		{
+			output_println("Failed to create %s (%i)", item->partPath, errno);
+			item->failed = item->finished = true;
+			continue;
+		}
+
+		reset_chunks(item, true);
+		load_state(item);
+		f.total += items[i].size;
+		for(guint j=0; j<item->numChunks; ++j)
+		{
+			Chunk *chunk = &item->chunks[j];
+			f.received += chunk->done;
+			if(!is_chunk_complete(chunk))
+			{
+				item->remaining++;
+				g_queue_push_tail(&f.queue, chunk);
+			}
+		}
+		if(item->remaining == 0)
+			finish_item(item);
+		else
+			++fetching;
+	}
+
+	if(fetching > 0)
+		output_println("Downloading %u files (%.1f MiB) over %u connections", fetching, f.total / 1048576.0, connections);
+
+	gint64 start = g_get_monotonic_time();
+	guint64 resumed = f.received;
+	f.lastProgress = start;
+	f.lastReceived = f.received;
+	f.reported = f.received;
+	bool cancelled = false;
+	while(f.active > 0 || f.queue.length > 0)
+	{
+		if(cancel && *cancel)
+		{
+			cancelled = true;
+			break;
+		}
+
+		while(f.active < connections && f.queue.length > 0)
+		{
+			Chunk *chunk = g_queue_pop_head(&f.queue);
+			if(!start_chunk(&f, chunk))
+			{
+				chunk->item->failed = true;
+				if(chunk->item->active == 0)
+					finish_item(chunk->item);
+			}
+		}
+
+		int running = 0;
+		curl_multi_perform(f.multi, &running);
+
+		CURLMsg *msg;
+		int queued;
+		while((msg = curl_multi_info_read(f.multi, &queued)))
+		{
+			if(msg->msg != CURLMSG_DONE)
+				continue;
+			Chunk *chunk = NULL;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&chunk);
+			CURLcode result = msg->data.result;
+			end_chunk(&f, chunk, result);
+		}
+
+		// Count bytes written by the transfers, including partial ones
+		guint64 received = 0;
+		for(guint i=0; i<numItems; ++i)
+			for(guint j=0; j<list[i].numChunks && list[i].fd >= 0; ++j)
+				received += list[i].chunks[j].done;
+		f.received = received;
+		print_progress(&f, g_get_monotonic_time(), false);
+
+		// Bytes of a range that was started over only count once
+		if(received > f.reported)
+		{
+			progress_downloaded(received - f.reported);
+			f.reported = received;
+		}
+
+		if(f.active > 0)
+			curl_multi_poll(f.multi, NULL, 0, 100, NULL);
+	}
+
+	guint failed = 0;
+	for(guint i=0; i<numItems; ++i)
+	{
+		Item *item = &list[i];
+		for(guint j=0; j<item->numChunks; ++j)
+		{
+			if(item->chunks[j].easy)
+			{
+				curl_multi_remove_handle(f.multi, item->chunks[j].easy);
+				curl_easy_cleanup(item->chunks[j].easy);
+			}
+		}
+		if(!item->finished)
+			save_state(item);
+		if(!item->finished || item->failed)
+			++failed;
+		free_item(item);
+	}
+	g_free(list);
+	g_queue_clear(&f.queue);
+	curl_multi_cleanup(f.multi);
+
+	if(fetching > 0)
+	{
+		gint64 elapsed = g_get_monotonic_time() - start;
+		double seconds = elapsed / (double)G_USEC_PER_SEC;
+		double downloaded = (f.received - resumed) / 1048576.0;
+		output_println("%s %.1f MiB in %.1fs (%.2f MiB/s)%s",
+			cancelled ? "Stopped after downloading" : "Downloaded",
+			downloaded,
+			seconds,
+			seconds > 0 ? downloaded / seconds : 0,
+			failed ? ", some files failed" : "");
+	}
+	return failed;
+}
@@ -0,0 +1,37 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * A parallel file fetcher built on libcurl, used to download packages
+ * into pacman's cache directory before pacman runs. Large files are split
+ * into ranges fetched over separate connections. Progress is kept next to
+ * each partial download, so an aborted fetch resumes where it left off.
+ */
+
+#include <glib.h>
+#include <stdbool.h>
+
+typedef struct
+{
+	const char *url;
+	const char *filename; // Name of the file in the destination directory
+	const char *sha256; // Expected checksum, or NULL to not verify
+	guint64 size; // Expected size, or 0 if unknown
+} FetchItem;
+
+/*
+ * Downloads each item into dir, using at most connections concurrent
+ * connections, and prints the transfer rate as it goes. Items already in
+ * dir with the right checksum are skipped. Files are downloaded to
+ * <filename>.part and only renamed into place once verified. If *cancel
+ * becomes true, stops as soon as possible, keeping partial downloads to
+ * resume later. Returns the number of items that weren't downloaded.
+ */
+guint fetch_files(const char *dir, const FetchItem *items, guint numItems, guint connections, const volatile bool *cancel);
+
+/*
+ * Initializes libcurl, the first time it's called. Call before using
+ * libcurl anywhere.
+ */
+void fetch_init_curl(void);
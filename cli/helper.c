@@ -0,0 +1,488 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * A helper process that runs commands for the installer.
+ */
+
+#define _GNU_SOURCE
+#include "helper.h"
+#include "supervisor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <poll.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define MAX_HELPER_INPUT (16 * 1024)
+#define MAX_REQUEST (128 * 1024)
+
+extern char **environ;
+
+struct _Helper
+{
+	int sock;
+};
+
+// A request is this, followed by argsLen bytes of NUL-terminated args
+// and inputLen bytes of input. It comes with the socket to reply to, the
+// command's output fd, and optionally the cgroup.procs of the cgroup to
+// start the command in attached.
+typedef struct
+{
+	uint32_t argsLen;
+	uint32_t inputLen;
+	int32_t hasInput;
+} Request;
+
+// Sent once the command is running (or failed to start, with pid 0 and
+// error set), and again once it has exited, with its resource usage
+typedef struct
+{
+	int32_t pid;
+	int32_t exited;
+	int32_t status;
+	int32_t error;
+	int64_t spawnTime;
+	struct rusage usage;
+} Reply;
+
+typedef struct
+{
+	pid_t pid;
+	int reply;
+} Running;
+
+// Everything in the helper process below here uses only plain libc,
+// since it's forked from a multithreaded process.
+
+// Closes every fd from first up, so the helper doesn't hold open pipes
+// (or the target's files) that the installer had open when it forked
+static void close_fds(int first)
+{
+#ifdef SYS_close_range
+	if(syscall(SYS_close_range, first, ~0U, 0) == 0)
+		return;
+#endif
+	DIR *dir = opendir("/proc/self/fd");
+	if(!dir)
+		return;
+	int *fds = NULL;
+	size_t numFds = 0;
+	struct dirent *entry;
+	while((entry = readdir(dir)) != NULL)
+	{
+		int fd = atoi(entry->d_name);
+		if(fd >= first && fd != dirfd(dir))
+		{
+			fds = realloc(fds, (numFds + 1) * sizeof(int));
+			fds[numFds++] = fd;
+		}
+	}
+	closedir(dir);
+	for(size_t i=0; i<numFds; ++i)
+		close(fds[i]);
+	free(fds);
+}
+
+static void send_reply(int fd, const Reply *reply)
+{
+	while(send(fd, reply, sizeof(*reply), MSG_NOSIGNAL) < 0 && errno == EINTR);
+}
+
+static int64_t elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+// Moves the helper into the cgroup whose cgroup.procs is open as fd
+static void join_cgroup(int fd)
+{
+	if(fd >= 0)
+		while(write(fd, "0", 1) < 0 && errno == EINTR);
+}
+
+// Starts the command in a request, in the cgroup whose cgroup.procs is
+// open as cgroup (if not -1), after which the helper goes back to home.
+// Returns its pid, or 0 if it failed to start (after replying so).
+static pid_t spawn(char *buf, size_t len, int reply, int outfd, int cgroup, int home)
+{
+	Reply r = {0};
+	Request request;
+	memcpy(&request, buf, MIN(len, sizeof(request)));
+	char *args = buf + sizeof(request);
+	if(len < sizeof(request) || request.argsLen == 0 || request.inputLen > MAX_HELPER_INPUT
+	|| sizeof(request) + request.argsLen + request.inputLen != len
+	|| args[request.argsLen - 1] != '\0')
+	{
+		r.error = EINVAL;
+		send_reply(reply, &r);
+		return 0;
+	}
+
+	size_t argc = 0;
+	for(uint32_t i=0; i<request.argsLen; ++i)
+		if(args[i] == '\0')
+			++argc;
+	char **argv = calloc(argc + 1, sizeof(char *));
+	char *arg = args;
+	for(size_t i=0; i<argc; ++i)
+	{
+		argv[i] = arg;
+		arg += strlen(arg) + 1;
+	}
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	int in[2] = {-1, -1};
+	if(request.hasInput)
+	{
+		// The input fits in the pipe, so this doesn't block
+		if(pipe2(in, O_CLOEXEC) == 0)
+		{
+			if(write(in[1], args + request.argsLen, request.inputLen) != (ssize_t)request.inputLen)
+				r.error = EIO;
+			close(in[1]);
+			posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+		}
+		else
+			r.error = errno;
+	}
+	else
+		posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_adddup2(&actions, outfd, STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, outfd, STDERR_FILENO);
+
+	// Its own process group, so the supervisor can stop it and
+	// everything it starts, with the signals the helper blocks back
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP|POSIX_SPAWN_SETSIGMASK|POSIX_SPAWN_SETSIGDEF);
+	posix_spawnattr_setpgroup(&attr, 0);
+	sigset_t none, defaults;
+	sigemptyset(&none);
+	posix_spawnattr_setsigmask(&attr, &none);
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGINT);
+	sigaddset(&defaults, SIGTERM);
+	sigaddset(&defaults, SIGHUP);
+	sigaddset(&defaults, SIGCHLD);
+	sigaddset(&defaults, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &defaults);
+
+	pid_t pid = 0;
+	if(!r.error)
+	{
+		// posix_spawn returns once the command is exec'd
+		// The command starts in whatever cgroup the helper is in
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		join_cgroup(cgroup);
+		r.error = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+		if(cgroup >= 0)
+			join_cgroup(home);
+		r.spawnTime = elapsed_us(&start);
+	}
+	if(r.error)
+		pid = 0;
+	r.pid = pid;
+	send_reply(reply, &r);
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	if(in[0] >= 0)
+		close(in[0]);
+	free(argv);
+	return pid;
+}
+
+static void helper_main(int sock, int home, pid_t parent, const char *root)
+{
+	supervisor_prepare_child(parent);
+
+	// The socket goes to fd 3 and home to fd 4, moved out of the way
+	// first in case either is already one of those. Close-on-exec, so
+	// the commands don't get them.
+	sock = fcntl(sock, F_DUPFD, 10);
+	home = (home >= 0) ? fcntl(home, F_DUPFD, 10) : -1;
+	if(sock < 0 || dup3(sock, 3, O_CLOEXEC) < 0)
+		_exit(1);
+	sock = 3;
+	if(home >= 0)
+		home = (dup3(home, 4, O_CLOEXEC) < 0) ? -1 : 4;
+	close_fds(5);
+
+	// Tell the installer whether it's ready
+	Reply ready = {0};
+	if(root && (chroot(root) || chdir("/")))
+		ready.error = errno;
+	send_reply(sock, &ready);
+	if(ready.error)
+		_exit(1);
+
+	// Children are reaped as SIGCHLD comes in. SIGINT is ignored, since
+	// on abort the supervisor signals each command itself; SIGHUP (the
+	// installer died) and SIGTERM stop everything.
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGHUP);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	int sfd = signalfd(-1, &sigs, SFD_NONBLOCK|SFD_CLOEXEC);
+	if(sfd < 0)
+		_exit(1);
+
+	Running *running = NULL;
+	size_t numRunning = 0;
+	bool open = true;
+	char *buf = malloc(MAX_REQUEST);
+	while(open || numRunning > 0)
+	{
+		struct pollfd fds[2] = {{sfd, POLLIN, 0}, {open ? sock : -1, POLLIN, 0}};
+		if(poll(fds, 2, -1) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+
+		if(fds[0].revents & POLLIN)
+		{
+			struct signalfd_siginfo info;
+			while(read(sfd, &info, sizeof(info)) == sizeof(info))
+			{
+				if(info.ssi_signo != SIGTERM && info.ssi_signo != SIGHUP)
+					continue;
+				for(size_t i=0; i<numRunning; ++i)
+					kill(-running[i].pid, SIGTERM);
+				_exit(1);
+			}
+
+			int status;
+			struct rusage usage;
+			pid_t pid;
+			while((pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
+			{
+				for(size_t i=0; i<numRunning; ++i)
+				{
+					if(running[i].pid != pid)
+						continue;
+					Reply r = {0};
+					r.pid = pid;
+					r.exited = 1;
+					r.status = status;
+					r.usage = usage;
+					send_reply(running[i].reply, &r);
+					close(running[i].reply);
+					running[i] = running[--numRunning];
+					break;
+				}
+			}
+		}
+
+		if(!open || !fds[1].revents)
+			continue;
+
+		struct iovec iov = {buf, MAX_REQUEST};
+		union
+		{
+			char buf[CMSG_SPACE(3 * sizeof(int))];
+			struct cmsghdr align;
+		} control;
+		struct msghdr msg = {0};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		ssize_t len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+		if(len < 0 && errno == EINTR)
+			continue;
+		if(len <= 0)
+		{
+			// The installer is done with the helper
+			open = false;
+			continue;
+		}
+
+		int passed[3] = {-1, -1, -1};
+		for(struct cmsghdr *c=CMSG_FIRSTHDR(&msg); c!=NULL; c=CMSG_NXTHDR(&msg, c))
+			if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+				memcpy(passed, CMSG_DATA(c), MIN(c->cmsg_len - CMSG_LEN(0), sizeof(passed)));
+		if(passed[0] >= 0 && passed[1] >= 0 && !(msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)))
+		{
+			pid_t pid = spawn(buf, len, passed[0], passed[1], passed[2], home);
+			if(pid > 0)
+			{
+				running = realloc(running, (numRunning + 1) * sizeof(Running));
+				running[numRunning].pid = pid;
+				running[numRunning++].reply = passed[0];
+				passed[0] = -1;
+			}
+		}
+		for(int i=0; i<3; ++i)
+			if(passed[i] >= 0)
+				close(passed[i]);
+	}
+	_exit(0);
+}
+
+static bool receive_reply(int fd, Reply *reply)
+{
+	ssize_t len;
+	while((len = recv(fd, reply, sizeof(*reply), 0)) < 0 && errno == EINTR);
+	return len == sizeof(*reply);
+}
+
+Helper * helper_start(const char *root, int home, pid_t *pid)
+{
+	g_return_val_if_fail(pid, NULL);
+
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv))
+		return NULL;
+
+	pid_t parent = getpid();
+	pid_t child = fork();
+	if(child < 0)
+	{
+		close(sv[0]);
+		close(sv[1]);
+		return NULL;
+	}
+	if(child == 0)
+	{
+		close(sv[0]);
+		helper_main(sv[1], home, parent, root);
+	}
+
+	close(sv[1]);
+	Reply ready;
+	if(!receive_reply(sv[0], &ready) || ready.error)
+	{
+		close(sv[0]);
+		waitpid(child, NULL, 0);
+		errno = ready.error ? ready.error : EPIPE;
+		return NULL;
+	}
+
+	Helper *helper = g_new0(Helper, 1);
+	helper->sock = sv[0];
+	*pid = child;
+	return helper;
+}
+
+gboolean helper_run(Helper *helper, const char * const *args, const char *input, int outfd, int cgroup,
+	HelperStartedFunc started, gpointer data, int *status, gint64 *spawnTime, struct rusage *usage)
+{
+	g_return_val_if_fail(helper && args && args[0], FALSE);
+
+	Request header = {0};
+	GString *request = g_string_new_len((const char *)&header, sizeof(header));
+	for(size_t i=0; args[i]!=NULL; ++i)
+		g_string_append_len(request, args[i], strlen(args[i]) + 1);
+	header.argsLen = request->len - sizeof(header);
+	if(input)
+	{
+		header.hasInput = 1;
+		header.inputLen = strlen(input);
+		g_string_append_len(request, input, header.inputLen);
+	}
+	memcpy(request->str, &header, sizeof(header));
+	if(header.inputLen > MAX_HELPER_INPUT || request->len > MAX_REQUEST)
+	{
+		g_string_free(request, TRUE);
+		errno = E2BIG;
+		return FALSE;
+	}
+
+	int rs[2];
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, rs))
+	{
+		g_string_free(request, TRUE);
+		return FALSE;
+	}
+
+	struct iovec iov = {request->str, request->len};
+	union
+	{
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+	int fds[3] = {rs[1], outfd, cgroup};
+	size_t numFds = (cgroup >= 0) ? 3 : 2;
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(numFds * sizeof(int));
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(numFds * sizeof(int));
+	memcpy(CMSG_DATA(c), fds, numFds * sizeof(int));
+
+	ssize_t sent;
+	while((sent = sendmsg(helper->sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+	int err = errno;
+	close(rs[1]);
+	g_string_free(request, TRUE);
+	if(sent < 0)
+	{
+		close(rs[0]);
+		errno = err;
+		return FALSE;
+	}
+
+	Reply reply = {0};
+	bool received = receive_reply(rs[0], &reply);
+	if(!received || reply.pid <= 0)
+	{
+		close(rs[0]);
+		errno = (received && reply.error > 0) ? reply.error : EPIPE;
+		return FALSE;
+	}
+	if(spawnTime)
+		*spawnTime = reply.spawnTime;
+	if(started)
+		started(reply.pid, data);
+
+	bool exited = receive_reply(rs[0], &reply) && reply.exited;
+	close(rs[0]);
+	if(!exited)
+	{
+		errno = EPIPE;
+		return FALSE;
+	}
+	if(status)
+		*status = reply.status;
+	if(usage)
+		*usage = reply.usage;
+	return TRUE;
+}
+
+void helper_stop(Helper *helper)
+{
+	if(!helper)
+		return;
+	close(helper->sock);
+	g_free(helper);
+}
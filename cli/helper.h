@@ -0,0 +1,50 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * A helper process that runs commands for the installer. It's forked
+ * once (and changes root into the target), stays small and single
+ * threaded, and starts each command with posix_spawn, so the installer
+ * doesn't fork its whole multithreaded self for every command. Commands
+ * are sent over a socket, and any number can run at once.
+ */
+
+#include <glib.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+typedef struct _Helper Helper;
+
+// Called with the pid of a command once it's running. Each command
+// leads its own process group.
+typedef void (*HelperStartedFunc)(pid_t pid, gpointer data);
+
+/*
+ * Forks the helper, which changes root to root (if non-NULL) and runs
+ * commands from there. home, if not -1, is the cgroup.procs of the
+ * helper's own cgroup, to go back to after starting a command in
+ * another. Stores its pid in pid, for the caller to supervise and wait
+ * on once stopped. Returns NULL with errno set on failure, including if
+ * it couldn't change root.
+ */
+Helper * helper_start(const char *root, int home, pid_t *pid);
+
+/*
+ * Runs args (searching PATH) through the helper, with input (if non-NULL,
+ * up to 16KiB) as its stdin, or /dev/null, and outfd as its stdout and
+ * stderr. If cgroup isn't -1, it's the cgroup.procs of the cgroup to
+ * start the command in. started is called once the command is running. Stores the
+ * command's wait status in status, how long it took to start (until
+ * it was exec'd) in microseconds in spawnTime, and its resource usage in
+ * usage (each if non-NULL). Safe to call from several
+ * threads at once. Returns FALSE with errno set if the command couldn't
+ * be started, or the helper died.
+ */
+gboolean helper_run(Helper *helper, const char * const *args, const char *input, int outfd, int cgroup,
+	HelperStartedFunc started, gpointer data, int *status, gint64 *spawnTime, struct rusage *usage);
+
+/*
+ * Tells the helper to exit once its commands are done, and frees helper.
+ */
+void helper_stop(Helper *helper);
@@ -0,0 +1,71 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Reads the host's network and disk counters from /proc.
+ */
+
+#include "hoststat.h"
+#include <stdio.h>
+#include <string.h>
+
+// /proc/diskstats counts in 512 byte sectors, whatever the disk's are
+#define SECTOR_SIZE 512
+
+gboolean hoststat_network(guint64 *received, guint64 *sent)
+{
+	char *contents = NULL;
+	if(!g_file_get_contents("/proc/net/dev", &contents, NULL, NULL))
+		return FALSE;
+	*received = *sent = 0;
+	char **lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+	// Two header lines, then "<iface>: <rx bytes> <7 more rx> <tx bytes> ..."
+	for(size_t i=0; lines[i]!=NULL; ++i)
+	{
+		char *colon = strchr(lines[i], ':');
+		if(i < 2 || !colon)
+			continue;
+		*colon = '\0';
+		if(strcmp(g_strstrip(lines[i]), "lo") == 0)
+			continue;
+		guint64 r, s;
+		if(sscanf(colon + 1, "%" G_GUINT64_FORMAT " %*u %*u %*u %*u %*u %*u %*u %" G_GUINT64_FORMAT, &r, &s) == 2)
+		{
+			*received += r;
+			*sent += s;
+		}
+	}
+	g_strfreev(lines);
+	return TRUE;
+}
+
+gboolean hoststat_disks(guint64 *read, guint64 *written)
+{
+	char *contents = NULL;
+	if(!g_file_get_contents("/proc/diskstats", &contents, NULL, NULL))
+		return FALSE;
+	*read = *written = 0;
+	char **lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+	for(size_t i=0; lines[i]!=NULL; ++i)
+	{
+		// "<major> <minor> <name> <reads> <merged> <sectors read> <ms>
+		//  <writes> <merged> <sectors written> ..."
+		char name[64];
+		guint64 r, w;
+		if(sscanf(lines[i], "%*u %*u %63s %*u %*u %" G_GUINT64_FORMAT " %*u %*u %*u %" G_GUINT64_FORMAT, name, &r, &w) != 3)
+			continue;
+		// Whole disks are the ones in /sys/block
+		char *path = g_build_path("/", "/sys/block", name, NULL);
+		if(g_file_test(path, G_FILE_TEST_EXISTS))
+		{
+			*read += r * SECTOR_SIZE;
+			*written += w * SECTOR_SIZE;
+		}
+		g_free(path);
+	}
+	g_strfreev(lines);
+	return TRUE;
+}
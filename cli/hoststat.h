@@ -0,0 +1,23 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Reads the host's network and disk counters from /proc, for the trace
+ * and progress reports to work out throughput from.
+ */
+
+#include <glib.h>
+
+/*
+ * Stores the bytes received and sent over every interface but loopback
+ * since boot. Returns FALSE if they can't be read.
+ */
+gboolean hoststat_network(guint64 *received, guint64 *sent);
+
+/*
+ * Stores the bytes read from and written to every whole disk (not
+ * counting partitions twice) since boot. Returns FALSE if they can't
+ * be read.
+ */
+gboolean hoststat_disks(guint64 *read, guint64 *written);
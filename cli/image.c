@@ -0,0 +1,111 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * A disk image file standing in for the destination partition.
+ */
+
+#include "image.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/loop.h>
+
+// Where an ext2/3/4 superblock's magic number is, and what it is
+#define EXT4_MAGIC_OFFSET 1080
+#define EXT4_MAGIC 0xEF53
+
+gboolean image_create(const char *path, guint64 size, gboolean *created)
+{
+	int fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	if(fd < 0)
+		return FALSE;
+	struct stat st;
+	gboolean ok = (fstat(fd, &st) == 0);
+	if(ok)
+		*created = (st.st_size == 0);
+	// Extending it with ftruncate leaves a hole, rather than writing zeros
+	if(ok && (guint64)st.st_size < size)
+		ok = (ftruncate(fd, size) == 0);
+	int err = errno;
+	close(fd);
+	errno = err;
+	return ok;
+}
+
+GHashTable * image_properties(const char *path)
+{
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	if(fd < 0)
+		return NULL;
+	struct stat st;
+	if(fstat(fd, &st))
+	{
+		close(fd);
+		return NULL;
+	}
+	unsigned char magic[2] = {0};
+	bool ext4 = (pread(fd, magic, 2, EXT4_MAGIC_OFFSET) == 2 && (magic[0] | magic[1] << 8) == EXT4_MAGIC);
+	close(fd);
+
+	GHashTable *props = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+	// From the file's identity, so it stays the same between runs
+	char *key = g_strdup_printf("%lu:%lu", (unsigned long)st.st_dev, (unsigned long)st.st_ino);
+	char *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA256, key, -1);
+	g_hash_table_insert(props, "ID_PART_ENTRY_UUID",
+		g_strdup_printf("%.8s-%.4s-%.4s-%.4s-%.12s", hash, hash + 8, hash + 12, hash + 16, hash + 20));
+	g_hash_table_insert(props, "ID_PART_ENTRY_SIZE", g_strdup_printf("%llu", (unsigned long long)st.st_size / 512));
+	if(ext4)
+		g_hash_table_insert(props, "ID_FS_TYPE", g_strdup("ext4"));
+	g_free(hash);
+	g_free(key);
+	return props;
+}
+
+char * image_attach(const char *path)
+{
+	int control = open("/dev/loop-control", O_RDWR|O_CLOEXEC);
+	if(control < 0)
+		return NULL;
+	int num = ioctl(control, LOOP_CTL_GET_FREE);
+	int err = errno;
+	close(control);
+	if(num < 0)
+	{
+		errno = err;
+		return NULL;
+	}
+
+	char *loop = g_strdup_printf("/dev/loop%i", num);
+	int loopfd = open(loop, O_RDWR|O_CLOEXEC);
+	int fd = open(path, O_RDWR|O_CLOEXEC);
+	struct loop_info64 info = {0};
+	info.lo_flags = LO_FLAGS_AUTOCLEAR;
+	g_strlcpy((char *)info.lo_file_name, path, LO_NAME_SIZE);
+	bool ok = (loopfd >= 0 && fd >= 0 && ioctl(loopfd, LOOP_SET_FD, fd) == 0);
+	if(ok && ioctl(loopfd, LOOP_SET_STATUS64, &info))
+	{
+		err = errno;
+		ioctl(loopfd, LOOP_CLR_FD, 0);
+		errno = err;
+		ok = false;
+	}
+	err = errno;
+	if(fd >= 0)
+		close(fd);
+	if(loopfd >= 0)
+		close(loopfd);
+	if(!ok)
+	{
+		g_free(loop);
+		errno = err;
+		return NULL;
+	}
+	return loop;
+}
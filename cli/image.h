@@ -0,0 +1,34 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * A disk image file standing in for the destination partition, so the
+ * real install steps can be run (and timed) on a build machine, without
+ * root and without touching a disk.
+ */
+
+#include <glib.h>
+
+/*
+ * Makes the (sparse) image file at path at least size bytes. Stores in
+ * created whether it was new (or empty), so has no filesystem yet.
+ * Returns FALSE on failure.
+ */
+gboolean image_create(const char *path, guint64 size, gboolean *created);
+
+/*
+ * Returns the udev properties a partition holding the image's contents
+ * would have: ID_PART_ENTRY_UUID (made up, but the same for the same
+ * file), ID_PART_ENTRY_SIZE (in 512 byte sectors) and ID_FS_TYPE (if
+ * it holds an ext4 filesystem). Free with g_hash_table_unref. Returns
+ * NULL on failure.
+ */
+GHashTable * image_properties(const char *path);
+
+/*
+ * Attaches the image to a free loop device, which detaches itself once
+ * it's unmounted, and returns its path. Free with g_free. Only root
+ * (outside a user namespace) can; returns NULL with errno set otherwise.
+ */
+char * image_attach(const char *path);
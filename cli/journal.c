@@ -0,0 +1,166 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * A journal of completed install steps, kept on the target.
+ */
+
+#include "journal.h"
+#include "output.h"
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define JOURNAL_HEADER "# vos-installer journal 1\n"
+
+struct _Journal
+{
+	GMutex lock;
+	GHashTable *entries; // "<step> <hash>" set
+	GPtrArray *unwritten; // Entries recorded before attaching
+	int fd;
+};
+
+Journal * journal_new(void)
+{
+	Journal *journal = g_new0(Journal, 1);
+	g_mutex_init(&journal->lock);
+	journal->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	journal->unwritten = g_ptr_array_new_with_free_func(g_free);
+	journal->fd = -1;
+	return journal;
+}
+
+void journal_free(Journal *journal)
+{
+	if(!journal)
+		return;
+	if(journal->fd >= 0)
+		close(journal->fd);
+	g_hash_table_unref(journal->entries);
+	g_ptr_array_unref(journal->unwritten);
+	g_mutex_clear(&journal->lock);
+	g_free(journal);
+}
+
+// Called with the lock held
+static void load(Journal *journal, const char *path)
+{
+	char *contents = NULL;
+	if(!g_file_get_contents(path, &contents, NULL, NULL))
+		return;
+	if(!g_str_has_prefix(contents, JOURNAL_HEADER))
+	{
+		output_println("Ignoring unknown journal %s", path);
+		g_free(contents);
+		return;
+	}
+
+	char **lines = g_strsplit(contents + strlen(JOURNAL_HEADER), "\n", -1);
+	g_free(contents);
+	for(size_t i=0; lines[i]!=NULL; ++i)
+		if(lines[i][0] != '\0' && lines[i][0] != '#')
+			g_hash_table_add(journal->entries, g_strdup(lines[i]));
+	g_strfreev(lines);
+}
+
+void journal_load(Journal *journal, const char *path)
+{
+	g_return_if_fail(journal && path);
+	g_mutex_lock(&journal->lock);
+	load(journal, path);
+	g_mutex_unlock(&journal->lock);
+}
+
+void journal_clear(Journal *journal)
+{
+	g_return_if_fail(journal);
+	g_mutex_lock(&journal->lock);
+	g_hash_table_remove_all(journal->entries);
+	for(guint i=0; i<journal->unwritten->len; ++i)
+		g_hash_table_add(journal->entries, g_strdup(g_ptr_array_index(journal->unwritten, i)));
+	g_mutex_unlock(&journal->lock);
+}
+
+// Appends an entry to the file and syncs it. Called with the lock held.
+static void write_entry(Journal *journal, const char *entry)
+{
+	char *line = g_strconcat(entry, "\n", NULL);
+	ssize_t length = strlen(line);
+	if(write(journal->fd, line, length) != length || fdatasync(journal->fd))
+		output_println("Warning: Failed to write to the install journal");
+	g_free(line);
+}
+
+gboolean journal_attach(Journal *journal, const char *path)
+{
+	g_return_val_if_fail(journal && path, FALSE);
+
+	char *dir = g_path_get_dirname(path);
+	int r = g_mkdir_with_parents(dir, 0755);
+	g_free(dir);
+	int fd = r ? -1 : open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0600);
+	if(fd < 0)
+		return FALSE;
+
+	g_mutex_lock(&journal->lock);
+	if(journal->fd >= 0)
+		close(journal->fd);
+	journal->fd = fd;
+
+	struct stat st;
+	if(fstat(fd, &st) == 0 && st.st_size == 0)
+	{
+		ssize_t length = strlen(JOURNAL_HEADER);
+		if(write(fd, JOURNAL_HEADER, length) != length)
+			output_println("Warning: Failed to write to the install journal");
+	}
+	else
+		load(journal, path);
+
+	for(guint i=0; i<journal->unwritten->len; ++i)
+		write_entry(journal, g_ptr_array_index(journal->unwritten, i));
+	g_ptr_array_set_size(journal->unwritten, 0);
+	g_mutex_unlock(&journal->lock);
+	return TRUE;
+}
+
+void journal_detach(Journal *journal)
+{
+	g_return_if_fail(journal);
+	g_mutex_lock(&journal->lock);
+	if(journal->fd >= 0)
+		close(journal->fd);
+	journal->fd = -1;
+	g_mutex_unlock(&journal->lock);
+}
+
+gboolean journal_contains(Journal *journal, const char *step, const char *hash)
+{
+	g_return_val_if_fail(journal && step && hash, FALSE);
+	char *entry = g_strdup_printf("%s %s", step, hash);
+	g_mutex_lock(&journal->lock);
+	gboolean found = g_hash_table_contains(journal->entries, entry);
+	g_mutex_unlock(&journal->lock);
+	g_free(entry);
+	return found;
+}
+
+void journal_record(Journal *journal, const char *step, const char *hash)
+{
+	g_return_if_fail(journal && step && hash);
+	char *entry = g_strdup_printf("%s %s", step, hash);
+	g_mutex_lock(&journal->lock);
+	g_hash_table_add(journal->entries, g_strdup(entry));
+	if(journal->fd >= 0)
+	{
+		write_entry(journal, entry);
+		g_free(entry);
+	}
+	else
+		g_ptr_array_add(journal->unwritten, entry);
+	g_mutex_unlock(&journal->lock);
+}
@@ -0,0 +1,48 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * A journal of completed install steps, kept on the target, so that an
+ * install can pick up where a failed one stopped. Each entry is a step
+ * name and a hash of what the step's result depends on.
+ */
+
+#include <glib.h>
+
+typedef struct _Journal Journal;
+
+Journal * journal_new(void);
+void journal_free(Journal *journal);
+
+/*
+ * Adds the entries of the journal file at path, if there is one.
+ */
+void journal_load(Journal *journal, const char *path);
+
+/*
+ * Forgets every entry, such as after the target is reformatted.
+ */
+void journal_clear(Journal *journal);
+
+/*
+ * Loads the journal file at path (creating it if necessary), writes the
+ * entries recorded so far to it, and keeps it open so later entries are
+ * written as they're recorded. The file stays usable after a chroot.
+ * Returns FALSE if it can't be opened.
+ */
+gboolean journal_attach(Journal *journal, const char *path);
+
+/*
+ * Closes the journal file, such as before the target is unmounted.
+ * Entries recorded after this are only kept in memory.
+ */
+void journal_detach(Journal *journal);
+
+gboolean journal_contains(Journal *journal, const char *step, const char *hash);
+
+/*
+ * Adds an entry, and writes it out (and syncs it) if the journal is
+ * attached to a file.
+ */
+void journal_record(Journal *journal, const char *step, const char *hash);
@@ -0,0 +1,24 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Writes JSON.
+ */
+
+#include "json.h"
+
+void json_append_string(GString *json, const char *str)
+{
+	g_string_append_c(json, '"');
+	for(const unsigned char *c=(const unsigned char *)str; *c; ++c)
+	{
+		if(*c == '"' || *c == '\\')
+			g_string_append_printf(json, "\\%c", *c);
+		else if(*c < 0x20)
+			g_string_append_printf(json, "\\u%04x", *c);
+		else
+			g_string_append_c(json, *c);
+	}
+	g_string_append_c(json, '"');
+}
@@ -0,0 +1,14 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Writes JSON, for the trace and progress reports.
+ */
+
+#include <glib.h>
+
+/*
+ * Appends str to json as a JSON string, quoted and escaped.
+ */
+void json_append_string(GString *json, const char *str);
@@ -0,0 +1,331 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Fetches PGP public keys from keyservers into an on-disk key cache.
+ */
+
+#include "keys.h"
+#include "fetch.h"
+#include "output.h"
+#include <string.h>
+#include <curl/curl.h>
+
+// Seconds before a keyserver is given up on
+#define KEYSERVER_TIMEOUT 30L
+
+#define KEY_BLOCK_HEADER "-----BEGIN PGP PUBLIC KEY BLOCK-----"
+#define KEY_BLOCK_FOOTER "-----END PGP PUBLIC KEY BLOCK-----"
+
+// OpenPGP packet tag of a (primary) public key
+#define PUBLIC_KEY_TAG 6
+
+typedef struct
+{
+	const char *fingerprint;
+	char *path;
+	bool done;
+} Key;
+
+typedef struct
+{
+	Key *key;
+	const char *keyserver;
+	CURL *easy;
+	GString *data;
+} Request;
+
+char * keys_get_path(const char *cacheDir, const char *fingerprint)
+{
+	g_return_val_if_fail(cacheDir && fingerprint, NULL);
+	char *name = g_strconcat(fingerprint, ".asc", NULL);
+	char *path = g_build_path("/", cacheDir, name, NULL);
+	g_free(name);
+	return path;
+}
+
+// Returns the HKP lookup URL for fingerprint on keyserver. Free with g_free.
+static char * lookup_url(const char *keyserver, const char *fingerprint)
+{
+	char *base;
+	if(g_str_has_prefix(keyserver, "hkps://"))
+		base = g_strconcat("https://", keyserver + strlen("hkps://"), NULL);
+	else if(g_str_has_prefix(keyserver, "hkp://"))
+	{
+		// Plain HKP has its own port, unless one is given
+		const char *host = keyserver + strlen("hkp://");
+		base = strchr(host, ':')
+			? g_strconcat("http://", host, NULL)
+			: g_strconcat("http://", host, ":11371", NULL);
+	}
+	else
+		base = g_strdup(keyserver);
+
+	char *url = g_strdup_printf("%s/pks/lookup?op=get&options=mr&search=0x%s", base, fingerprint);
+	g_free(base);
+	return url;
+}
+
+// Decodes the armored key block in text. Returns NULL unless there's
+// exactly one. Free with g_free.
+static guchar * dearmor(const char *text, gsize *len)
+{
+	const char *start = strstr(text, KEY_BLOCK_HEADER);
+	if(!start || strstr(start + 1, KEY_BLOCK_HEADER))
+		return NULL;
+	const char *end = strstr(start, KEY_BLOCK_FOOTER);
+	if(!end)
+		return NULL;
+
+	char *block = g_strndup(start, end - start);
+	char **lines = g_strsplit(block, "\n", -1);
+	GString *base64 = g_string_new(NULL);
+	bool headers = true;
+	for(guint i=1; lines[i]; ++i)
+	{
+		char *line = g_strstrip(lines[i]);
+		// Armor headers ("Key: Value") end at an empty line
+		if(headers && (*line == '\0' || strchr(line, ':')))
+			continue;
+		headers = false;
+		if(*line == '=') // Checksum
+			break;
+		g_string_append(base64, line);
+	}
+
+	guchar *data = g_base64_decode(base64->str, len);
+	g_string_free(base64, TRUE);
+	g_strfreev(lines);
+	g_free(block);
+	return data;
+}
+
+// Returns whether the v4 public key packet body of size bytes has the
+// fingerprint fingerprint (in hex, any case)
+static bool fingerprint_matches(const guchar *body, gsize size, const char *fingerprint)
+{
+	if(size == 0 || size > 0xffff || body[0] != 4)
+		return false;
+	GChecksum *sha1 = g_checksum_new(G_CHECKSUM_SHA1);
+	guchar prefix[] = {0x99, size >> 8, size & 0xff};
+	g_checksum_update(sha1, prefix, sizeof(prefix));
+	g_checksum_update(sha1, body, size);
+	bool matches = g_ascii_strcasecmp(g_checksum_get_string(sha1), fingerprint) == 0;
+	g_checksum_free(sha1);
+	return matches;
+}
+
+// Returns whether text is an armored block of exactly one public key,
+// with the fingerprint fingerprint, so a keyserver can't slip in any
+// other key. Its subkeys, user IDs and signatures can be anything.
+static bool verify_key(const char *text, const char *fingerprint)
+{
+	gsize len = 0;
+	guchar *data = dearmor(text, &len);
+	if(!data)
+		return false;
+
+	guint keys = 0;
+	bool matches = false;
+	bool valid = true;
+	gsize pos = 0;
+	while(valid && pos < len)
+	{
+		guint8 first = data[pos++];
+		guint tag;
+		gsize size = 0;
+		if(!(first & 0x80))
+			valid = false;
+		else if(first & 0x40) // New packet format
+		{
+			tag = first & 0x3f;
+			guint8 octet = (pos < len) ? data[pos++] : 224;
+			if(octet < 192)
+				size = octet;
+			else if(octet < 224 && pos < len)
+				size = ((octet - 192) << 8) + data[pos++] + 192;
+			else if(octet == 255 && len - pos >= 4)
+				for(guint i=0; i<4; ++i)
+					size = (size << 8) | data[pos++];
+			else // Keys can't have partial lengths
+				valid = false;
+		}
+		else // Old packet format
+		{
+			tag = (first >> 2) & 0xf;
+			guint octets = 1 << (first & 3);
+			if((first & 3) == 3 || len - pos < octets) // Indeterminate length
+				valid = false;
+			else
+				for(guint i=0; i<octets; ++i)
+					size = (size << 8) | data[pos++];
+		}
+
+		if(!valid || size > len - pos)
+			valid = false;
+		else if(tag == PUBLIC_KEY_TAG && ++keys == 1)
+			matches = fingerprint_matches(data + pos, size, fingerprint);
+		pos += size;
+	}
+
+	g_free(data);
+	return valid && keys == 1 && matches;
+}
+
+// Returns whether a good key for fingerprint is cached at path
+static bool is_cached(const char *path, const char *fingerprint)
+{
+	char *text = NULL;
+	if(!g_file_get_contents(path, &text, NULL, NULL))
+		return false;
+	bool valid = verify_key(text, fingerprint);
+	g_free(text);
+	return valid;
+}
+
+static size_t on_write(char *data, size_t size, size_t nmemb, void *userdata)
+{
+	Request *request = userdata;
+	g_string_append_len(request->data, data, size * nmemb);
+	return size * nmemb;
+}
+
+static void end_request(CURLM *multi, Request *request)
+{
+	curl_multi_remove_handle(multi, request->easy);
+	curl_easy_cleanup(request->easy);
+	request->easy = NULL;
+}
+
+guint keys_fetch(const char * const *fingerprints, const char * const *keyservers, const char *cacheDir, const volatile bool *cancel)
+{
+	g_return_val_if_fail(fingerprints && cacheDir, 0);
+
+	guint numKeys = g_strv_length((char **)fingerprints);
+	Key *keys = g_new0(Key, numKeys);
+	guint missing = 0;
+	for(guint i=0; i<numKeys; ++i)
+	{
+		keys[i].fingerprint = fingerprints[i];
+		keys[i].path = keys_get_path(cacheDir, fingerprints[i]);
+		keys[i].done = is_cached(keys[i].path, fingerprints[i]);
+		if(!keys[i].done)
+			++missing;
+	}
+
+	guint numServers = keyservers ? g_strv_length((char **)keyservers) : 0;
+	if(missing == 0 || numServers == 0 || g_mkdir_with_parents(cacheDir, 0755))
+		goto out;
+
+	fetch_init_curl();
+
+	CURLM *multi = curl_multi_init();
+	if(!multi)
+		goto out;
+
+	// Every missing key from every keyserver at once
+	output_println("Requesting %u keys from %u keyservers", missing, numServers);
+	GPtrArray *requests = g_ptr_array_new();
+	for(guint i=0; i<numKeys; ++i)
+	{
+		if(keys[i].done)
+			continue;
+		for(guint j=0; j<numServers; ++j)
+		{
+			Request *request = g_new0(Request, 1);
+			request->key = &keys[i];
+			request->keyserver = keyservers[j];
+			request->data = g_string_new(NULL);
+			request->easy = curl_easy_init();
+			if(!request->easy)
+			{
+				g_string_free(request->data, TRUE);
+				g_free(request);
+				continue;
+			}
+
+			char *url = lookup_url(keyservers[j], keys[i].fingerprint);
+			curl_easy_setopt(request->easy, CURLOPT_URL, url);
+			curl_easy_setopt(request->easy, CURLOPT_WRITEFUNCTION, on_write);
+			curl_easy_setopt(request->easy, CURLOPT_WRITEDATA, request);
+			curl_easy_setopt(request->easy, CURLOPT_PRIVATE, request);
+			curl_easy_setopt(request->easy, CURLOPT_FOLLOWLOCATION, 1L);
+			curl_easy_setopt(request->easy, CURLOPT_FAILONERROR, 1L);
+			curl_easy_setopt(request->easy, CURLOPT_NOSIGNAL, 1L);
+			curl_easy_setopt(request->easy, CURLOPT_TIMEOUT, KEYSERVER_TIMEOUT);
+			curl_easy_setopt(request->easy, CURLOPT_USERAGENT, "vos-install-cli");
+			curl_multi_add_handle(multi, request->easy);
+			g_ptr_array_add(requests, request);
+			g_free(url);
+		}
+	}
+
+	int running = 1;
+	while(running > 0 && missing > 0 && !(cancel && *cancel))
+	{
+		curl_multi_perform(multi, &running);
+
+		CURLMsg *msg;
+		int queued;
+		while((msg = curl_multi_info_read(multi, &queued)))
+		{
+			if(msg->msg != CURLMSG_DONE)
+				continue;
+			Request *request = NULL;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&request);
+			CURLcode result = msg->data.result;
+			end_request(multi, request);
+
+			Key *key = request->key;
+			if(key->done)
+				continue;
+			if(result != CURLE_OK || !strstr(request->data->str, KEY_BLOCK_HEADER))
+			{
+				output_println("Key %s not found on %s", key->fingerprint, request->keyserver);
+				continue;
+			}
+			if(!verify_key(request->data->str, key->fingerprint))
+			{
+				output_println("Ignoring the key from %s, which isn't only %s", request->keyserver, key->fingerprint);
+				continue;
+			}
+			if(!g_file_set_contents(key->path, request->data->str, request->data->len, NULL))
+			{
+				output_println("Failed to write %s", key->path);
+				continue;
+			}
+
+			// First to answer wins; stop asking the others
+			output_println("Got key %s from %s", key->fingerprint, request->keyserver);
+			key->done = true;
+			--missing;
+			for(guint i=0; i<requests->len; ++i)
+			{
+				Request *other = g_ptr_array_index(requests, i);
+				if(other->key == key && other->easy)
+					end_request(multi, other);
+			}
+		}
+
+		if(running > 0 && missing > 0)
+			curl_multi_poll(multi, NULL, 0, 100, NULL);
+	}
+
+	for(guint i=0; i<requests->len; ++i)
+	{
+		Request *request = g_ptr_array_index(requests, i);
+		if(request->easy)
+			end_request(multi, request);
+		g_string_free(request->data, TRUE);
+		g_free(request);
+	}
+	g_ptr_array_free(requests, TRUE);
+	curl_multi_cleanup(multi);
+
+out:
+	for(guint i=0; i<numKeys; ++i)
+		g_free(keys[i].path);
+	g_free(keys);
+	return missing;
+}
@@ -0,0 +1,28 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Fetches PGP public keys from keyservers into an on-disk key cache, so
+ * that later installs don't need the network for them.
+ */
+
+#include <glib.h>
+#include <stdbool.h>
+
+/*
+ * Returns the path of the cached key file for fingerprint in cacheDir.
+ * The file may not exist. Free with g_free.
+ */
+char * keys_get_path(const char *cacheDir, const char *fingerprint);
+
+/*
+ * Makes sure every fingerprint in the NULL-terminated list has a key in
+ * cacheDir. Missing keys are requested from every keyserver (hkp://,
+ * hkps://, http:// or https:// URLs) at once, and the first reply that
+ * holds that key and no other is kept. Cached keys are checked the same
+ * way, and fetched again if they don't pass. With no keyservers (NULL),
+ * only checks the cache. Stops early if *cancel becomes true. Returns
+ * the number of keys still missing.
+ */
+guint keys_fetch(const char * const *fingerprints, const char * const *keyservers, const char *cacheDir, const volatile bool *cancel);
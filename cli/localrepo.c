@@ -0,0 +1,411 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Builds a pacman repository out of a directory of packages.
+ */
+
+#include "localrepo.h"
+#include "pkgcache.h"
+#include "output.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <archive.h>
+#include <archive_entry.h>
+
+// Fields of a package's .PKGINFO, and the database field each becomes
+static const char *kFields[][2] =
+{
+	{"pkgname", "NAME"},
+	{"pkgbase", "BASE"},
+	{"pkgver", "VERSION"},
+	{"pkgdesc", "DESC"},
+	{"group", "GROUPS"},
+	{"size", "ISIZE"},
+	{"url", "URL"},
+	{"license", "LICENSE"},
+	{"arch", "ARCH"},
+	{"builddate", "BUILDDATE"},
+	{"packager", "PACKAGER"},
+	{"replaces", "REPLACES"},
+	{"conflict", "CONFLICTS"},
+	{"provides", "PROVIDES"},
+	{"depend", "DEPENDS"},
+	{"optdepend", "OPTDEPENDS"},
+	{"makedepend", "MAKEDEPENDS"},
+	{"checkdepend", "CHECKDEPENDS"},
+};
+
+#define NUM_FIELDS (sizeof(kFields) / sizeof(kFields[0]))
+
+typedef struct
+{
+	char *path;
+	char *filename;
+	GPtrArray *values[NUM_FIELDS]; // From .PKGINFO
+	char *sha256;
+	char *pgpsig; // Base64, or NULL
+	guint64 csize;
+	bool ok;
+} Entry;
+
+static void free_entry(Entry *entry)
+{
+	g_free(entry->path);
+	g_free(entry->filename);
+	for(size_t i=0; i<NUM_FIELDS; ++i)
+		if(entry->values[i])
+			g_ptr_array_unref(entry->values[i]);
+	g_free(entry->sha256);
+	g_free(entry->pgpsig);
+	g_free(entry);
+}
+
+static const char * get_value(Entry *entry, const char *field)
+{
+	for(size_t i=0; i<NUM_FIELDS; ++i)
+		if(g_strcmp0(kFields[i][0], field) == 0)
+			return (entry->values[i] && entry->values[i]->len > 0) ? g_ptr_array_index(entry->values[i], 0) : NULL;
+	return NULL;
+}
+
+// Parses the "key = value" lines of a .PKGINFO into entry
+static void parse_pkginfo(Entry *entry, const char *pkginfo)
+{
+	char **lines = g_strsplit(pkginfo, "\n", -1);
+	for(size_t i=0; lines[i]!=NULL; ++i)
+	{
+		if(lines[i][0] == '#')
+			continue;
+		char **kv = g_strsplit(lines[i], " = ", 2);
+		if(g_strv_length(kv) == 2)
+		{
+			for(size_t j=0; j<NUM_FIELDS; ++j)
+			{
+				if(g_strcmp0(kv[0], kFields[j][0]) != 0)
+					continue;
+				if(!entry->values[j])
+					entry->values[j] = g_ptr_array_new_with_free_func(g_free);
+				g_ptr_array_add(entry->values[j], g_strdup(kv[1]));
+				break;
+			}
+		}
+		g_strfreev(kv);
+	}
+	g_strfreev(lines);
+}
+
+// Reads the .PKGINFO out of the package. Returns NULL if it has none.
+static char * read_pkginfo(const char *path)
+{
+	struct archive *a = archive_read_new();
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+	if(archive_read_open_filename(a, path, 65536) != ARCHIVE_OK)
+	{
+		archive_read_free(a);
+		return NULL;
+	}
+
+	GString *pkginfo = NULL;
+	struct archive_entry *ae;
+	while(archive_read_next_header(a, &ae) == ARCHIVE_OK)
+	{
+		if(g_strcmp0(archive_entry_pathname(ae), ".PKGINFO") != 0)
+			continue;
+
+		pkginfo = g_string_new(NULL);
+		char buf[8192];
+		la_ssize_t num;
+		while((num = archive_read_data(a, buf, sizeof(buf))) > 0)
+			g_string_append_len(pkginfo, buf, num);
+		if(num < 0)
+		{
+			g_string_free(pkginfo, TRUE);
+			pkginfo = NULL;
+		}
+		break;
+	}
+	archive_read_free(a);
+	return pkginfo ? g_string_free(pkginfo, FALSE) : NULL;
+}
+
+// Reads one package. Runs on the thread pool.
+static void read_entry(Entry *entry, UNUSED gpointer data)
+{
+	char *pkginfo = read_pkginfo(entry->path);
+	if(!pkginfo)
+	{
+		output_println("Failed to read package info from %s", entry->filename);
+		return;
+	}
+	parse_pkginfo(entry, pkginfo);
+	g_free(pkginfo);
+
+	int fd = open(entry->path, O_RDONLY|O_CLOEXEC);
+	if(fd < 0)
+		return;
+	struct stat st;
+	if(fstat(fd, &st) == 0)
+		entry->csize = st.st_size;
+
+	GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	guchar buf[65536];
+	ssize_t num;
+	while((num = read(fd, buf, sizeof(buf))) > 0)
+		g_checksum_update(checksum, buf, num);
+	close(fd);
+	if(num == 0)
+		entry->sha256 = g_strdup(g_checksum_get_string(checksum));
+	g_checksum_free(checksum);
+
+	char *sigpath = g_strconcat(entry->path, ".sig", NULL);
+	char *sig = NULL;
+	gsize siglen = 0;
+	if(g_file_get_contents(sigpath, &sig, &siglen, NULL))
+		entry->pgpsig = g_base64_encode((const guchar *)sig, siglen);
+	g_free(sig);
+	g_free(sigpath);
+
+	entry->ok = (entry->sha256 && get_value(entry, "pkgname") && get_value(entry, "pkgver"));
+}
+
+static void append_field(GString *desc, const char *field, const char *value)
+{
+	if(value)
+		g_string_append_printf(desc, "%%%s%%\n%s\n\n", field, value);
+}
+
+// Returns the contents of the package's desc file in the database
+static GString * build_desc(Entry *entry)
+{
+	GString *desc = g_string_new(NULL);
+	char *csize = g_strdup_printf("%" G_GUINT64_FORMAT, entry->csize);
+	append_field(desc, "FILENAME", entry->filename);
+	append_field(desc, "CSIZE", csize);
+	append_field(desc, "SHA256SUM", entry->sha256);
+	append_field(desc, "PGPSIG", entry->pgpsig);
+	g_free(csize);
+
+	for(size_t i=0; i<NUM_FIELDS; ++i)
+	{
+		GPtrArray *values = entry->values[i];
+		if(!values || values->len == 0)
+			continue;
+		g_string_append_printf(desc, "%%%s%%\n", kFields[i][1]);
+		for(guint j=0; j<values->len; ++j)
+			g_string_append_printf(desc, "%s\n", (char *)g_ptr_array_index(values, j));
+		g_string_append(desc, "\n");
+	}
+	return desc;
+}
+
+static bool write_archive_entry(struct archive *a, const char *path, mode_t type, const char *data, size_t size)
+{
+	struct archive_entry *ae = archive_entry_new();
+	archive_entry_set_pathname(ae, path);
+	archive_entry_set_filetype(ae, type);
+	archive_entry_set_perm(ae, type == AE_IFDIR ? 0755 : 0644);
+	archive_entry_set_size(ae, size);
+	archive_entry_set_mtime(ae, time(NULL), 0);
+	bool ok = (archive_write_header(a, ae) == ARCHIVE_OK
+		&& (size == 0 || archive_write_data(a, data, size) == (la_ssize_t)size));
+	archive_entry_free(ae);
+	return ok;
+}
+
+// Writes the entries into a gzipped database at path
+static bool write_database(const char *path, GPtrArray *entries)
+{
+	struct archive *a = archive_write_new();
+	archive_write_add_filter_gzip(a);
+	archive_write_set_format_pax_restricted(a);
+	if(archive_write_open_filename(a, path) != ARCHIVE_OK)
+	{
+		archive_write_free(a);
+		return false;
+	}
+
+	bool ok = true;
+	for(guint i=0; ok && i<entries->len; ++i)
+	{
+		Entry *entry = g_ptr_array_index(entries, i);
+		char *dirname = g_strdup_printf("%s-%s/", get_value(entry, "pkgname"), get_value(entry, "pkgver"));
+		char *descname = g_strconcat(dirname, "desc", NULL);
+		GString *desc = build_desc(entry);
+		ok = write_archive_entry(a, dirname, AE_IFDIR, NULL, 0)
+			&& write_archive_entry(a, descname, AE_IFREG, desc->str, desc->len);
+		g_string_free(desc, TRUE);
+		g_free(descname);
+		g_free(dirname);
+	}
+
+	ok = (archive_write_close(a) == ARCHIVE_OK) && ok;
+	archive_write_free(a);
+	return ok;
+}
+
+static gint compare_entry(gconstpointer a, gconstpointer b)
+{
+	Entry *ea = *(Entry **)a;
+	Entry *eb = *(Entry **)b;
+	gint cmp = g_strcmp0(get_value(ea, "pkgname"), get_value(eb, "pkgname"));
+	if(cmp != 0)
+		return cmp;
+	// Newest build first
+	guint64 da = g_ascii_strtoull(get_value(ea, "builddate") ?: "0", NULL, 10);
+	guint64 db = g_ascii_strtoull(get_value(eb, "builddate") ?: "0", NULL, 10);
+	return (da < db) - (da > db);
+}
+
+int localrepo_build(const char *dir, const char *name)
+{
+	g_return_val_if_fail(dir && name, -1);
+
+	GDir *gdir = g_dir_open(dir, 0, NULL);
+	if(!gdir)
+	{
+		output_println("Failed to open %s", dir);
+		return -1;
+	}
+
+	GPtrArray *entries = g_ptr_array_new_with_free_func((GDestroyNotify)free_entry);
+	const char *filename;
+	while((filename = g_dir_read_name(gdir)))
+	{
+		if(!pkgcache_is_package_file(filename))
+			continue;
+		Entry *entry = g_new0(Entry, 1);
+		entry->path = g_build_path("/", dir, filename, NULL);
+		entry->filename = g_strdup(filename);
+		g_ptr_array_add(entries, entry);
+	}
+	g_dir_close(gdir);
+
+	output_println("Reading %u packages in %s...", entries->len, dir);
+	gint64 start = g_get_monotonic_time();
+	GThreadPool *pool = g_thread_pool_new((GFunc)read_entry, NULL, g_get_num_processors(), TRUE, NULL);
+	for(guint i=0; i<entries->len; ++i)
+		g_thread_pool_push(pool, g_ptr_array_index(entries, i), NULL);
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	// Drop unreadable packages, and all but the newest of each name
+	for(guint i=0; i<entries->len;)
+	{
+		if(((Entry *)g_ptr_array_index(entries, i))->ok)
+			++i;
+		else
+			g_ptr_array_remove_index(entries, i);
+	}
+	g_ptr_array_sort(entries, compare_entry);
+	for(guint i=1; i<entries->len;)
+	{
+		Entry *prev = g_ptr_array_index(entries, i-1);
+		Entry *entry = g_ptr_array_index(entries, i);
+		if(g_strcmp0(get_value(prev, "pkgname"), get_value(entry, "pkgname")) == 0)
+			g_ptr_array_remove_index(entries, i);
+		else
+			++i;
+	}
+
+	char *dbname = g_strconcat(name, ".db.tar.gz", NULL);
+	char *dbpath = g_build_path("/", dir, dbname, NULL);
+	char *tmppath = g_strconcat(dbpath, ".tmp", NULL);
+	char *linkname = g_strconcat(name, ".db", NULL);
+	char *linkpath = g_build_path("/", dir, linkname, NULL);
+
+	int count = entries->len;
+	if(!write_database(tmppath, entries) || rename(tmppath, dbpath) != 0)
+	{
+		output_println("Failed to write %s", dbpath);
+		unlink(tmppath);
+		count = -1;
+	}
+	else
+	{
+		unlink(linkpath);
+		if(symlink(dbname, linkpath) != 0)
+		{
+			output_println("Failed to link %s (%i)", linkpath, errno);
+			count = -1;
+		}
+	}
+
+	if(count >= 0)
+		output_println("Wrote %i packages to %s in %.1fs", count, dbpath, (g_get_monotonic_time() - start) / (double)G_USEC_PER_SEC);
+
+	g_free(dbname);
+	g_free(dbpath);
+	g_free(tmppath);
+	g_free(linkname);
+	g_free(linkpath);
+	g_ptr_array_unref(entries);
+	return count;
+}
+
+// Adds the installed sizes in one sync database to sizes
+static void read_database_sizes(const char *path, GHashTable *sizes)
+{
+	struct archive *a = archive_read_new();
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+	if(archive_read_open_filename(a, path, 65536) != ARCHIVE_OK)
+	{
+		archive_read_free(a);
+		return;
+	}
+
+	struct archive_entry *ae;
+	while(archive_read_next_header(a, &ae) == ARCHIVE_OK)
+	{
+		const char *name = archive_entry_pathname(ae);
+		if(!g_str_has_suffix(name, "/desc"))
+			continue;
+
+		GString *desc = g_string_new(NULL);
+		char buf[8192];
+		la_ssize_t num;
+		while((num = archive_read_data(a, buf, sizeof(buf))) > 0)
+			g_string_append_len(desc, buf, num);
+
+		const char *isize = strstr(desc->str, "%ISIZE%\n");
+		if(num == 0 && isize)
+		{
+			guint64 *size = g_new(guint64, 1);
+			*size = g_ascii_strtoull(isize + strlen("%ISIZE%\n"), NULL, 10);
+			g_hash_table_replace(sizes, g_strndup(name, strlen(name) - strlen("/desc")), size);
+		}
+		g_string_free(desc, TRUE);
+	}
+	archive_read_free(a);
+}
+
+GHashTable * localrepo_read_installed_sizes(const char *dir)
+{
+	g_return_val_if_fail(dir, NULL);
+
+	GHashTable *sizes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	GDir *gdir = g_dir_open(dir, 0, NULL);
+	if(!gdir)
+		return sizes;
+
+	const char *filename;
+	while((filename = g_dir_read_name(gdir)))
+	{
+		if(!g_str_has_suffix(filename, ".db"))
+			continue;
+		char *path = g_build_path("/", dir, filename, NULL);
+		read_database_sizes(path, sizes);
+		g_free(path);
+	}
+	g_dir_close(gdir);
+	return sizes;
+}
@@ -0,0 +1,27 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Builds a pacman repository out of a directory of packages, so that an
+ * install can run without a network connection.
+ */
+
+#include <glib.h>
+
+/*
+ * Writes the sync database <name>.db.tar.gz (and the <name>.db symlink
+ * pacman looks for) into dir, listing every package in dir. Packages
+ * are read and checksummed in parallel. If dir holds several versions of
+ * a package, the most recently built is listed. Signatures are included
+ * for packages with a .sig file next to them. Returns the number of
+ * packages listed, or -1 on failure.
+ */
+int localrepo_build(const char *dir, const char *name);
+
+/*
+ * Reads the installed size of every package in the sync databases (the
+ * *.db files) in dir. Returns a table from "<name>-<version>" to a
+ * guint64 size in bytes. Free with g_hash_table_unref.
+ */
+GHashTable * localrepo_read_installed_sizes(const char *dir);
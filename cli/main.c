@@ -57,7 +57,18 @@
  *                   "Name,Server,SigLevel,keys...". Where 'keys' are the
  *                   PGP signing key(s) (full fingerprint only), if any,
  *                   that should be downloaded from a keyserver and added
- *                   to pacman's keyring.
+ *                   to pacman's keyring. Keys for all repos are requested
+ *                   from every keyserver at once while base installs,
+ *                   and kept in a key cache next to --cache (or in
+ *                   /var/cache/vos-installer/keys), so later installs
+ *                   don't download them again.
+ *     --keyserver  A keyserver (hkp://, hkps://, http:// or https://) to
+ *                   get --repo keys from, instead of keyserver.ubuntu.com,
+ *                   keys.openpgp.org and pgp.mit.edu. May be specified
+ *                   multiple times.
+ *     --keyfile  A file of PGP public key(s) to add to pacman's keyring
+ *                   on the target, such as a key a --repo is signed with.
+ *                   May be specified multiple times.
  *     --refind   Install the rEFInd boot manager. This is a UEFI-only
  *                   boot manager. The install updates your UEFI NVRAM
  *                   to make itself the default boot. rEFInd auto-detects
@@ -67,6 +78,145 @@
  *                   determine if the drive is internal or external and
  *                   choose to use refind-install's --root or --usedefault
  *                   flags, respectively.
+ *     --cache     A directory on the host to use as a package cache shared
+ *                   between installs, in the format "Dir,MaxMiB,MaxDays".
+ *                   pacman reads packages from it before downloading, and
+ *                   new downloads are added to it after each transaction.
+ *                   At the end of the install, entries older than MaxDays
+ *                   (default 60) are removed, and then the least recently
+ *                   used entries until it is under MaxMiB (default 10240).
+ *     --seed      A directory of packages, such as the package cache of the
+ *                   live media running the installer. Before each pacman
+ *                   transaction, any packages it needs that are in this
+ *                   directory are copied into the target's package cache
+ *                   (as reflinks where possible), so pacman only downloads
+ *                   the rest.
+ *     --pipeline  Install packages in batches of the given size (default
+ *                   20), in the order pacman would install them, so that
+ *                   dependencies come first. Each batch downloads while
+ *                   the batch before it installs, and the time the two
+ *                   overlapped is reported at the end.
+ *     --fetch     Download packages with the installer's own fetcher
+ *                   instead of pacman, over the given number of connections
+ *                   (default 4). Large packages are split into ranges
+ *                   downloaded in parallel, and partial downloads are kept
+ *                   in the target's package cache, so an aborted install
+ *                   resumes them. Packages are checked against the sync
+ *                   databases' checksums before pacman sees them.
+ *     --mirrors   Before installing packages, probe every server in the
+ *                   host's mirrorlist (commented out ones included) in
+ *                   parallel, and install from the fastest, in the format
+ *                   "Count,MaxHours". The Count (default 5) fastest are
+ *                   written to the target's /etc/pacman.d/mirrorlist too.
+ *                   The ranking is kept in the --cache directory (or in
+ *                   /var/cache/vos-installer) and reused for MaxHours
+ *                   (default 24) unless the host's mirrorlist changes.
+ *     --build-repo  Instead of installing, turn a directory of packages
+ *                   (such as a package cache) into a pacman repository
+ *                   named "offline", for use with --offline. Packages are
+ *                   read and checksummed in parallel. Only the most
+ *                   recently built version of each package is listed.
+ *     --offline   Install from the repository made by --build-repo in the
+ *                   given directory, and nothing else. The internet
+ *                   connection check is skipped, and so are --fetch and
+ *                   --mirrors, so every package must be in the repository.
+ *                   --repo signing keys must be in the key cache already,
+ *                   or given with --keyfile. The target's own pacman.conf
+ *                   is still written as usual.
+ *     --lock      Write the packages installed (name, version, checksum
+ *                   and download URL of each, and which were explicitly
+ *                   installed) to the given file at the end of the
+ *                   package install.
+ *     --from-lock  Install exactly the packages in a file written by
+ *                   --lock, in a single pacman -U transaction, instead of
+ *                   base and <packages>. Dependencies aren't resolved
+ *                   against the sync databases, so every machine
+ *                   installed from the same lockfile gets the same
+ *                   packages. Packages come from --cache, --seed and
+ *                   --offline where possible, and are otherwise
+ *                   downloaded from their recorded URL with the --fetch
+ *                   fetcher. Every package is checked against its
+ *                   recorded checksum.
+ *     --target-cache  What to do with the packages left in the target's
+ *                   package cache once the install is done: "keep" them
+ *                   (the default), "export" them into --cache (renamed
+ *                   into it if it's on the same filesystem, copied
+ *                   otherwise), or "prune" them. Either of the last two
+ *                   leaves the target's package cache empty.
+ *     --resume    Every install keeps a journal of the steps it finished
+ *                   in /var/lib/vos-installer/journal on the target, each
+ *                   with a hash of its inputs (the arguments it uses and
+ *                   the hashes of the steps before it). With --resume,
+ *                   steps the journal of an earlier install to the same
+ *                   <dest> lists with the same hash are skipped, so an
+ *                   install that failed part way picks up where it
+ *                   stopped. This includes --ext4: the volume isn't
+ *                   formatted again. With --lock, packages installed by
+ *                   skipped steps aren't in the lockfile. Setting the
+ *                   passwords always runs again, so they're never part
+ *                   of a hash. Can't be used with --image or --replay.
+ *     --singlesync  Sync the package databases only once. The host's
+ *                   databases are copied to the target first, so if
+ *                   they're up to date nothing is downloaded. If no
+ *                   --repo is given, base and <packages> are installed
+ *                   in a single pacman transaction.
+ *     --step-policy  Step,Timeout,Stall,Retries,Backoff. Limits how long
+ *                   a step (or "all" steps) may take, and how long any
+ *                   command it runs may go without output or reading or
+ *                   writing anything (network traffic included), in
+ *                   seconds, 0 for no limit. A command past either limit
+ *                   is stopped and the step fails. A failed step is run
+ *                   again up to Retries times, waiting Backoff seconds
+ *                   first, doubling for each retry up to an hour.
+ *                   Trailing fields can be left out to keep the defaults
+ *                   (see kPolicies: steps that download are retried
+ *                   twice, and their commands are stopped after 5
+ *                   minutes without progress). This may be specified
+ *                   multiple times.
+ *     --cgroup    CpuWeight,IoWeight,MemoryHighMiB. Every command the
+ *                   install runs is put in a cgroup for its step, inside
+ *                   a cgroup for the install, under a vos-installer
+ *                   cgroup shared by every install on the host. This sets
+ *                   the install's cpu.weight and io.weight (1-10000,
+ *                   default 100) against the other installs, and its
+ *                   memory.high (default none), 0 to keep the default.
+ *                   Without cgroup v2, the install fails if this is
+ *                   given, and otherwise runs without measuring usage.
+ *     --trace     file. Write a timeline of the install to file in the
+ *                   Chrome trace event format (open it in Perfetto or
+ *                   chrome://tracing): a span for each step and each
+ *                   command it ran, with the command's arguments, exit
+ *                   code, CPU time and bytes read and written, and the
+ *                   host's network and disk throughput over time.
+ *     --progress-fd  fd. Report progress as JSON lines on fd (already
+ *                   open, such as a pipe the caller made), for programs
+ *                   to read instead of parsing the output: each step's
+ *                   start and end, each command's arguments, and every
+ *                   second, the bytes downloaded and written to the
+ *                   target, the packages installed, their totals, and an
+ *                   ETA. See progress.h for the format.
+ *     --record    file. Record what the install does outside the
+ *                   installer (its commands' output, results and times,
+ *                   the destination's properties, and the files it reads
+ *                   from the target) into a scenario file.
+ *     --replay    File,Scale. Run every step against a recorded scenario
+ *                   instead of installing: nothing is mounted or run,
+ *                   the target is a temporary directory, and each command
+ *                   returns its recorded output and result after its
+ *                   recorded time multiplied by Scale (default 1; 0 to
+ *                   not wait). This needs no root or disk, and measures
+ *                   the installer's own overhead; "make benchmark" runs
+ *                   it against a scenario where nothing takes any time.
+ *                   See executor.h for the format.
+ *     --image     File,SizeMiB. Install to an image file instead of a
+ *                   partition (replacing --dest), made sparse and
+ *                   SizeMiB big (default 8192), and formatted ext4 if
+ *                   it's new. Its udev properties are made up from the
+ *                   file. Without root, the install runs in a user
+ *                   namespace (mapping the user's /etc/subuid range too,
+ *                   where there is one) and the image is mounted with
+ *                   fuse2fs; with root, through a loop device. This runs
+ *                   the real steps on a build machine, to time them.
  *
  * All arguments an be passed over STDIN in the
  * form ^<argname>=<value>$ where ^ means start of line and $ means
@@ -78,45 +228,116 @@
  * command line or by STDIN, it will output "WAITING <argname>\n" and
  * pause until the argument is passed through STDIN.
  *
- * Steps this installer takes:
+ * Before anything on the destination is erased, the installer works out
+ * the download and installed size of the packages from the host's sync
+ * databases (or the --offline repository, or the --from-lock lockfile),
+ * and fails if they won't fit on the partition (with --ext4) or in the
+ * filesystem's free space. It also times a download from the first mirror
+ * to estimate how long the package download will take.
  *
- * 1) Mounts volume <dest> at <mount>
- * 2) $ pacstrap <mount> base <packages>
- * 3) $ genfstab <mount> >> <mount>/etc/fstab
- * 4) Changes root into <mount>
- * 5) $ passwd <password>
- * 6) Updates locale.gen with <locale> and $ locale-gen
- * 7) $ ln -s /usr/share/zoneinfo/<zone> /etc/localtime
- * 8) echo <hostname> > /etc/hostname
- * 9) Create user account with username and password and group wheel
- * 10) Enables wheel to access sudo
- * 11) Enables <services>
+ * Steps this installer takes (see kSteps for exactly what each waits for;
+ * steps that don't wait on each other run at the same time):
  *
- * STDOUT/ERR from child processess are piped to this program's STDOUT/ERR,
- * and this program also outputs "PROGRESS <%f>\n" where %f is from 0 to 100
- * as progress is made. A successful install has exit code 0, and any errors
- * from child processess cause the install to fail with the child process's
- * exit code.
+ * 1) Checks the internet connection and finds <dest>, then checks the
+ *      packages fit
+ * 2) Formats <dest> if --ext4, and mounts it at <mount>, while the
+ *      mirrors are ranked and --repo keys are fetched
+ * 3) $ pacstrap <mount> base
+ *      (pacman's keyring is initialized alongside the base install,
+ *      and populated from the target's keyring package after it)
+ * 4) Adds --repo repos and their keys, and installs <packages>, while
+ *      $ genfstab <mount> >> <mount>/etc/fstab
+ * 5) Runs these in <mount>, chrooted into it, all at once:
+ *      $ passwd <password>, and then creates the user account with
+ *        username and password and group wheel, and enables wheel to
+ *        access sudo
+ *      Updates locale.gen with <locale> and $ locale-gen
+ *      $ ln -s /usr/share/zoneinfo/<zone> /etc/localtime
+ *      echo <hostname> > /etc/hostname
+ *      Enables <services>
+ *      Installs rEFInd if --refind
+ * 6) Runs --postcmd commands in <mount>, stops the chroot helper, handles
+ *      --target-cache, and unmounts <mount>
+ *
+ * The installer itself never leaves the host's root, so host-side work
+ * isn't held up by the steps in <mount>. Their commands are started by a
+ * small helper process forked once and chrooted into <mount>, rather than
+ * by forking the installer for each, and their files are opened relative
+ * to <mount> (with absolute symlinks resolved inside it, where the kernel
+ * allows). locale.gen and sudoers are edited without running sed at all.
+ *
+ * The install runs in its own mount and PID namespaces, so <mount> (a
+ * temporary directory <dest> is mounted on) and everything mounted under
+ * it are only visible to the installer, and several installs can run on
+ * one host. When the installer exits, anything its commands left running
+ * (such as gpg-agent) is killed, and its mounts go away with it.
+ *
+ * If a step fails, nothing more is started, but the chroot helper is still
+ * stopped and <mount> still unmounted. At the end, the time each step took
+ * is printed (with how many processes it started, and how long starting
+ * them took), along with how long the install would have taken running
+ * one step at a time.
+ *
+ * STDOUT/ERR from child processess are piped to this program's STDOUT,
+ * each line prefixed with the step that ran the process ("[base] ..."),
+ * since steps run at the same time. Everything printed is also logged to
+ * /var/log/vos-installer.log on the target (appended to by each install,
+ * including anything printed before <dest> was mounted). This program
+ * also outputs "PROGRESS <%f>\n" where %f is from 0 to 1
+ * as progress is made, weighted by how long each step usually takes.
+ * When a command has gone half its stall limit without progress it
+ * outputs "STALLED <step> <seconds>\n", and "RESUMED <step>\n" if it
+ * picks up again; "TIMEOUT <step> deadline|stalled\n" when a command is
+ * stopped; "RETRY <step> <attempt> <retries> <delay>\n" before a
+ * failed step is run again; and "USAGE <step> <user usec> <system usec>
+ * <read bytes> <written bytes> <peak memory bytes>\n" with what the
+ * processes a step ran used (from its cgroup) once it finishes. A
+ * successful install has exit code 0, and any errors from child
+ * processess cause the install to fail with the child process's exit
+ * code.
  *
  * Sending SIGINT to this process will cleanly exit it, but will not undo
  * changes made.
  */
 
+#define _GNU_SOURCE // pipe2
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
+#include <sys/statvfs.h>
 #include <sys/wait.h>
-#include <sys/prctl.h>
+#include <sys/syscall.h>
 #include <errno.h>
 #include <string.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <argp.h>
+#include <ftw.h>
 #include <libudev.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <glib.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+#include "pkgcache.h"
+#include "fetch.h"
+#include "mirrors.h"
+#include "localrepo.h"
+#include "keys.h"
+#include "steps.h"
+#include "journal.h"
+#include "supervisor.h"
+#include "output.h"
+#include "helper.h"
+#include "namespace.h"
+#include "cgroup.h"
+#include "trace.h"
+#include "progress.h"
+#include "executor.h"
+#include "image.h"
 
 typedef struct
 {
@@ -126,6 +347,34 @@ typedef struct
 	char **keys;
 } Repo;
 
+// A package pacman would install, as reported by resolve_packages
+typedef struct
+{
+	char *repo;
+	char *name;
+	char *version;
+	char *filename;
+	char *sha256;
+	guint64 size; // Download size
+	char *url;
+} Package;
+
+// What to do with the target's package cache once the install is done
+typedef enum
+{
+	kTargetCacheKeep,
+	kTargetCacheExport, // Move the packages into the shared cache
+	kTargetCachePrune, // Delete the packages
+} TargetCache;
+
+// A --step-policy: its first numSet fields (in StepPolicy's order)
+// replace the step's defaults
+typedef struct
+{
+	StepPolicy policy;
+	guint numSet;
+} PolicyOverride;
+
 typedef struct
 {
 	// Args
@@ -139,6 +388,7 @@ typedef struct
 	char *packages;
 	char *services;
 	bool skipPacstrap;
+	bool singleSync;
 	bool writeExt4;
 	bool debug;
 	char *newFSLabel; // Only if writeExt4
@@ -146,48 +396,115 @@ typedef struct
 	char *refindDest;
 	GList *postcmds;
 	GList *repos;
+	char *cachePath; // Shared host package cache, or NULL for none
+	guint64 cacheMaxSize;
+	guint cacheMaxDays;
+	char *seedPath; // Directory of packages to copy into the target's cache, or NULL
+	guint pipelineSize; // Packages per pipelined batch, or 0 to not pipeline
+	guint fetchConnections; // Connections for the built-in fetcher, or 0 to let pacman download
+	guint mirrorCount; // Number of ranked mirrors to use, or 0 to use the host's mirrorlist
+	guint mirrorMaxHours;
+	char *offlinePath; // Local repository to install from without a network, or NULL
+	char *buildRepoPath; // Directory to build a local repository in instead of installing
+	GList *keyfiles; // Key files to add to the target's keyring
+	GList *keyservers; // Keyservers to race for --repo keys, or NULL for the defaults
+	char *lockPath; // File to record the installed package set in, or NULL
+	char *fromLockPath; // File of the exact package set to install, or NULL
+	TargetCache targetCache;
+	bool resume; // Skip steps the target's journal says are done
+	GHashTable *policies; // Step name (or "all") -> PolicyOverride, from --step-policy
+	CgroupLimits cgroupLimits;
+	bool limitCgroup; // --cgroup was given, so cgroups are needed
+	char *tracePath; // File to write a timeline of the install to, or NULL
+	int progressFd; // Where to report progress as JSON lines, or -1
+	char *recordPath; // Scenario file to record the install into, or NULL
+	char *replayPath; // Scenario file to replay instead of installing, or NULL
+	double replayScale; // Multiplies the replayed commands' latencies
+	char *imagePath; // Image file to install to instead of a partition, or NULL
+	guint64 imageSize;
+	bool rootless; // Running without root, in a user namespace
 	
 	// Running data
-	size_t steps;
 	char *mountPath;
+	pid_t fusePid; // fuse2fs serving the --image on mountPath, or 0
 	bool enableSudoWheel;
 	char *killfifo;
 	char *partuuid;
+	guint64 destSize; // Size of the destination partition in bytes, or 0 if unknown
+	guint64 installSize; // Estimated space the package install needs, or 0 if unknown
 	char *ofstype; // original fs type before running mkfs.ext4, or NULL if none
 	bool refindExternal; // Set true if refind is being installed on an external device
+	PkgCache *cache;
+	Journal *journal;
+	char *offlineConf; // pacman.conf for installing from offlinePath, or NULL
+	char *hostConf; // Host's pacman.conf using the ranked mirrors, or NULL
+	char *rankedMirrors; // Ranked mirrorlist for the target, or NULL
+	GPtrArray *locked; // Packages installed so far, for lockPath
+	GPtrArray *lockExplicit; // Names of explicitly installed packages, for lockPath
+	int targetFd; // The target's root, open between enter_chroot and leave_chroot, or -1
+	Helper *helper; // Runs commands in the target, or NULL
+	pid_t helperPid;
 	
-	int selfpipe[2];
 	bool killing;
 } Data;
 
 static error_t parse_arg(int key, char *arg, struct argp_state *state);
 static Repo * parse_repo_string(const char *arg);
-static void * thread_watch_killfifo(void *data);
-static void * thread_watch_parent(void *data);
-static void on_signal(int sig, siginfo_t *siginfo, void *context);
 static void free_repo_struct(Repo *r);
-static void step(Data *d);
-static int run(int *out, const char * const *args);
-static int run_shell(int *out, const char *command);
+static bool parse_cache_string(Data *d, const char *arg);
+static bool parse_mirrors_string(Data *d, const char *arg);
+static bool parse_policy_string(Data *d, const char *arg);
+static bool parse_cgroup_string(Data *d, const char *arg);
+static bool setup_image(Data *d);
+static void print_progress(double fraction, Data *d);
+static int run(GString *tail, const char * const *args);
+static int run_target(GString *tail, const char * const *args);
+static int run_shell(GString *tail, const char *command);
 static void ensure_argument(Data *d, char **arg, const char *argname);
-static int start(Data *d);
+static int check_connection(Data *d);
+static int find_dest(Data *d);
+static int check_install_size(Data *d);
+static int rank_target_mirrors(Data *d);
+static int fetch_keys(Data *d);
 static int run_ext4(Data *d);
 static int mount_volume(Data *d);
-static int run_pacstrap(Data *d);
+static int init_keyring(Data *d);
+static int populate_keyring(Data *d);
+static int install_base(Data *d);
+static int add_repos(Data *d);
+static int install_packages(Data *d);
 static int run_genfstab(Data *d);
-static int run_chroot(Data *d);
+static int enter_chroot(Data *d);
 static int set_passwd(Data *d);
 static int set_locale(Data *d);
 static int set_zone(Data *d);
 static int set_hostname(Data *d);
 static int create_user(Data *d);
 static int enable_services(Data *d);
-static int run_postcmd(Data *d);
 static int install_refind(Data *d);
+static int run_postcmd(Data *d);
+static int leave_chroot(Data *d);
+static int clean_target_cache(Data *d);
+static int unmount_volume(Data *d);
+static char * ext4_inputs(Data *d);
+static char * keyring_inputs(Data *d);
+static char * base_inputs(Data *d);
+static char * repos_inputs(Data *d);
+static char * packages_inputs(Data *d);
+static char * fstab_inputs(Data *d);
+static char * locale_inputs(Data *d);
+static char * zone_inputs(Data *d);
+static char * hostname_inputs(Data *d);
+static char * services_inputs(Data *d);
+static char * refind_inputs(Data *d);
+static char * postcmd_inputs(Data *d);
+static gboolean journal_step_completed(const char *step, const char *hash, gpointer data);
+static void step_policy(const char *step, StepPolicy *policy, gpointer data);
+static void journal_step_record(const char *step, const char *hash, gpointer data);
 
-#define println(fmt...) { printf(fmt); printf("\n"); }
-
-#define NONBLOCK(fd) fcntl(fd,F_SETFL,fcntl(fd,F_GETFL)|O_NONBLOCK)
+// Steps run on their own threads, so lines are written whole, in one
+// write, to stdout and the log
+#define println(fmt...) { output_println(fmt); }
 
 #define FAIL(code, x, fmt...) { \
 	println(fmt); \
@@ -196,9 +513,16 @@ static int install_refind(Data *d);
 }
 
 // Use like: int status = RUN(..)
-#define RUN(out, args...) 0; { \
+#define RUN(tail, args...) 0; { \
 	char *argv [] = {args, NULL}; \
-	status = run(out, (const char * const *)argv); \
+	status = run(tail, (const char * const *)argv); \
+}
+
+// Like RUN, but runs the command in the target. For steps between
+// enter_chroot and leave_chroot.
+#define RUN_TARGET(tail, args...) 0; { \
+	char *argv [] = {args, NULL}; \
+	status = run_target(tail, (const char * const *)argv); \
 }
 
 static struct argp_option options[] =
@@ -219,6 +543,27 @@ static struct argp_option options[] =
 	{"repo",      995, "repo",      0, "Specify a pacman repository to add to /etc/pacman.conf on the target machine, in the format \"Name,Server,SigLevel,Keys...\" where keys are full PGP fingerprints to download public keys to add to pacman's keyring.", 0},
 	{"debug",     994, 0,      0, "specify to enable debug mode", 0},
 	{"refind",    993, "block device",      OPTION_ARG_OPTIONAL, "Install rEFInd boot manager to the default EFI partition. Optionally specify a partition to perform a more compatible install (good for external devices).", 0},
+	{"singlesync", 992, 0,          0, "Sync the package databases only once (starting from the host's), and install base and the extra packages in one transaction if no --repo is given.", 0},
+	{"pipeline",  989, "batch size", OPTION_ARG_OPTIONAL, "Install packages in batches, downloading each batch while the one before it installs. Optionally specify the number of packages per batch (default 20).", 0},
+	{"fetch",     988, "connections", OPTION_ARG_OPTIONAL, "Download packages with the installer's own parallel, resumable fetcher before running pacman. Optionally specify the number of connections (default 4).", 0},
+	{"mirrors",   987, "Count,MaxHours", OPTION_ARG_OPTIONAL, "Probe the host's mirrors and install from the fastest Count (default 5). The ranking is reused for MaxHours (default 24).", 0},
+	{"build-repo", 986, "dir",      0, "Don't install anything; instead make the packages in dir into a local repository for --offline.", 0},
+	{"offline",   985, "dir",       0, "Install without a network connection, only from the local repository in dir made with --build-repo.", 0},
+	{"keyfile",   984, "file",      0, "Add the PGP public key(s) in file to pacman's keyring on the target. This may be specified multiple times.", 0},
+	{"keyserver", 983, "url",       0, "A keyserver to download --repo signing keys from, instead of the defaults. This may be specified multiple times; all are asked at once.", 0},
+	{"lock",      982, "file",      0, "Write the exact set of packages installed (names, versions and checksums) to file, for --from-lock.", 0},
+	{"from-lock", 981, "file",      0, "Install exactly the packages in a file written by --lock, without resolving dependencies.", 0},
+	{"step-policy", 978, "Step,Timeout,Stall,Retries,Backoff", 0, "Limit how long a step (or \"all\") may take and how long its commands may go without output or I/O, in seconds (0 for no limit), and how many times to retry it if it fails, waiting Backoff seconds (doubling each time). Trailing fields may be left out to keep the defaults. This may be specified multiple times.", 0},
+	{"cgroup",    977, "CpuWeight,IoWeight,MemoryHighMiB", 0, "Set the cpu.weight and io.weight (1-10000, default 100) of the install's cgroup against other installs on the host, and its memory.high in MiB (default none). 0 keeps a default.", 0},
+	{"trace",     976, "file",      0, "Write a timeline of the install's steps and commands, and the host's network and disk throughput, to file in the Chrome trace event format.", 0},
+	{"progress-fd", 975, "fd",      0, "Report the install's progress (steps, commands, bytes downloaded and written, packages installed and an ETA) as JSON lines on the already open file descriptor fd.", 0},
+	{"record",    974, "file",      0, "Record the commands the install runs (with their output, result and time), the destination's properties and the files read from the target into a scenario file for --replay.", 0},
+	{"replay",    973, "File,Scale", 0, "Don't install anything; instead run the steps against the scenario in File made by --record, replaying its commands with their recorded times multiplied by Scale (default 1, 0 for none). Needs no root or disk, to measure the installer's own overhead.", 0},
+	{"image",     972, "File,SizeMiB", 0, "Install to the image file File instead of a partition, making it (sparse) SizeMiB big (default 8192) and formatting it if it's new. This works without root, in a user namespace, to run and time the install steps on any machine.", 0},
+	{"resume",    979, 0,           0, "Skip the steps an earlier install to the same destination finished, unless what they depend on has changed.", 0},
+	{"target-cache", 980, "keep|export|prune", 0, "What to do with the target's package cache after installing: keep it (default), move it into --cache, or delete it.", 0},
+	{"seed",      990, "dir",       0, "A directory of packages (such as the live media's package cache) to copy into the target's package cache before pacman downloads anything.", 0},
+	{"cache",     991, "dir",       0, "Use a package cache on the host, shared between installs, in the format \"Dir,MaxMiB,MaxDays\". MaxMiB and MaxDays are optional limits (default 10240 and 60, 0 for no limit).", 0},
 	{0}
 };
 
@@ -226,7 +571,56 @@ const char *argp_program_version = "vos-install-cli 0.1";
 const char *argp_program_bug_address = "Aidan Shafran <zelbrium@gmail.com>";
 static char argp_program_doc[] = "An installer for VeltOS (Arch Linux). See top of main.c for detailed instructions on how to use the installer. The program author is not responsible for any damages, including but not limited to exploded computer, caused by this program. Use as root and with caution.";
 
-static const size_t kMaxSteps = 17;
+// The install, as steps and the steps each waits for. Steps run as soon
+// as what they wait for is done, so independent steps run at the same
+// time. Weights are shares of the progress, roughly in proportion to how
+// long each step usually takes. Steps with inputs are recorded in the
+// target's journal, and skipped with --resume if already done.
+static const Step kSteps[] =
+{
+	{"connection",   (StepFunc)check_connection,    1,  {NULL}, NULL, NULL},
+	{"dest",         (StepFunc)find_dest,           1,  {NULL}, NULL, NULL},
+	{"size",         (StepFunc)check_install_size,  1,  {"connection", "dest"}, NULL, NULL},
+	{"keys",         (StepFunc)fetch_keys,          1,  {"connection"}, NULL, NULL},
+	{"mirrors",      (StepFunc)rank_target_mirrors, 2,  {"size"}, NULL, NULL},
+	{"ext4",         (StepFunc)run_ext4,            2,  {"size"}, NULL, (StepInputsFunc)ext4_inputs},
+	{"mount",        (StepFunc)mount_volume,        1,  {"ext4"}, NULL, NULL},
+	{"keyring-init", (StepFunc)init_keyring,        2,  {"mount"}, NULL, (StepInputsFunc)keyring_inputs},
+	{"base",         (StepFunc)install_base,        30, {"mount", "mirrors"}, NULL, (StepInputsFunc)base_inputs},
+	{"keyring",      (StepFunc)populate_keyring,    1,  {"base", "keyring-init"}, NULL, (StepInputsFunc)keyring_inputs},
+	{"repos",        (StepFunc)add_repos,           1,  {"base", "keyring", "keys"}, NULL, (StepInputsFunc)repos_inputs},
+	{"packages",     (StepFunc)install_packages,    30, {"repos"}, NULL, (StepInputsFunc)packages_inputs},
+	{"fstab",        (StepFunc)run_genfstab,        1,  {"base"}, NULL, (StepInputsFunc)fstab_inputs},
+	{"chroot",       (StepFunc)enter_chroot,        1,  {"packages", "fstab"}, NULL, NULL},
+	{"passwd",       (StepFunc)set_passwd,          1,  {"chroot"}, NULL, NULL}, // Not journaled, so passwords never are
+	{"locale",       (StepFunc)set_locale,          4,  {"chroot"}, NULL, (StepInputsFunc)locale_inputs},
+	{"zone",         (StepFunc)set_zone,            1,  {"chroot"}, NULL, (StepInputsFunc)zone_inputs},
+	{"hostname",     (StepFunc)set_hostname,        1,  {"chroot"}, NULL, (StepInputsFunc)hostname_inputs},
+	{"user",         (StepFunc)create_user,         2,  {"passwd"}, NULL, NULL}, // Both edit /etc/shadow
+	{"services",     (StepFunc)enable_services,     1,  {"chroot"}, NULL, (StepInputsFunc)services_inputs},
+	{"refind",       (StepFunc)install_refind,      2,  {"chroot"}, NULL, (StepInputsFunc)refind_inputs},
+	{"postcmd",      (StepFunc)run_postcmd,         2,  {"locale", "zone", "hostname", "user", "services", "refind"}, NULL, (StepInputsFunc)postcmd_inputs},
+	{"leave-chroot", (StepFunc)leave_chroot,        0,  {"postcmd"}, "chroot", NULL},
+	{"target-cache", (StepFunc)clean_target_cache,  1,  {"leave-chroot"}, NULL, NULL},
+	{"unmount",      (StepFunc)unmount_volume,      1,  {"leave-chroot", "target-cache"}, "mount", NULL},
+};
+static const StepJournal kJournal = {journal_step_completed, journal_step_record};
+// Default timeout, stall limit, retries and backoff of each step (see
+// StepPolicy). Steps that aren't listed get kDefaultPolicy. Steps that
+// download are retried, since a mirror or keyserver can fail or hang.
+static const struct { const char *step; StepPolicy policy; } kPolicies[] =
+{
+	{"connection", {0,    0,   0, 0}}, // Waits for a connection as long as it takes
+	{"keys",       {600,  120, 2, 10}},
+	{"keyring-init", {1800, 300, 1, 10}}, // pacman-key can block waiting for entropy
+	{"base",       {0,    300, 2, 10}},
+	{"repos",      {0,    300, 2, 10}},
+	{"packages",   {0,    300, 2, 10}},
+};
+static const StepPolicy kDefaultPolicy = {0, 0, 0, 0};
+static const char *kOfflineRepo = "offline";
+static const char *kJournalPath = "var/lib/vos-installer/journal"; // On the target
+static const char *kLogPath = "var/log/vos-installer.log"; // On the target
 static Data *d;
 
 
@@ -234,11 +628,15 @@ int main(int argc, char **argv)
 {
 	int code;
 	
-	// Don't buffer stdout, seems to mess with GSubprocess/GInputStream
-	setbuf(stdout, NULL);
+	// Fully buffering stdout seems to mess with GSubprocess/GInputStream,
+	// but unbuffered, every printf is its own write. println bypasses
+	// stdio, and the other modules print whole lines.
+	setvbuf(stdout, NULL, _IOLBF, 0);
 
 	// Parse arguments
 	d = g_new0(Data, 1);
+	d->targetFd = -1;
+	d->progressFd = -1;
 	static struct argp argp = {options, parse_arg, NULL, argp_program_doc, NULL, NULL, NULL};
 	error_t error;
 	if((error = argp_parse(&argp, argc, argv, 0, 0, d)))
@@ -260,62 +658,133 @@ int main(int argc, char **argv)
 	REPL_NONE(d->packages);
 	REPL_NONE(d->services);
 	#undef REPL_NONE
+	
+	if(d->buildRepoPath)
+	{
+		code = (localrepo_build(d->buildRepoPath, kOfflineRepo) < 0);
+		goto exit;
+	}
+	
+	if(d->targetCache == kTargetCacheExport && !d->cachePath)
+	{
+		println("--target-cache export needs a --cache to export to");
+		code = 1;
+		goto exit;
+	}
+	
+	if(d->offlinePath && (d->fetchConnections || d->mirrorCount))
+	{
+		println("--fetch and --mirrors are ignored with --offline");
+		d->fetchConnections = 0;
+		d->mirrorCount = 0;
+	}
 
-	// Setup selfpipe
-	// Nonblocking because a blocking write() in the signal handler,
-	// waiting for a read in the main thread = deadlock
-	errno = 0;
-	if(pipe(d->selfpipe)
-	|| NONBLOCK(d->selfpipe[0]) == -1
-	|| NONBLOCK(d->selfpipe[1]) == -1)
+	if(d->recordPath && d->replayPath)
 	{
-		println("Error creating selfpipe (%i)", errno);
+		println("--record and --replay can't be used together");
 		code = 1;
 		goto exit;
 	}
 
-	// Watch for stop signals
-	sigset_t bsigs;
-	sigemptyset(&bsigs);
-	sigaddset(&bsigs, SIGINT);
-	sigaddset(&bsigs, SIGTERM);
-	sigaddset(&bsigs, SIGHUP);
-	sigaddset(&bsigs, SIGCHLD);
-	
-	struct sigaction act = {0};
-	act.sa_sigaction = on_signal;
-	act.sa_flags = SA_SIGINFO;
-	act.sa_mask = bsigs;
-	if(sigaction(SIGINT, &act, NULL)
-	|| sigaction(SIGTERM, &act, NULL)
-	|| sigaction(SIGHUP, &act, NULL)
-	|| sigaction(SIGCHLD, &act, NULL))
-	{
-		println("Failed to setup signal handlers! Aborting just to be safe.");
+	if(d->resume && (d->imagePath || d->replayPath))
+	{
+		println("--resume can't be used with --image or --replay");
 		code = 1;
 		goto exit;
 	}
 
-	// According to POSIX (see pthread(7) man page), when a signal
-	// arrives at a process, a thread is arbitrarily selected to
-	// receive the signal. It appears that on Linux, that is always
-	// the program's main thread. But it doesn't have to be, so to
-	// make sure, temporarily block the signals we're interested in,
-	// so that the other threads inherit the block mask. Then, after
-	// spawning the threads, unblock the signals on this thread.
-	pthread_sigmask(SIG_BLOCK, &bsigs, NULL);
-	
-	// Start threads to monitor for abort conditions
-	pthread_t p, p2;
-	if(d->killfifo)
-		pthread_create(&p, NULL, thread_watch_killfifo, NULL);
-	pthread_create(&p2, NULL, thread_watch_parent, NULL);
+	if(d->imagePath && !setup_image(d))
+	{
+		code = 1;
+		goto exit;
+	}
+
+	// The install's mounts and the processes it starts stay in the
+	// installer's own namespaces. The original process only waits here
+	// for the install to finish. A replay mounts and starts nothing.
+	if(!d->replayPath && !namespace_enter())
+	{
+		println("Failed to make the install's mount and PID namespaces (%i, must run as root)", errno);
+		code = 1;
+		goto exit;
+	}
+
+	if(d->recordPath && !executor_record(d->recordPath))
+	{
+		println("Failed to open the scenario file %s (%i)", d->recordPath, errno);
+		code = 1;
+		goto exit;
+	}
+	if(d->replayPath && !executor_replay(d->replayPath, d->replayScale))
+	{
+		println("Failed to load the scenario file %s (%i)", d->replayPath, errno);
+		code = 1;
+		goto exit;
+	}
+
+	// Watch for stop signals, the kill fifo and the parent exiting.
+	// This has to come before any other threads start.
+	if(!supervisor_start(d->killfifo, &d->killing, 1000))
+	{
+		println("Failed to start watching for abort conditions (%i). Aborting just to be safe.", errno);
+		code = 1;
+		goto exit;
+	}
 	
-	// Unblock blocked signals
-	pthread_sigmask(SIG_UNBLOCK, &bsigs, NULL);
+	if(!output_start())
+	{
+		println("Failed to start the output multiplexer (%i)", errno);
+		code = 1;
+		goto exit;
+	}
+
+	if(d->cachePath && !(d->cache = pkgcache_open(d->cachePath, d->cacheMaxSize, d->cacheMaxDays)))
+	{
+		code = 1;
+		goto exit;
+	}
+
+	if(!d->replayPath && !cgroup_start(&d->cgroupLimits))
+	{
+		if(d->limitCgroup)
+		{
+			println("Failed to make the install's cgroup (cgroup v2 is needed for --cgroup)");
+			code = 1;
+			goto exit;
+		}
+		println("cgroup v2 isn't available, so the steps' resource usage won't be measured");
+	}
+
+	if(d->tracePath && !trace_open(d->tracePath))
+	{
+		println("Failed to open the trace file %s (%i)", d->tracePath, errno);
+		cgroup_stop();
+		code = 1;
+		goto exit;
+	}
+
+	if(d->progressFd >= 0 && !progress_open(d->progressFd))
+	{
+		println("Progress fd %i isn't open", d->progressFd);
+		cgroup_stop();
+		trace_close();
+		code = 1;
+		goto exit;
+	}
 
 	// Begin installation
-	code = start(d);
+	d->journal = journal_new();
+	code = steps_run(kSteps, G_N_ELEMENTS(kSteps), d, (StepProgressFunc)print_progress, &kJournal, step_policy);
+	cgroup_stop();
+	trace_close();
+	progress_close(code);
+	executor_close();
+	
+	if(d->cache)
+	{
+		pkgcache_evict(d->cache);
+		pkgcache_print_stats(d->cache);
+	}
 
 exit:
 	g_free(d->dest);
@@ -328,7 +797,34 @@ exit:
 	g_free(d->packages);
 	g_free(d->services);
 	g_free(d->mountPath);
+	g_free(d->cachePath);
+	g_free(d->seedPath);
+	g_free(d->offlinePath);
+	g_free(d->buildRepoPath);
+	g_free(d->lockPath);
+	g_free(d->tracePath);
+	g_free(d->recordPath);
+	g_free(d->replayPath);
+	g_free(d->imagePath);
+	g_free(d->fromLockPath);
+	if(d->offlineConf)
+		unlink(d->offlineConf);
+	g_free(d->offlineConf);
+	if(d->hostConf)
+		unlink(d->hostConf);
+	g_free(d->hostConf);
+	g_free(d->rankedMirrors);
+	if(d->locked)
+		g_ptr_array_unref(d->locked);
+	if(d->lockExplicit)
+		g_ptr_array_unref(d->lockExplicit);
+	pkgcache_close(d->cache);
+	journal_free(d->journal);
+	if(d->policies)
+		g_hash_table_unref(d->policies);
 	g_list_free_full(d->postcmds, g_free);
+	g_list_free_full(d->keyfiles, g_free);
+	g_list_free_full(d->keyservers, g_free);
 	g_list_free_full(d->repos, (GDestroyNotify)free_repo_struct);
 	g_free(d);
 	return code;
@@ -366,11 +862,266 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 	}
 	case 994: d->debug = TRUE; break;
 	case 993: d->refind = true; d->refindDest = arg; break;
+	case 992: d->singleSync = true; break;
+	case 990: d->seedPath = arg; break;
+	case 991:
+		if(!parse_cache_string(d, arg))
+		{
+			println("Invalid cache specified: %s", arg);
+			g_free(arg);
+			return EINVAL;
+		}
+		g_free(arg);
+		break;
+	case 989:
+		d->pipelineSize = arg ? strtoul(arg, NULL, 10) : 20;
+		g_free(arg);
+		if(d->pipelineSize == 0)
+		{
+			println("Invalid pipeline batch size");
+			return EINVAL;
+		}
+		break;
+	case 986: d->buildRepoPath = arg; break;
+	case 984: d->keyfiles = g_list_append(d->keyfiles, arg); break;
+	case 983: d->keyservers = g_list_append(d->keyservers, arg); break;
+	case 982: d->lockPath = arg; break;
+	case 981: d->fromLockPath = arg; break;
+	case 985: d->offlinePath = arg; break;
+	case 979: d->resume = true; break;
+	case 978:
+		if(!parse_policy_string(d, arg))
+		{
+			println("Invalid step policy specified: %s", arg);
+			g_free(arg);
+			return EINVAL;
+		}
+		g_free(arg);
+		break;
+	case 977:
+		if(!parse_cgroup_string(d, arg))
+		{
+			println("Invalid cgroup limits specified: %s", arg);
+			g_free(arg);
+			return EINVAL;
+		}
+		g_free(arg);
+		break;
+	case 976: d->tracePath = arg; break;
+	case 975:
+	{
+		char *end = NULL;
+		long fd = strtol(arg, &end, 10);
+		if(end == arg || *end != '\0' || fd < 0 || fd > G_MAXINT)
+		{
+			println("Invalid progress fd specified: %s", arg);
+			g_free(arg);
+			return EINVAL;
+		}
+		d->progressFd = fd;
+		g_free(arg);
+		break;
+	}
+	case 974: d->recordPath = arg; break;
+	case 972:
+	{
+		char **split = g_strsplit(arg, ",", 2);
+		char *end = NULL;
+		d->imagePath = g_strdup(split[0]);
+		guint64 mib = split[1] ? g_ascii_strtoull(split[1], &end, 10) : 8192;
+		bool valid = (*d->imagePath != '\0') && mib > 0 && (!split[1] || (end != split[1] && *end == '\0'));
+		d->imageSize = mib * 1024 * 1024;
+		g_strfreev(split);
+		if(!valid)
+		{
+			println("Invalid image specified: %s", arg);
+			g_free(arg);
+			return EINVAL;
+		}
+		g_free(arg);
+		break;
+	}
+	case 973:
+	{
+		char **split = g_strsplit(arg, ",", 2);
+		char *end = NULL;
+		d->replayPath = g_strdup(split[0]);
+		d->replayScale = split[1] ? g_ascii_strtod(split[1], &end) : 1;
+		bool valid = (*d->replayPath != '\0') && (!split[1] || (end != split[1] && *end == '\0' && d->replayScale >= 0));
+		g_strfreev(split);
+		if(!valid)
+		{
+			println("Invalid replay specified: %s", arg);
+			g_free(arg);
+			return EINVAL;
+		}
+		g_free(arg);
+		break;
+	}
+	case 980:
+		if(g_strcmp0(arg, "keep") == 0)
+			d->targetCache = kTargetCacheKeep;
+		else if(g_strcmp0(arg, "export") == 0)
+			d->targetCache = kTargetCacheExport;
+		else if(g_strcmp0(arg, "prune") == 0)
+			d->targetCache = kTargetCachePrune;
+		else
+		{
+			println("Invalid target cache action: %s", arg);
+			g_free(arg);
+			return EINVAL;
+		}
+		g_free(arg);
+		break;
+	case 987:
+		if(!parse_mirrors_string(d, arg))
+		{
+			println("Invalid mirrors specified: %s", arg);
+			g_free(arg);
+			return EINVAL;
+		}
+		g_free(arg);
+		break;
+	case 988:
+		d->fetchConnections = arg ? strtoul(arg, NULL, 10) : 4;
+		g_free(arg);
+		if(d->fetchConnections == 0)
+		{
+			println("Invalid number of fetch connections");
+			return EINVAL;
+		}
+		break;
 	default: g_free(arg); return ARGP_ERR_UNKNOWN;
 	}
 	return 0;
 }
 
+static bool parse_cache_string(Data *d, const char *arg)
+{
+	// 0,    1,      2
+	// path, maxmib, maxdays
+	char **split = g_strsplit(arg, ",", -1);
+	size_t length = g_strv_length(split);
+	bool valid = (length >= 1 && length <= 3 && split[0][0] != '\0');
+	
+	d->cacheMaxSize = 10240ULL * 1024 * 1024;
+	d->cacheMaxDays = 60;
+	for(size_t i=1; valid && i<length; ++i)
+	{
+		char *end = NULL;
+		guint64 value = g_ascii_strtoull(g_strstrip(split[i]), &end, 10);
+		if(!end || *end != '\0')
+			valid = false;
+		else if(i == 1)
+			d->cacheMaxSize = value * 1024 * 1024;
+		else
+			d->cacheMaxDays = value;
+	}
+	
+	if(valid)
+	{
+		g_free(d->cachePath);
+		d->cachePath = g_strdup(g_strstrip(split[0]));
+	}
+	g_strfreev(split);
+	return valid;
+}
+
+static bool parse_mirrors_string(Data *d, const char *arg)
+{
+	// 0,     1
+	// count, maxhours
+	d->mirrorCount = 5;
+	d->mirrorMaxHours = 24;
+	if(!arg)
+		return true;
+	
+	char **split = g_strsplit(arg, ",", -1);
+	size_t length = g_strv_length(split);
+	bool valid = (length >= 1 && length <= 2);
+	for(size_t i=0; valid && i<length; ++i)
+	{
+		char *end = NULL;
+		guint64 value = g_ascii_strtoull(g_strstrip(split[i]), &end, 10);
+		if(!end || *end != '\0' || value > G_MAXUINT)
+			valid = false;
+		else if(i == 0)
+			d->mirrorCount = value;
+		else
+			d->mirrorMaxHours = value;
+	}
+	g_strfreev(split);
+	return valid && d->mirrorCount > 0;
+}
+
+static bool parse_policy_string(Data *d, const char *arg)
+{
+	// 0,    1,       2,     3,       4
+	// step, timeout, stall, retries, backoff
+	char **split = g_strsplit(arg, ",", -1);
+	size_t length = g_strv_length(split);
+	bool valid = (length >= 2 && length <= 5);
+	
+	const char *step = valid ? g_strstrip(split[0]) : NULL;
+	bool known = (g_strcmp0(step, "all") == 0);
+	for(size_t i=0; valid && !known && i<G_N_ELEMENTS(kSteps); ++i)
+		known = (g_strcmp0(step, kSteps[i].name) == 0);
+	valid = valid && known;
+	
+	guint values[4] = {0};
+	for(size_t i=1; valid && i<length; ++i)
+	{
+		char *end = NULL;
+		guint64 value = g_ascii_strtoull(g_strstrip(split[i]), &end, 10);
+		if(!end || *end != '\0' || value > G_MAXUINT)
+			valid = false;
+		else
+			values[i-1] = value;
+	}
+	
+	if(valid)
+	{
+		PolicyOverride *o = g_new0(PolicyOverride, 1);
+		o->policy.timeout = values[0];
+		o->policy.stall = values[1];
+		o->policy.retries = values[2];
+		o->policy.backoff = values[3];
+		o->numSet = length - 1;
+		if(!d->policies)
+			d->policies = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+		g_hash_table_replace(d->policies, g_strdup(step), o);
+	}
+	g_strfreev(split);
+	return valid;
+}
+
+static bool parse_cgroup_string(Data *d, const char *arg)
+{
+	// 0,         1,        2
+	// cpuweight, ioweight, memoryhighmib
+	char **split = g_strsplit(arg, ",", -1);
+	size_t length = g_strv_length(split);
+	bool valid = (length >= 1 && length <= 3);
+	guint64 values[3] = {0};
+	for(size_t i=0; valid && i<length; ++i)
+	{
+		char *end = NULL;
+		values[i] = g_ascii_strtoull(g_strstrip(split[i]), &end, 10);
+		if(!end || *end != '\0' || (i < 2 && values[i] > 10000))
+			valid = false;
+	}
+	g_strfreev(split);
+	
+	if(valid)
+	{
+		d->cgroupLimits.cpuWeight = values[0];
+		d->cgroupLimits.ioWeight = values[1];
+		d->cgroupLimits.memoryHigh = values[2] * 1024 * 1024;
+		d->limitCgroup = true;
+	}
+	return valid;
+}
+
 static Repo * parse_repo_string(const char *arg)
 {
 	// 0,    1,      2,        3...
@@ -438,215 +1189,360 @@ static Repo * parse_repo_string(const char *arg)
 	return r;
 }
 
-// Wait for data to be sent to the killfifo
-static void * thread_watch_killfifo(UNUSED void *data)
+static void free_repo_struct(Repo *r)
 {
-	int fifo = open(d->killfifo, O_RDONLY);
-	char x[2];
-	x[0] = '\0';
-	x[1] = '\0';
-	while(1)
-	{
-		read(fifo, &x, 1);
-		kill(getpid(), SIGINT);
-		// TODO: Clear and/or request user only send one char of data
-	}
-	return NULL;
+	g_free(r->name);
+	g_free(r->server);
+	g_free(r->siglevel);
+	g_strfreev(r->keys);
+	g_free(r);
 }
 
-// Constantly make sure the parent doesn't change (will
-// happen if the original parent dies). If it does, abort.
-static void * thread_watch_parent(UNUSED void *data)
+static void print_progress(double fraction, UNUSED Data *d)
 {
-	int ppid = getppid();
-	do
-	{
-		sleep(1);
-	} while(getppid() == ppid);
-	println("\nParent changed, stopping install to be safe\n");
-	kill(getpid(), SIGINT);
-	return NULL;
+	println("PROGRESS %f", fraction);
+	progress_fraction(fraction);
 }
 
-static void on_signal(int sig, UNUSED siginfo_t *siginfo, UNUSED void *context)
+// Checks how a child process ended. Returns an error code if the
+// install was aborted or the supervisor stopped the child, or 0.
+static int check_child_end(ChildEnd end)
 {
-	if(sig != SIGCHLD)
-		d->killing = true;
-	
-	// To avoid some race conditions, also use a selfpipe to
-	// inform of these signals.
-	int savederr = errno;
-	(void)write(d->selfpipe[1], "", 1);
-	errno = savederr;
+	if(d->killing)
+		FAIL(1, , "Install aborted")
+	// Stopped by the supervisor, so the exit code means nothing. Fatal,
+	// so that the step fails (and can be retried).
+	if(end == kChildTimedOut)
+		FAIL(ETIMEDOUT, , "Process took longer than the step's timeout")
+	if(end == kChildStalled)
+		FAIL(ETIMEDOUT, , "Process stalled without output or I/O")
+	return 0;
 }
 
-static void free_repo_struct(Repo *r)
+// Waits for a child process started by run_full (and tracked with
+// supervisor_track) to exit. This is safe to call from several threads
+// at once, each waiting on their own child. Returns 0 once the child
+// has exited, with its wait status in exitstatus and resource usage in
+// usage (if non-NULL), or an error code if the install was aborted.
+static int wait_child(pid_t pid, int *exitstatus, struct rusage *usage)
 {
-	g_free(r->name);
-	g_free(r->server);
-	g_free(r->siglevel);
-	g_strfreev(r->keys);
-	g_free(r);
+	int status = 0;
+	ChildEnd end = kChildExited;
+	if(!supervisor_wait(pid, &status, &end, usage))
+		FAIL(1, , "Error monitoring process")
+	if(exitstatus)
+		*exitstatus = status;
+	return check_child_end(end);
 }
 
-static void step(Data *d)
+// Turns a wait status into run_full's return value
+static int exit_code(int exitstatus)
 {
-	d->steps++;
-	println("PROGRESS %f", (gfloat)(d)->steps / kMaxSteps);
+	int exit = 1;
+	if(WIFEXITED(exitstatus))
+		exit = WEXITSTATUS(exitstatus);
+	else
+		println("Process aborted (signal: %i)", WIFSIGNALED(exitstatus) ? WTERMSIG(exitstatus) : 0);
+	return (-exit);
 }
 
-// Run a process. If an exit signal comes though, try to give the
-// process a little bit of time to exit, and if it doesn't die in
-// time, force kill it.
-// Supply a integer to store the read end of a pipe if the child's
-// output should be redirected to that pipe, or NULL to keep output
-// at stdout. run still waits for the child to exit before returning
-// even if a pipe is supplied.
-// Returns the process's exit code as a negative, to distinugish a child
-// process error (possibly not fatal) from a fork/abort error (fatal).
-static int run_full(int *out, bool mute, const char * const *args)
+// Called by the chroot helper once a command is running
+static void on_helper_started(pid_t pid, gpointer data)
 {
-	if(d->killing)
-		FAIL(errno, , "Install aborted")
-	
-	if(d->debug || !mute)
-	{
-		char *cmd = g_strjoinv(" ", (char **)args);
-		println("Running: %s", cmd);
-		g_free(cmd);
-	}
+	*(pid_t *)data = pid;
+	supervisor_watch(pid, steps_current(), steps_current_deadline(), steps_current_stall());
+}
 
-	if(d->debug)
+// Runs a command through the chroot helper. See run_full.
+static int run_helper(GString *tail, const char *input, const char * const *args)
+{
+	int outfd;
+	OutputChild *output = output_child_new(steps_current(), &outfd);
+	if(!output)
+		FAIL(errno, , "Failed to open pipe")
+
+	pid_t pid = 0;
+	int exitstatus = 0;
+	gint64 spawnTime = 0;
+	struct rusage usage = {0};
+	int cgroup = cgroup_procs_fd(steps_current_cgroup());
+	gint64 start = g_get_monotonic_time();
+	gboolean ran = helper_run(d->helper, args, input, outfd, cgroup, on_helper_started, &pid, &exitstatus, &spawnTime, &usage);
+	int err = errno;
+	if(ran)
+		trace_process(args, start, g_get_monotonic_time(), exitstatus, &usage);
+	close(outfd);
+	ChildEnd end = kChildExited;
+	if(pid)
+		supervisor_unwatch(pid, &end);
+	output_child_finish(output, tail);
+
+	int r = check_child_end(end);
+	if(r)
+		return r;
+	if(!ran && (pid || err == EPIPE))
+		FAIL(err, , "Lost the chroot helper")
+	if(!ran)
 	{
-		printf("Continue? (y/n) ");
-		char *line = NULL;
-		size_t len = 0;
-		if(getline(&line, &len, stdin) == -1)
-			exit(1);
-		if(g_strcmp0(line, "y\n") != 0)
-			exit(1);
+		println("Error: Failed to launch process. It might not exist.");
+		return -1;
 	}
+	steps_count_process(spawnTime);
+	return exit_code(exitstatus);
+}
+
+// Closes the fds that aren't -1
+static void close_fds(const int *fds, size_t num)
+{
+	for(size_t i=0; i<num; ++i)
+		if(fds[i] >= 0)
+			close(fds[i]);
+}
+
+// Reports why a forked child couldn't exec, and exits it
+static void child_fail(const char *message)
+{
+	write(STDERR_FILENO, message, strlen(message));
+	_exit(127);
+}
 
-	int fd[2];
-	if(out)
+// Forks and execs a process. See run_full.
+static int run_fork(GString *tail, GString *capture, bool target, const char *input, const char * const *args)
+{
+	// Close-on-exec, so that children other steps start at the same
+	// time don't hold the pipes open. The exec pipe closes when the
+	// child execs, to time how long starting it took.
+	int outfd;
+	OutputChild *output = output_child_new(steps_current(), &outfd);
+	if(!output)
+		FAIL(errno, , "Failed to open pipe")
+	int fd[2] = {-1, -1};
+	int in[2] = {-1, -1};
+	int execfd[2] = {-1, -1};
+	if((capture && pipe2(fd, O_CLOEXEC)) || (input && pipe2(in, O_CLOEXEC)) || pipe2(execfd, O_CLOEXEC))
 	{
-		*out = 0;
-		if(pipe(fd) || NONBLOCK(fd[0]) || NONBLOCK(fd[1]))
-			FAIL(errno, , "Failed to open pipe")
-		*out = fd[0];
+		int err = errno;
+		int fds[] = {outfd, fd[0], fd[1], in[0], in[1], execfd[0], execfd[1]};
+		close_fds(fds, G_N_ELEMENTS(fds));
+		output_child_finish(output, NULL);
+		FAIL(err, , "Failed to open pipe")
 	}
-	
+
 	// Spawn new process
 	errno = 0;
+	gint64 forkTime = g_get_monotonic_time();
 	pid_t ppid = getpid();
+	int root = target ? d->targetFd : -1;
+	int cgroup = cgroup_procs_fd(steps_current_cgroup());
+	supervisor_fork();
 	pid_t pid = fork();
-	
+
 	if(pid == -1)
 	{
-		FAIL(errno, , "Failed to fork new process")
+		int err = errno;
+		supervisor_fork_failed();
+		int fds[] = {outfd, fd[0], fd[1], in[0], in[1], execfd[0], execfd[1]};
+		close_fds(fds, G_N_ELEMENTS(fds));
+		output_child_finish(output, NULL);
+		FAIL(err, , "Failed to fork new process")
 	}
 	else if(pid == 0) // Child process
 	{
-		// Give the child its own process group
-		setpgrp();
-		
-		// Redirect child's STDOUT/ERR to pipe if requested
-		if(out)
-		{
-			close(fd[0]);
-			dup2(fd[1], STDOUT_FILENO);
-			dup2(fd[1], STDERR_FILENO);
-		}
+		// Own process group, signals unblocked, dies with the installer
+		supervisor_prepare_child(ppid);
 		
-		// Child processes should be killed cleanly, but just incase
-		// something bad happens (parent segfaults or SIGKILL'd), this
-		// is a last resort to get the child to die.
-		if(prctl(PR_SET_PDEATHSIG, SIGHUP))
-			abort();
-		// Prevent race condition of parent dying before prctl is called
-		if(getppid() != ppid)
-			abort();
-		
-		execvp(args[0], (char * const *)args);
-		println("Error: Failed to launch process. It might not exist.");
-		abort();
+		// Into the step's cgroup, so what it uses is counted
+		if(cgroup >= 0)
+			write(cgroup, "0", 1);
+
+		// Redirect child's STDOUT/ERR to the multiplexer, or STDOUT to
+		// the capture pipe
+		dup2(capture ? fd[1] : outfd, STDOUT_FILENO);
+		dup2(outfd, STDERR_FILENO);
+		if(input)
+			dup2(in[0], STDIN_FILENO);
+
+		// Other threads may have held locks (stdout's, malloc's) when
+		// this forked, so only write(2) fixed strings until exec
+		if(root >= 0 && (fchdir(root) || chroot(".")))
+			child_fail("Error: Failed to change root into the target\n");
+
+		execvp(args[0], (char * const *)args);
+		child_fail("Error: Failed to launch process. It might not exist.\n");
 	}
 
-	if(out)
-		close(fd[1]);
+	int fds[] = {outfd, fd[1], in[0], execfd[1]};
+	close_fds(fds, G_N_ELEMENTS(fds));
 
-	// Wait for process to exit, or something to go wrong
-	// Loop to handle EINTR.
-	int exitstatus = 0;
-	while(1)
-	{
-		// This will wait for any signal, or exit immediately
-		// if we should be aborting. This avoids a race condition
-		// between checking d->killing and waitpid.
-		fd_set rfds;
-		FD_ZERO(&rfds);
-		FD_SET(d->selfpipe[0], &rfds);
-		errno = 0;
-		select(d->selfpipe[0]+1, &rfds, NULL, NULL, NULL);
-		if(errno != 0 && errno != EINTR)
-			d->killing = true;
-		static char dummy[PIPE_BUF];
-		while(read(d->selfpipe[0], dummy, sizeof(dummy)) > 0);
-		
-		if(!d->killing)
+	supervisor_track(pid, steps_current(), steps_current_deadline(), steps_current_stall());
+
+	char c;
+	while(read(execfd[0], &c, 1) < 0 && errno == EINTR);
+	close(execfd[0]);
+	steps_count_process(g_get_monotonic_time() - forkTime);
+
+	if(input)
+	{
+		// Small enough to fit in the pipe, so this doesn't block
+		size_t len = strlen(input);
+		if(write(in[1], input, len) != (ssize_t)len)
+			println("Failed to write to process's input");
+		close(in[1]);
+	}
+
+	if(capture)
+	{
+		char buf[4096];
+		ssize_t num;
+		while((num = read(fd[0], buf, sizeof(buf))) != 0)
 		{
-			errno = 0;
-			if(waitpid(pid, &exitstatus, WNOHANG) > 0)
+			if(num > 0)
+				g_string_append_len(capture, buf, num);
+			else if(errno != EINTR)
 				break;
-			else if(errno == 0 || errno == EINTR) // 0 for WNOHANG
-				continue;
 		}
-		
-		// Something went wrong; stop the child process.
-		kill(-getpgid(pid), SIGINT);
-		
-		println("Waiting 1s for child process to exit...");
-		
-		// Give the process time to cleanly exit. If it does,
-		// SIGCHLD will interrupt the sleep.
-		// If the user sends another interrupt during this time,
-		// it will also exit the sleep. (Assume two interrupts =
-		// they really want it dead)
-		sleep(1);
-		
-		// Death
-		kill(-getpgid(pid), SIGKILL);
-		waitpid(pid, NULL, 0);
-		
-		if(d->killing)
-			FAIL(1, , "Install aborted")
-		else
-			FAIL(errno, , "Error monitoring process")
+		close(fd[0]);
 	}
 
-	int exit = 1;
-	if(WIFEXITED(exitstatus))
-		exit = WEXITSTATUS(exitstatus);
+	int exitstatus = 0;
+	struct rusage usage = {0};
+	int r = wait_child(pid, &exitstatus, &usage);
+	trace_process(args, forkTime, g_get_monotonic_time(), exitstatus, &usage);
+	output_child_finish(output, tail);
+	if(r)
+		return r;
+	return exit_code(exitstatus);
+}
+
+// Replays a command's recorded output and result instead of running it,
+// after its recorded latency. See run_full.
+static int run_replay(GString *tail, GString *capture, const char * const *args)
+{
+	ExecutorCommand command;
+	executor_find_command(steps_current(), args, &command);
+
+	// Through the multiplexer, the same as a real command's output
+	int outfd;
+	OutputChild *output = output_child_new(steps_current(), &outfd);
+	if(!output)
+		FAIL(errno, , "Failed to open pipe")
+	size_t len = strlen(command.output);
+	for(size_t done=0; done<len;)
+	{
+		ssize_t num = write(outfd, command.output + done, len - done);
+		if(num > 0)
+			done += num;
+		else if(num < 0 && errno != EINTR)
+			break;
+	}
+	close(outfd);
+
+	// In slices, so an abort isn't held up
+	for(gint64 left=command.latency; left>0 && !d->killing; left-=G_USEC_PER_SEC/10)
+		g_usleep(MIN(left, G_USEC_PER_SEC/10));
+	if(capture)
+		g_string_append(capture, command.captured);
+	output_child_finish(output, tail);
+	if(d->killing)
+		FAIL(1, , "Install aborted")
+	return command.result;
+}
+
+// Run a process. If an exit signal comes though, the supervisor
+// gives the process a little bit of time to exit, and if it doesn't
+// die in time, force kills it.
+// The child's output goes through the output multiplexer to stdout and
+// the log, with its lines prefixed with the current step. Supply a
+// GString as tail to get the end of that output (up to OUTPUT_TAIL_SIZE)
+// for parsing, or NULL. Alternatively, supply a GString to capture the
+// child's STDOUT into instead (STDERR still goes through the
+// multiplexer); it is read while the child runs, so there is no limit
+// on the output's size. If input is non-NULL, it's written (a few KiB
+// at most) to the child's STDIN.
+// If target is true, the process runs chrooted into the target, which
+// must be entered (with enter_chroot) already. The installer itself
+// stays in the host's root, so other steps can run commands on the host
+// at the same time. Such processes are started by the chroot helper
+// rather than forked from the installer (except to capture output), and
+// forked ones change root between fork and exec.
+// With --record, every process is recorded into the scenario, and with
+// --replay, none run; their recorded output and result are replayed.
+// Returns the process's exit code as a negative, to distinugish a child
+// process error (possibly not fatal) from a fork/abort error (fatal).
+static int run_full(GString *tail, GString *capture, bool mute, bool target, const char *input, const char * const *args)
+{
+	if(d->killing)
+		FAIL(errno, , "Install aborted")
+	if(target && d->targetFd < 0)
+		FAIL(1, , "Can't run %s in the target outside the chroot steps", args[0])
+
+	if(d->debug || !mute)
+	{
+		char *cmd = g_strjoinv(" ", (char **)args);
+		println("Running: %s", cmd);
+		g_free(cmd);
+	}
+	progress_process(steps_current(), args);
+
+	if(d->debug)
+	{
+		printf("Continue? (y/n) ");
+		fflush(stdout);
+		char *line = NULL;
+		size_t len = 0;
+		if(getline(&line, &len, stdin) == -1)
+			exit(1);
+		if(g_strcmp0(line, "y\n") != 0)
+			exit(1);
+	}
+
+	if(executor_replaying())
+		return run_replay(tail, capture, args);
+
+	// A recording keeps the output even if the caller doesn't
+	GString *recorded = NULL;
+	if(executor_recording() && !tail)
+		tail = recorded = g_string_new(NULL);
+	gsize captureStart = capture ? capture->len : 0;
+	gint64 start = g_get_monotonic_time();
+
+	int r;
+	if(target && d->helper && !capture)
+		r = run_helper(tail, input, args);
 	else
-		println("Process aborted (signal: %i)", WIFSIGNALED(exitstatus) ? WTERMSIG(exitstatus) : 0);
-	return (-exit);
+		r = run_fork(tail, capture, target, input, args);
+
+	if(executor_recording())
+		executor_add_command(steps_current(), args, r, g_get_monotonic_time() - start,
+			tail->str, capture ? capture->str + captureStart : NULL);
+	if(recorded)
+		g_string_free(recorded, TRUE);
+	return r;
+}
+
+static int run(GString *tail, const char * const *args)
+{
+	return run_full(tail, NULL, FALSE, FALSE, NULL, args);
 }
 
-static int run(int *out, const char * const *args)
+static int run_target(GString *tail, const char * const *args)
 {
-	return run_full(out, FALSE, args);
+	return run_full(tail, NULL, FALSE, TRUE, NULL, args);
 }
 
-static int run_shell(int *out, const char *command)
+static int run_shell(GString *tail, const char *command)
 {
 	const char *args[] = {"sh", "-c", command, NULL};
-	return run_full(out, TRUE, args);
+	return run_full(tail, NULL, TRUE, FALSE, NULL, args);
 }
 
 // Checks if the arg is available (non-NULL)
 // If it isn't, reads and parses STDIN until it is non-NULL
 static void ensure_argument(Data *d, char **arg, const char *argname)
 {
+	// Steps running at the same time take turns reading STDIN
+	static GMutex lock;
+	g_mutex_lock(&lock);
 	if(*arg == NULL)
 		println("WAITING %s", argname);
 	while(*arg == NULL)
@@ -669,72 +1565,158 @@ static void ensure_argument(Data *d, char **arg, const char *argname)
 		else TRY(services, 8)
 		#undef TRY
 	}
+	g_mutex_unlock(&lock);
 }
 
-// Works similarly to chroot, with two exceptions:
-// 1) This automatically changes working directory to
-//    the chroot. That is, cwd will always return /
-//    after a call successful to exitable_chroot.
-// 2) Passing NULL for path returns to the original root
-//    at the time of first calling exitable_chroot (or
-//    previous NULL call).
-// The effect of #2 does not stack:
-//  exitable_chroot("/a");
-//  exitable_chroot("/b");
-//  exitable_chroot(NULL);
-// Would leave you at the root of where /a exists, not
-// the root where /b exists.
-// Returns true on success. On failure, the working directory
-// may be changed, but the chroot will not be.
-static bool exitable_chroot(const char *path)
-{
-	static int originalRoot = -1;
-	if(originalRoot < 0)
-		originalRoot = open("/", O_RDONLY);
-	if(originalRoot < 0)
-		return false;
+static int check_connection(Data *d)
+{
+	if(d->offlinePath)
+	{
+		char *db = g_strdup_printf("%s/%s.db", d->offlinePath, kOfflineRepo);
+		bool exists = g_file_test(db, G_FILE_TEST_EXISTS);
+		g_free(db);
+		if(!exists)
+			FAIL(1, , "No repository in %s; make one with --build-repo", d->offlinePath)
+		println("Installing offline from %s", d->offlinePath);
+	}
+	else
+	{
+		println("Checking internet connection...");
+		
+		if(run_shell(NULL, "curl -s -I --max-time 10 http://google.com > /dev/null 2>&1"))
+		{
+			println("\nPlease connect to the internet to continue the install.");
+			if(run_shell(NULL, "until curl -s -I --max-time 20 http://google.com > /dev/null 2>&1; do sleep 1; done"))
+				return 1;
+		}
+		
+		println("Connection to google.com available.");
+	}
+	return 0;
+}
+
+// Returns where the block device dev is mounted, or NULL if it isn't.
+// Free with g_free.
+static char * find_mount_point(const char *dev)
+{
+	char *contents = NULL;
+	char *real = realpath(dev, NULL);
+	if(!real || !g_file_get_contents("/proc/self/mounts", &contents, NULL, NULL))
+	{
+		free(real);
+		return NULL;
+	}
 	
-	int tmpcwd = open(".", O_RDONLY);
-	if(tmpcwd < 0)
-		return false;
+	char *mountPoint = NULL;
+	char **lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+	for(size_t i=0; !mountPoint && lines[i]!=NULL; ++i)
+	{
+		char **fields = g_strsplit(lines[i], " ", 3);
+		if(g_strv_length(fields) >= 2)
+		{
+			char *source = realpath(fields[0], NULL);
+			if(g_strcmp0(source, real) == 0)
+				mountPoint = g_strcompress(fields[1]); // Spaces are octal escaped
+			free(source);
+		}
+		g_strfreev(fields);
+	}
+	g_strfreev(lines);
+	free(real);
+	return mountPoint;
+}
+
+// Reads the journal an earlier install left on <dest>, before anything
+// (such as mkfs) changes it. If <dest> isn't mounted, it's mounted
+// read-only somewhere temporary for this.
+static void load_journal(Data *d)
+{
+	char *mountPoint = find_mount_point(d->dest);
+	char *tmp = NULL;
+	if(!mountPoint && d->ofstype && (tmp = g_dir_make_tmp("vos-installer-XXXXXX", NULL))
+	&& mount(d->dest, tmp, d->ofstype, MS_RDONLY|MS_NOSUID|MS_NODEV|MS_NOEXEC, "") == 0)
+		mountPoint = g_strdup(tmp);
 	
-	if((path && chdir(path)) || (!path && fchdir(originalRoot)))
+	if(mountPoint)
 	{
-		close(tmpcwd);
-		return false;
+		char *path = g_build_path("/", mountPoint, kJournalPath, NULL);
+		journal_load(d->journal, path);
+		g_free(path);
 	}
+	else
+		println("No journal found on %s, nothing to resume", d->dest);
 	
-	if(chroot("."))
+	if(tmp)
+	{
+		if(mountPoint)
+			umount(tmp);
+		rmdir(tmp);
+		g_free(tmp);
+	}
+	g_free(mountPoint);
+}
+
+// Makes the --image file the destination, and, without root, enters a
+// user namespace to install to it in. Called before any threads start.
+static bool setup_image(Data *d)
+{
+	if(d->dest || d->refind || d->replayPath)
+	{
+		println("--image can't be used with --dest, --refind or --replay");
+		return false;
+	}
+	gboolean created = FALSE;
+	if(!image_create(d->imagePath, d->imageSize, &created))
 	{
-		// Try to move back to previous directory. This could fail,
-		// in which case the cwd might change.
-		fchdir(tmpcwd);
-		close(tmpcwd);
+		println("Failed to make the image %s (%i)", d->imagePath, errno);
 		return false;
 	}
+	d->dest = g_strdup(d->imagePath);
+	// A new image has no filesystem to install to yet
+	if(created)
+		d->writeExt4 = true;
 
-	close(tmpcwd);
-	if(!path)
+	d->rootless = (geteuid() != 0);
+	if(d->rootless && !namespace_enter_user())
 	{
-		close(originalRoot);
-		originalRoot = -1;
+		println("Failed to make a user namespace to install the image without root (%i)", errno);
+		return false;
 	}
 	return true;
 }
 
-static int start(Data *d)
+// Takes the destination's properties from the image, the way udev would
+// have them for a partition
+static int image_dest(Data *d)
 {
-	println("Checking internet connection...");
-	
-	if(run_shell(0, "curl -s -I --max-time 10 http://google.com > /dev/null 2>&1"))
-	{
-		println("\nPlease connect to the internet to continue the install.");
-		if(run_shell(0, "until curl -s -I --max-time 20 http://google.com > /dev/null 2>&1; do sleep 1; done"))
-			return 1;
-	}
-	
-	println("Connection to google.com available.");
+	GHashTable *props = image_properties(d->dest);
+	if(!props)
+		FAIL(errno, , "Failed to read the image %s", d->dest)
+	d->partuuid = g_strdup(g_hash_table_lookup(props, "ID_PART_ENTRY_UUID"));
+	d->ofstype = g_strdup(g_hash_table_lookup(props, "ID_FS_TYPE"));
+	const char *sectors = g_hash_table_lookup(props, "ID_PART_ENTRY_SIZE");
+	d->destSize = sectors ? g_ascii_strtoull(sectors, NULL, 10) * 512 : 0;
+	g_hash_table_unref(props);
+	return 0;
+}
+
+// Takes the destination's properties from the scenario being replayed,
+// instead of from udev
+static int replay_dest(Data *d)
+{
+	const char *partuuid, *fstype;
+	gboolean removable;
+	if(!executor_find_dest(&partuuid, &fstype, &d->destSize, &removable))
+		FAIL(1, , "The scenario has no destination device")
+	d->partuuid = g_strdup(partuuid);
+	d->ofstype = g_strdup(fstype);
+	d->refindExternal = removable;
+	return 0;
+}
 
+static int find_dest(Data *d)
+{
 	// Get the PARTUUID of the destination drive before
 	// anything else. If anything it helps validate that
 	// it's a real drive. Also I'd rather the install fail
@@ -742,6 +1724,11 @@ static int start(Data *d)
 	// something's wrong with udev.
 	ensure_argument(d, &d->dest, "dest");
 	
+	if(executor_replaying())
+		return replay_dest(d);
+	if(d->imagePath)
+		return image_dest(d);
+	
 	struct udev *udev = udev_new();
 	if(!udev)
 		FAIL(1, , "udev unavailable")
@@ -805,22 +1792,30 @@ static int start(Data *d)
 	if(!d->partuuid)
 		FAIL(1, udev_unref(udev), "PARTUUID not found.")
 	d->ofstype = g_strdup(udev_device_get_property_value(installdev, "ID_FS_TYPE"));
+	// In 512-byte sectors, whatever the device's sector size
+	const char *sectors = udev_device_get_property_value(installdev, "ID_PART_ENTRY_SIZE");
+	d->destSize = sectors ? g_ascii_strtoull(sectors, NULL, 10) * 512 : 0;
 	udev_unref(udev);
+	executor_add_dest(d->partuuid, d->ofstype, d->destSize, d->refindExternal);
 	
-	return run_ext4(d);
+	if(d->resume)
+		load_journal(d);
+	return 0;
 }
 
 static int run_ext4(Data *d)
 {
 	if(!d->writeExt4)
-	{
-		step(d);
-		return mount_volume(d);
-	}
+		return 0;
 	
 	ensure_argument(d, &d->dest, "dest");
 	
-	int status = RUN(NULL, "udisksctl", "unmount", "-b", d->dest);
+	// Nothing mounts an image
+	int status = 0;
+	if(!d->imagePath)
+	{
+		status = RUN(NULL, "udisksctl", "unmount", "-b", d->dest);
+	}
 	// Don't worry if this fails, since it might not have been mounted at all
 	//if(status > 0)
 	//	return status;
@@ -842,62 +1837,151 @@ static int run_ext4(Data *d)
 			FAIL(-status, , "e2label failed with code %i.", -status)
 	}
 	
-	step(d);
-	return mount_volume(d);
+	// Whatever an earlier install did is gone
+	journal_clear(d->journal);
+	return 0;
+}
+
+// Whether path has something mounted on it
+static bool is_mounted(const char *path)
+{
+	char *parent = g_path_get_dirname(path);
+	struct stat st, pst;
+	bool mounted = stat(path, &st) == 0 && stat(parent, &pst) == 0 && st.st_dev != pst.st_dev;
+	g_free(parent);
+	return mounted;
+}
+
+// Mounts the --image on mountPath. Root mounts it through a loop device.
+// A user namespace can't, so fuse2fs mounts it instead (with FUSE, which
+// it can).
+static int mount_image(Data *d, const char *fstype)
+{
+	char *loop = image_attach(d->dest);
+	if(loop)
+	{
+		int r = mount(loop, d->mountPath, fstype, 0, "");
+		int err = errno;
+		g_free(loop);
+		if(r)
+			FAIL(err, , "Failed to mount %s (%i)", d->dest, err)
+		return 0;
+	}
+
+	// Kept in the foreground as the installer's own child, outside the
+	// step's cgroup, so it outlives the step and unmount_volume can wait
+	// for it to close the image
+	pid_t ppid = getpid();
+	supervisor_fork();
+	pid_t pid = fork();
+	if(pid == -1)
+	{
+		int err = errno;
+		supervisor_fork_failed();
+		FAIL(err, , "Failed to fork new process")
+	}
+	else if(pid == 0)
+	{
+		supervisor_prepare_child(ppid);
+		int null = open("/dev/null", O_RDWR);
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		execlp("fuse2fs", "fuse2fs", "-f", "-o", "fakeroot", d->dest, d->mountPath, (char *)NULL);
+		_exit(127);
+	}
+	supervisor_track(pid, "fuse2fs", 0, 0);
+	
+	// Ready once the mount appears, or failed if it exits first
+	for(guint i=0; i<1000; ++i)
+	{
+		siginfo_t info = {0};
+		if(is_mounted(d->mountPath))
+		{
+			d->fusePid = pid;
+			return 0;
+		}
+		if(waitid(P_PID, pid, &info, WEXITED|WNOHANG|WNOWAIT) == 0 && info.si_pid == pid)
+			break;
+		g_usleep(G_USEC_PER_SEC / 100);
+	}
+	
+	int status = 0;
+	kill(pid, SIGTERM);
+	wait_child(pid, &status, NULL);
+	int code = -exit_code(status);
+	if(code == 0)
+		code = 1;
+	FAIL(code, , "Failed to mount %s; without root, fuse2fs is needed (%i)", d->dest, code)
 }
 
 static int mount_volume(Data *d)
 {
 	ensure_argument(d, &d->dest, "dest");
 	
-	// Let udisks do the mounting, since it mounts the drive in a
-	// unique spot, unlike simply mounting at /mnt.
-	// Could do this with udisks dbus API but lazy.
-	
-	int rfd;
-	int status = RUN(&rfd, "udisksctl", "mount", "-b", d->dest);
-	if(status > 0)
-		return status;
-	status = -status;
-	
-	char buf[1024];
-	int num = read(rfd, buf, sizeof(buf));
-	
-	bool alreadyMounted = false;
-	if(status == 0)
+	// Mounted in the installer's own mount namespace, somewhere only it
+	// can see, so it doesn't matter if <dest> is mounted on the host
+	// already, and it's unmounted (with everything mounted under it)
+	// when the installer exits, whatever happens
+	const char *fstype = d->writeExt4 ? "ext4" : d->ofstype;
+	if(!fstype)
+		FAIL(1, , "Unknown filesystem type on %s", d->dest)
+	d->mountPath = g_dir_make_tmp("vos-installer-XXXXXX", NULL);
+	if(!d->mountPath)
+		FAIL(errno, , "Failed to make a mount point")
+	// A replay's target is just that directory, with the files the
+	// recorded install read
+	if(executor_replaying())
 	{
-		char *phrase = g_strdup_printf("Mounted %s at", d->dest);
-		int phraseLen = strlen(phrase);
-		const char *loc = g_strstr_len(buf, num, phrase);
-		g_free(phrase);
-		if(!loc)
-			FAIL(status, , "Unexpected output: %.*s", num, buf);
-		loc += phraseLen + 1; // +1 for space
-		const char *end = strchr(loc, '.');
-		if(!end)
-			FAIL(status, , "Unexpected output: %.*s", num, buf);
-		d->mountPath = g_strndup(loc, (end-loc));
+		if(!executor_restore_files(d->mountPath))
+			FAIL(1, , "Failed to restore the scenario's files")
 	}
-	else
+	else if(d->imagePath)
+	{
+		if(mount_image(d, fstype))
+		{
+			rmdir(d->mountPath);
+			g_free(d->mountPath);
+			d->mountPath = NULL;
+			return 1;
+		}
+	}
+	else if(mount(d->dest, d->mountPath, fstype, 0, ""))
 	{
-		static char phrase[] = "already mounted at";
-		const char *loc = g_strstr_len(buf, num, phrase);
-		if(!loc)
-			FAIL(status, , "Mount failed: %.*s", num, buf);
-		loc += sizeof(phrase) + 1; // +1 for " `", and the other +1 is the NULL byte
-		const char *end = strchr(loc, '\'');
-		if(!end)
-			FAIL(status, , "Unexpected output: %.*s", num, buf);
-		d->mountPath = g_strndup(loc, (end-loc));
-		println("%s already mounted", d->dest);
-		alreadyMounted = true;
+		int err = errno;
+		rmdir(d->mountPath);
+		g_free(d->mountPath);
+		d->mountPath = NULL;
+		FAIL(err, , "Failed to mount %s (%i)", d->dest, err)
 	}
 	
 	println("Mounted at %s", d->mountPath);
-	step(d);
+	progress_set_target(d->mountPath);
 
 	if(chdir(d->mountPath))
 		FAIL(errno, , "Failed to chdir to mount path")
+	
+	if(!journal_attach(d->journal, kJournalPath))
+		println("Warning: Failed to open %s/%s; this install can't be resumed", d->mountPath, kJournalPath);
+	if(!output_attach_log(kLogPath))
+		println("Warning: Failed to open %s/%s; this install won't be logged", d->mountPath, kLogPath);
+	
+	// An existing filesystem wasn't erased, so it's the free space that
+	// counts. Upgrading an existing install replaces packages rather
+	// than adding them, so that only gets a warning.
+	struct statvfs fs;
+	if(!d->writeExt4 && d->installSize > 0 && statvfs(".", &fs) == 0
+	&& (guint64)fs.f_bavail * fs.f_frsize < d->installSize)
+	{
+		guint64 available = (guint64)fs.f_bavail * fs.f_frsize;
+		if(g_file_test("var/lib/pacman/local", G_FILE_TEST_IS_DIR))
+		{
+			println("Warning: the install may need %.1f MiB, and %s has %.1f MiB free",
+				d->installSize / 1048576.0, d->dest, available / 1048576.0);
+		}
+		else
+			FAIL(1, , "%s doesn't have enough free space: the install needs %.1f MiB, and it has %.1f MiB free",
+				d->dest, d->installSize / 1048576.0, available / 1048576.0)
+	}
 
 	println("Creating directories");
 	
@@ -906,6 +1990,7 @@ static int mount_volume(Data *d)
 	if(d->refind)
 		TRY_MKDIR("boot/efi", 0755)
 	TRY_MKDIR("etc", 0755)
+	TRY_MKDIR("etc/pacman.d", 0755)
 	TRY_MKDIR("run", 0755)
 	TRY_MKDIR("dev", 0755)
 	TRY_MKDIR("var", 0755)
@@ -914,59 +1999,96 @@ static int mount_volume(Data *d)
 	TRY_MKDIR("var/cache/pacman/pkg", 0755)
 	TRY_MKDIR("var/lib", 0755)
 	TRY_MKDIR("var/lib/pacman", 0755)
+	TRY_MKDIR("var/lib/pacman/sync", 0755)
 	TRY_MKDIR("var/log", 0755)
 	TRY_MKDIR("tmp", 1777)
 	TRY_MKDIR("sys", 0555)
 	TRY_MKDIR("proc", 0555)
 	#undef TRY_MKDIR
 	
+	if(executor_replaying())
+		return 0;
 	println("Mounting temporary filesystems");
 
 	#define TRY_MOUNT(s, t, fs, f, data) { if(mount(s, t, fs, f, data) && errno != EBUSY) FAIL(errno, , "Failed to mount %s/" t, d->mountPath) }
 	TRY_MOUNT("proc", "proc", "proc", MS_NOSUID|MS_NOEXEC|MS_NODEV, "")
-	TRY_MOUNT("sys", "sys", "sysfs", MS_NOSUID|MS_NOEXEC|MS_NODEV|MS_RDONLY, "")
-	int efimnt = mount("efivarfs", "sys/firmware/efi/efivars", "efivarfs", MS_NOSUID|MS_NOEXEC|MS_NODEV, "");
-	TRY_MOUNT("udev", "dev", "devtmpfs", MS_NOSUID, "mode=0755")
+	if(d->rootless)
+	{
+		// A user namespace can't mount sysfs or devtmpfs, but it can
+		// bind the host's
+		TRY_MOUNT("/sys", "sys", NULL, MS_BIND|MS_REC, NULL)
+		TRY_MOUNT("/dev", "dev", NULL, MS_BIND|MS_REC, NULL)
+	}
+	else
+	{
+		TRY_MOUNT("sys", "sys", "sysfs", MS_NOSUID|MS_NOEXEC|MS_NODEV|MS_RDONLY, "")
+		mount("efivarfs", "sys/firmware/efi/efivars", "efivarfs", MS_NOSUID|MS_NOEXEC|MS_NODEV, ""); // Only on UEFI systems
+		TRY_MOUNT("udev", "dev", "devtmpfs", MS_NOSUID, "mode=0755")
+	}
 	TRY_MOUNT("devpts", "dev/pts", "devpts", MS_NOSUID|MS_NOEXEC, "gid=5,mode=0620")
 	TRY_MOUNT("shm", "dev/shm", "tmpfs", MS_NOSUID|MS_NODEV, "mode=1777")
 	TRY_MOUNT("run", "run", "tmpfs", MS_NOSUID|MS_NODEV, "mode=0755")
 	TRY_MOUNT("tmp", "tmp", "tmpfs", MS_NOSUID|MS_NODEV|MS_STRICTATIME, "mode=1777")
 	#undef TRY_MOUNT
-	
-	// Continue install
-	int r = run_pacstrap(d);
+	return 0;
+}
 
-	// Cleanup
+static int remove_entry(const char *path, UNUSED const struct stat *st, int type, UNUSED struct FTW *ftw)
+{
+	return (type == FTW_DP) ? rmdir(path) : unlink(path);
+}
 
-	// gpg-agent is a piece o' trash and loves to just hang around after
-	// running pacman-key, and it keeps the drive from being unmounted.
-	// XXX: Probably a better solution than this
-	status = RUN(NULL, "killall", "-u", "root", "gpg-agent");
+// Deletes the directory at path and everything in it, without following
+// symlinks. Returns false on failure.
+static bool remove_tree(const char *path)
+{
+	return nftw(path, remove_entry, 16, FTW_DEPTH|FTW_PHYS) == 0;
+}
 
-	println("Unmounting temporary filesystems");
-	errno = 0;
-	if(!chdir(d->mountPath))
+static int unmount_volume(Data *d)
+{
+	if(!d->mountPath)
+		return 0;
+	println("Unmounting %s", d->mountPath);
+	
+	// Nothing on the volume should be held open when it's unmounted
+	output_detach_log();
+	journal_detach(d->journal);
+	progress_set_target(NULL);
+	
+	// Anything a command left running there (such as gpg-agent) is
+	// killed when the installer exits, and the mounts go with the
+	// installer's namespace then anyway. This just takes them out of the
+	// way now, all at once.
+	if(executor_replaying())
 	{
-		umount("tmp");
-		umount("run");
-		umount("dev/shm");
-		umount("dev/pts");
-		umount("dev");
-		if(efimnt == 0)
-			umount("sys/firmware/efi/efivars");
-		umount("sys");
-		umount("proc");
+		if(chdir("/") || !remove_tree(d->mountPath))
+			println("Warning: Failed to remove %s (%i)", d->mountPath, errno);
 	}
-	if(errno)
-		println("Warning: Failed to unmount some. You may have to do this manually.");
-
-	if(!alreadyMounted)
+	else if(d->fusePid)
 	{
-		println("Unmounting volume");
-		// udisksctl not necessary for unmount
-		umount2(".", MNT_DETACH); // Lazy unmount
+		// fuse2fs only writes out and closes the image once it's
+		// unmounted, and would be killed with the namespace before then.
+		// If something is still open on it, stopping fuse2fs closes the
+		// image cleanly too.
+		if(chdir("/") || umount2(d->mountPath, 0))
+		{
+			kill(d->fusePid, SIGTERM);
+			umount2(d->mountPath, MNT_DETACH);
+		}
+		int status = 0;
+		wait_child(d->fusePid, &status, NULL);
+		d->fusePid = 0;
+		if(WIFEXITED(status) && WEXITSTATUS(status) == 0)
+			rmdir(d->mountPath);
+		else
+			println("Warning: fuse2fs failed to close %s", d->dest);
 	}
-	return r;
+	else if(chdir("/") == 0 && umount2(d->mountPath, MNT_DETACH) == 0)
+		rmdir(d->mountPath);
+	else
+		println("Warning: Failed to unmount %s (%i)", d->mountPath, errno);
+	return 0;
 }
 
 static bool search_file_for_line(FILE *file, const char *search)
@@ -994,69 +2116,1311 @@ static bool search_file_for_line(FILE *file, const char *search)
 	return false;
 }
 
-static int run_pacstrap(Data *d)
+// Copies the host's sync databases into the target's pacman database
+// directory. pacman gives downloaded databases the server's modification
+// time, and won't download them again unless the server's copy is newer,
+// so if the host's are up to date, syncing the target costs no downloads.
+static void copy_host_sync_dbs(Data *d)
 {
-	char *cachedir = g_build_path("/", d->mountPath, "var", "cache", "pacman", "pkg", NULL);
+	static const char *hostsync = "/var/lib/pacman/sync";
+	GDir *dir = g_dir_open(hostsync, 0, NULL);
+	if(!dir)
+		return;
 	
-	// Install base first before user packages. That way we can modify
-	// pacman.conf's repository list and download signing keys.
-	if(!d->skipPacstrap)
+	const char *name;
+	while((name = g_dir_read_name(dir)) != NULL)
 	{
-		int status;
-		if(d->refind)
+		if(!g_str_has_suffix(name, ".db"))
+			continue;
+		char *src = g_build_path("/", hostsync, name, NULL);
+		char *dst = g_build_path("/", d->mountPath, "var", "lib", "pacman", "sync", name, NULL);
+		int err = pkgcache_copy_file(src, dst);
+		if(err)
 		{
-			status = RUN(NULL,
-				"pacman",
-				"-r", d->mountPath,
-				"--cachedir", cachedir,
-				"--noconfirm",
-				"-Sy", "base", "refind-efi");
+			println("Warning: Failed to copy %s (%i)", src, err);
 		}
 		else
 		{
-			status = RUN(NULL,
-				"pacman",
-				"-r", d->mountPath,
-				"--cachedir", cachedir,
-				"--noconfirm",
-				"-Sy", "base");
+			println("Copied %s from host", name);
 		}
-		
-		if(status > 0)
+		g_free(src);
+		g_free(dst);
+	}
+	g_dir_close(dir);
+}
+
+// Splits d->packages into a NULL-terminated list of package names, leaving
+// out the empty strings created by two spaces between packages. Free with
+// g_strfreev.
+static char ** split_packages(Data *d)
+{
+	char **split = g_strsplit(d->packages, " ", -1);
+	size_t j = 0;
+	for(size_t i=0;split[i]!=NULL;++i)
+	{
+		if(split[i][0] == '\0')
 		{
-			g_free(cachedir);
-			return status;
+			g_free(split[i]);
+			continue;
 		}
-		else if(status < 0)
-			FAIL(-status, g_free(cachedir), "pacman failed with code %i.", -status)
+		if(g_strcmp0(split[i], "sudo") == 0)
+			d->enableSudoWheel = true;
+		split[j++] = split[i];
 	}
-	step(d);
+	split[j] = NULL;
+	return split;
+}
 
-	char *confpath = g_build_path("/", d->mountPath, "etc", "pacman.conf", NULL);
-	char *gpgdir = g_build_path("/", d->mountPath, "etc", "pacman.d", "gnupg", NULL);
+static void free_package(Package *package)
+{
+	g_free(package->repo);
+	g_free(package->name);
+	g_free(package->version);
+	g_free(package->filename);
+	g_free(package->sha256);
+	g_free(package->url);
+	g_free(package);
+}
+
+// The format of a package, as printed by pacman --print-format
+#define PACKAGE_FORMAT "%r %n %v %f %h %s %l"
+
+// Parses a line in PACKAGE_FORMAT. Returns NULL if it isn't one.
+static Package * parse_package_line(const char *line)
+{
+	char **fields = g_strsplit(line, " ", -1);
+	char *end = NULL;
+	Package *package = NULL;
+	if(g_strv_length(fields) == 7 && strstr(fields[6], "://"))
+	{
+		guint64 size = g_ascii_strtoull(fields[5], &end, 10);
+		if(end && *end == '\0')
+		{
+			package = g_new0(Package, 1);
+			package->repo = g_strdup(fields[0]);
+			package->name = g_strdup(fields[1]);
+			package->version = g_strdup(fields[2]);
+			package->filename = g_strdup(fields[3]);
+			package->sha256 = fields[4][0] ? g_strdup(fields[4]) : NULL;
+			package->size = size;
+			package->url = g_strdup(fields[6]);
+		}
+	}
+	g_strfreev(fields);
+	return package;
+}
 
-	// pacman-key init
+static Package * copy_package(const Package *package)
+{
+	Package *copy = g_new0(Package, 1);
+	copy->repo = g_strdup(package->repo);
+	copy->name = g_strdup(package->name);
+	copy->version = g_strdup(package->version);
+	copy->filename = g_strdup(package->filename);
+	copy->sha256 = g_strdup(package->sha256);
+	copy->size = package->size;
+	copy->url = g_strdup(package->url);
+	return copy;
+}
+
+// Asks pacman which packages the transaction in args (a NULL-terminated
+// pacman -S command line) would install, without installing anything.
+// Returns an array of Package in pacman's install order, or NULL if
+// pacman fails.
+static GPtrArray * resolve_packages(const char * const *args)
+{
+	GPtrArray *query = g_ptr_array_new();
+	for(size_t i=0;args[i]!=NULL;++i)
+		g_ptr_array_add(query, (char *)args[i]);
+	g_ptr_array_add(query, "--print");
+	g_ptr_array_add(query, "--print-format");
+	g_ptr_array_add(query, PACKAGE_FORMAT);
+	g_ptr_array_add(query, NULL);
+	
+	GString *output = g_string_new(NULL);
+	int status = run_full(NULL, output, TRUE, FALSE, NULL, (const char * const *)query->pdata);
+	g_ptr_array_free(query, TRUE);
+	if(status != 0)
+	{
+		g_string_free(output, TRUE);
+		return NULL;
+	}
+	
+	GPtrArray *packages = g_ptr_array_new_with_free_func((GDestroyNotify)free_package);
+	char **lines = g_strsplit(output->str, "\n", -1);
+	g_string_free(output, TRUE);
+	for(size_t i=0;lines[i]!=NULL;++i)
+	{
+		// Anything else pacman prints (such as database sync
+		// progress with -Sy) won't parse
+		Package *package = parse_package_line(lines[i]);
+		if(package)
+			g_ptr_array_add(packages, package);
+	}
+	g_strfreev(lines);
+	return packages;
+}
+
+// Returns a NULL-terminated pacman command line made of options (the
+// pacman executable and global options), operation, and targets (may be
+// NULL). Free with g_ptr_array_free(x, TRUE).
+static GPtrArray * pacman_args(GPtrArray *options, const char *operation, char **targets)
+{
+	GPtrArray *args = g_ptr_array_new();
+	for(guint i=0; i<options->len; ++i)
+		g_ptr_array_add(args, g_ptr_array_index(options, i));
+	g_ptr_array_add(args, (char *)operation);
+	for(size_t i=0; targets && targets[i]!=NULL; ++i)
+		g_ptr_array_add(args, targets[i]);
+	g_ptr_array_add(args, NULL);
+	return args;
+}
+
+// Start and end times of one pipelined download or install
+typedef struct
+{
+	gint64 start;
+	gint64 end;
+} Interval;
+
+typedef struct
+{
+	GPtrArray *options;
+	char *dbpath; // Separate database path for downloads
+	GPtrArray *batches; // Arrays of Package
+	Interval *downloads;
+	StepContext *step; // The step installing, which the downloads are part of
+	
+	GMutex lock;
+	GCond cond;
+	guint downloaded; // Number of batches downloaded
+	int status; // Download status, 0 while successful
+	bool stop;
+} Pipeline;
+
+// Downloads each batch of the pipeline in turn. pacman holds a lock on its
+// database path for the whole of a transaction, so downloads use a separate
+// database path, which shares the sync databases with the target's but has
+// no local database. Dependencies are already in their own batches, so
+// dependency checks are skipped to download only the batch itself.
+static void * thread_pipeline_download(void *data)
+{
+	Pipeline *p = data;
+	steps_enter(p->step);
+	for(guint i=0; i<p->batches->len; ++i)
 	{
-		char *args[] = {"pacman-key",
-			"--config", confpath,
-			"--gpgdir", gpgdir,
-			"--init",
-			NULL};
+		g_mutex_lock(&p->lock);
+		bool stop = p->stop;
+		g_mutex_unlock(&p->lock);
+		if(stop)
+			break;
 		
-		int status = run(NULL, (const char * const *)args);
-		if(status > 0)
-			return status;
-		else if(status < 0)
-			FAIL(-status, , "pacman-key --init failed with code %i.", -status)
+		GPtrArray *batch = g_ptr_array_index(p->batches, i);
+		char **targets = g_new0(char *, batch->len + 1);
+		for(guint j=0; j<batch->len; ++j)
+		{
+			Package *package = g_ptr_array_index(batch, j);
+			targets[j] = g_strdup_printf("%s/%s", package->repo, package->name);
+		}
 		
-		args[5] = "--populate";
+		GPtrArray *args = pacman_args(p->options, "-Sw", targets);
+		g_ptr_array_remove_index(args, args->len-1);
+		g_ptr_array_add(args, "--dbpath");
+		g_ptr_array_add(args, p->dbpath);
+		g_ptr_array_add(args, "--nodeps");
+		g_ptr_array_add(args, "--nodeps");
+		g_ptr_array_add(args, NULL);
 		
-		status = run(NULL, (const char * const *)args);
-		if(status > 0)
-			return status;
-		else if(status < 0)
-			FAIL(-status, , "pacman-key --populate failed with code %i.", -status)
+		p->downloads[i].start = g_get_monotonic_time();
+		int status = run(NULL, (const char * const *)args->pdata);
+		p->downloads[i].end = g_get_monotonic_time();
+		g_ptr_array_free(args, TRUE);
+		g_strfreev(targets);
+		
+		g_mutex_lock(&p->lock);
+		p->status = status;
+		if(status == 0)
+			p->downloaded = i+1;
+		g_cond_broadcast(&p->cond);
+		g_mutex_unlock(&p->lock);
+		if(status)
+			break;
+	}
+	
+	// Make sure the installer doesn't wait forever if stopped
+	g_mutex_lock(&p->lock);
+	if(p->downloaded < p->batches->len && p->status == 0)
+		p->status = 1;
+	g_cond_broadcast(&p->cond);
+	g_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+// Total time during which an interval in a overlaps one in b
+static gint64 intervals_overlap(const Interval *a, guint na, const Interval *b, guint nb)
+{
+	gint64 overlap = 0;
+	for(guint i=0; i<na; ++i)
+	{
+		for(guint j=0; j<nb; ++j)
+		{
+			gint64 start = MAX(a[i].start, b[j].start);
+			gint64 end = MIN(a[i].end, b[j].end);
+			if(end > start)
+				overlap += end - start;
+		}
+	}
+	return overlap;
+}
+
+// Returns the names from targets that should be marked as explicitly
+// installed: every target that is a package name, and the members of every
+// target that is a group. Free with g_ptr_array_unref.
+static GPtrArray * explicit_targets(GPtrArray *options, GPtrArray *resolved, char **targets)
+{
+	GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+	for(size_t i=0; targets[i]!=NULL; ++i)
+	{
+		bool found = false;
+		for(guint j=0; j<resolved->len && !found; ++j)
+			found = (g_strcmp0(((Package *)g_ptr_array_index(resolved, j))->name, targets[i]) == 0);
+		if(found)
+		{
+			g_ptr_array_add(names, g_strdup(targets[i]));
+			continue;
+		}
+		
+		char *group[] = {targets[i], NULL};
+		GPtrArray *args = pacman_args(options, "-Sgq", group);
+		GString *output = g_string_new(NULL);
+		if(run_full(NULL, output, TRUE, FALSE, NULL, (const char * const *)args->pdata) == 0)
+		{
+			char **members = g_strsplit(output->str, "\n", -1);
+			for(size_t j=0; members[j]!=NULL; ++j)
+				if(members[j][0] != '\0')
+					g_ptr_array_add(names, g_strdup(members[j]));
+			g_strfreev(members);
+		}
+		g_string_free(output, TRUE);
+		g_ptr_array_free(args, TRUE);
+	}
+	return names;
+}
+
+// Creates a temporary pacman database path that shares the sync
+// databases in syncdir but has nothing installed, so pacman resolves and
+// downloads from it as if for an empty system. Returns NULL on failure.
+// Remove with remove_temp_dbpath.
+static char * make_temp_dbpath(const char *syncdir)
+{
+	char *dbpath = g_dir_make_tmp("vos-installer-XXXXXX", NULL);
+	if(!dbpath)
+		return NULL;
+	char *dbsync = g_build_path("/", dbpath, "sync", NULL);
+	int r = symlink(syncdir, dbsync);
+	g_free(dbsync);
+	if(r)
+	{
+		rmdir(dbpath);
+		g_free(dbpath);
+		return NULL;
+	}
+	return dbpath;
+}
+
+// Removes and frees a path from make_temp_dbpath
+static void remove_temp_dbpath(char *dbpath)
+{
+	if(!dbpath)
+		return;
+	
+	// pacman may have created a lock file and an empty local database
+	char *path = g_build_path("/", dbpath, "sync", NULL);
+	unlink(path);
+	g_free(path);
+	path = g_build_path("/", dbpath, "local", NULL);
+	rmdir(path);
+	g_free(path);
+	path = g_build_path("/", dbpath, "db.lck", NULL);
+	unlink(path);
+	g_free(path);
+	rmdir(dbpath);
+	g_free(dbpath);
+}
+
+// Installs resolved (pacman's install order for targets) in batches, with
+// the download of each batch overlapping the install of the one before it.
+// pacman installs dependencies before the packages that need them, so each
+// batch only depends on itself and earlier batches. Everything is installed
+// as a dependency, and then the targets are marked explicitly installed.
+static int run_pacman_pipelined(Data *d, GPtrArray *options, GPtrArray *resolved, char **targets)
+{
+	Pipeline p = {0};
+	p.options = options;
+	p.step = steps_current_context();
+	p.batches = g_ptr_array_new_with_free_func((GDestroyNotify)g_ptr_array_unref);
+	for(guint i=0; i<resolved->len; ++i)
+	{
+		if(i % d->pipelineSize == 0)
+			g_ptr_array_add(p.batches, g_ptr_array_new());
+		g_ptr_array_add(g_ptr_array_index(p.batches, p.batches->len-1), g_ptr_array_index(resolved, i));
+	}
+	guint numBatches = p.batches->len;
+	if(numBatches == 0)
+	{
+		g_ptr_array_unref(p.batches);
+		return 0;
+	}
+	
+	char *targetsync = g_build_path("/", d->mountPath, "var", "lib", "pacman", "sync", NULL);
+	p.dbpath = make_temp_dbpath(targetsync);
+	g_free(targetsync);
+	if(!p.dbpath)
+	{
+		g_ptr_array_unref(p.batches);
+		FAIL(1, , "Failed to create download database path")
+	}
+	
+	p.downloads = g_new0(Interval, numBatches);
+	Interval *installs = g_new0(Interval, numBatches);
+	g_mutex_init(&p.lock);
+	g_cond_init(&p.cond);
+	
+	println("Installing %u packages in %u batches", resolved->len, numBatches);
+	gint64 start = g_get_monotonic_time();
+	GThread *downloader = g_thread_new("download", thread_pipeline_download, &p);
+	
+	int status = 0;
+	guint installed = 0;
+	for(; installed<numBatches && status == 0; ++installed)
+	{
+		g_mutex_lock(&p.lock);
+		while(p.downloaded <= installed && p.status == 0)
+			g_cond_wait(&p.cond, &p.lock);
+		status = (p.downloaded > installed) ? 0 : p.status;
+		g_mutex_unlock(&p.lock);
+		if(status)
+			break;
+		
+		GPtrArray *batch = g_ptr_array_index(p.batches, installed);
+		char **names = g_new0(char *, batch->len + 1);
+		for(guint j=0; j<batch->len; ++j)
+		{
+			Package *package = g_ptr_array_index(batch, j);
+			names[j] = g_strdup_printf("%s/%s", package->repo, package->name);
+		}
+		
+		println("Installing batch %u of %u", installed+1, numBatches);
+		GPtrArray *args = pacman_args(options, "-S", names);
+		g_ptr_array_remove_index(args, args->len-1);
+		g_ptr_array_add(args, "--asdeps");
+		g_ptr_array_add(args, "--needed");
+		g_ptr_array_add(args, NULL);
+		
+		installs[installed].start = g_get_monotonic_time();
+		status = run(NULL, (const char * const *)args->pdata);
+		installs[installed].end = g_get_monotonic_time();
+		g_ptr_array_free(args, TRUE);
+		g_strfreev(names);
+	}
+	
+	g_mutex_lock(&p.lock);
+	p.stop = true;
+	g_mutex_unlock(&p.lock);
+	g_thread_join(downloader);
+	gint64 wall = g_get_monotonic_time() - start;
+	
+	if(status == 0)
+	{
+		GPtrArray *explicit = explicit_targets(options, resolved, targets);
+		if(explicit->len > 0)
+		{
+			g_ptr_array_add(explicit, NULL);
+			GPtrArray *args = pacman_args(options, "-D", (char **)explicit->pdata);
+			g_ptr_array_remove_index(args, args->len-1);
+			g_ptr_array_add(args, "--asexplicit");
+			g_ptr_array_add(args, NULL);
+			status = run(NULL, (const char * const *)args->pdata);
+			g_ptr_array_free(args, TRUE);
+		}
+		g_ptr_array_unref(explicit);
+	}
+	
+	gint64 downloading = 0, installing = 0;
+	for(guint i=0; i<numBatches; ++i)
+	{
+		downloading += p.downloads[i].end - p.downloads[i].start;
+		installing += installs[i].end - installs[i].start;
+	}
+	gint64 overlap = intervals_overlap(p.downloads, numBatches, installs, installed);
+	println("Pipelined %u batches in %.1fs: downloading took %.1fs and installing %.1fs, overlapping for %.1fs",
+		numBatches,
+		wall / (double)G_USEC_PER_SEC,
+		downloading / (double)G_USEC_PER_SEC,
+		installing / (double)G_USEC_PER_SEC,
+		overlap / (double)G_USEC_PER_SEC);
+	
+	remove_temp_dbpath(p.dbpath);
+	
+	g_mutex_clear(&p.lock);
+	g_cond_clear(&p.cond);
+	g_free(p.downloads);
+	g_free(installs);
+	g_ptr_array_unref(p.batches);
+	return status;
+}
+
+// Adds the packages a transaction installed to the set recorded by
+// --lock. Later versions of a package replace earlier ones.
+static void lock_packages(Data *d, GPtrArray *options, GPtrArray *resolved, char **targets)
+{
+	if(!d->locked)
+	{
+		d->locked = g_ptr_array_new_with_free_func((GDestroyNotify)free_package);
+		d->lockExplicit = g_ptr_array_new_with_free_func(g_free);
+	}
+	
+	for(guint i=0; i<resolved->len; ++i)
+	{
+		Package *package = g_ptr_array_index(resolved, i);
+		guint j = 0;
+		for(; j<d->locked->len; ++j)
+			if(g_strcmp0(((Package *)g_ptr_array_index(d->locked, j))->name, package->name) == 0)
+				break;
+		if(j < d->locked->len)
+		{
+			free_package(g_ptr_array_index(d->locked, j));
+			g_ptr_array_index(d->locked, j) = copy_package(package);
+		}
+		else
+			g_ptr_array_add(d->locked, copy_package(package));
+	}
+	
+	if(!targets)
+		return;
+	GPtrArray *explicit = explicit_targets(options, resolved, targets);
+	for(guint i=0; i<explicit->len; ++i)
+	{
+		char *name = g_ptr_array_index(explicit, i);
+		bool found = false;
+		for(guint j=0; j<d->lockExplicit->len && !found; ++j)
+			found = (g_strcmp0(g_ptr_array_index(d->lockExplicit, j), name) == 0);
+		if(!found)
+			g_ptr_array_add(d->lockExplicit, g_strdup(name));
+	}
+	g_ptr_array_unref(explicit);
+}
+
+// Names of the files in dir
+static GHashTable * list_dir(const char *dir)
+{
+	GHashTable *names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	GDir *gdir = g_dir_open(dir, 0, NULL);
+	const char *name;
+	while(gdir && (name = g_dir_read_name(gdir)) != NULL)
+		g_hash_table_add(names, g_strdup(name));
+	if(gdir)
+		g_dir_close(gdir);
+	return names;
+}
+
+// Sums the sizes of the files in dir that aren't in before (from list_dir)
+static guint64 new_files_size(const char *dir, GHashTable *before)
+{
+	guint64 size = 0;
+	GDir *gdir = g_dir_open(dir, 0, NULL);
+	const char *name;
+	while(gdir && (name = g_dir_read_name(gdir)) != NULL)
+	{
+		if(g_hash_table_contains(before, name))
+			continue;
+		char *path = g_build_path("/", dir, name, NULL);
+		struct stat st;
+		if(stat(path, &st) == 0 && S_ISREG(st.st_mode))
+			size += st.st_size;
+		g_free(path);
+	}
+	if(gdir)
+		g_dir_close(gdir);
+	return size;
+}
+
+// Runs a pacman transaction. options is the pacman executable and its
+// global options, and operation and targets are added to it. Before the
+// transaction, packages are copied into cachedir from the seed directory.
+// With a shared package cache, pacman reads packages from the cache, and
+// anything it downloads into cachedir is added to the cache.
+static int run_pacman(Data *d, const char *cachedir, GPtrArray *options, const char *operation, char **targets)
+{
+	GPtrArray *callerOptions = options;
+	options = g_ptr_array_new();
+	for(guint i=0; i<callerOptions->len; ++i)
+		g_ptr_array_add(options, g_ptr_array_index(callerOptions, i));
+	if(d->cache)
+	{
+		g_ptr_array_add(options, "--cachedir");
+		g_ptr_array_add(options, (char *)pkgcache_get_path(d->cache));
+	}
+	
+	int status = 0;
+	char *op = g_strdup(operation);
+	bool pipeline = d->pipelineSize > 0 && targets;
+	if(pipeline && strchr(op, 'y'))
+	{
+		// The pipeline runs several transactions, so sync the
+		// databases once up front instead of in each of them
+		GPtrArray *args = pacman_args(options, "-Sy", NULL);
+		status = run(NULL, (const char * const *)args->pdata);
+		g_ptr_array_free(args, TRUE);
+		char *y = strchr(op, 'y');
+		memmove(y, y+1, strlen(y));
+	}
+	
+	GPtrArray *resolved = NULL;
+	if(status == 0 && (d->cache || d->seedPath || d->fetchConnections || d->lockPath || pipeline))
+	{
+		GPtrArray *args = pacman_args(options, op, targets);
+		resolved = resolve_packages((const char * const *)args->pdata);
+		g_ptr_array_free(args, TRUE);
+	}
+	
+	bool *cached = resolved ? g_new0(bool, resolved->len) : NULL;
+	if(resolved && d->cache)
+	{
+		guint hits = 0;
+		for(guint i=0; i<resolved->len; ++i)
+		{
+			Package *package = g_ptr_array_index(resolved, i);
+			if((cached[i] = pkgcache_lookup(d->cache, package->filename, package->sha256)))
+				++hits;
+		}
+		println("%u of %u packages in package cache", hits, resolved->len);
+	}
+	
+	if(resolved && d->seedPath)
+	{
+		const char **filenames = g_new(const char *, resolved->len + 1);
+		for(guint i=0; i<resolved->len; ++i)
+			filenames[i] = ((Package *)g_ptr_array_index(resolved, i))->filename;
+		filenames[resolved->len] = NULL;
+		
+		guint copied = pkgcache_seed(d->seedPath, cachedir, filenames);
+		println("Copied %u of %u packages from %s", copied, resolved->len, d->seedPath);
+		g_free(filenames);
+	}
+	
+	if(resolved && d->fetchConnections)
+	{
+		// Packages pacman will find in the shared cache don't need to
+		// be downloaded. Anything that fails to download is left for
+		// pacman to try.
+		FetchItem *items = g_new0(FetchItem, resolved->len);
+		guint numItems = 0;
+		for(guint i=0; i<resolved->len; ++i)
+		{
+			Package *package = g_ptr_array_index(resolved, i);
+			if(cached[i])
+				continue;
+			items[numItems].url = package->url;
+			items[numItems].filename = package->filename;
+			items[numItems].sha256 = package->sha256;
+			items[numItems].size = package->size;
+			++numItems;
+		}
+		
+		guint failed = fetch_files(cachedir, items, numItems, d->fetchConnections, &d->killing);
+		if(failed > 0 && !d->killing)
+			println("Failed to download %u packages, leaving them to pacman", failed);
+		g_free(items);
+	}
+	g_free(cached);
+	
+	if(status == 0)
+	{
+		// What pacman downloads itself is new in cachedir afterwards
+		GHashTable *before = (d->progressFd >= 0) ? list_dir(cachedir) : NULL;
+		if(pipeline && resolved)
+			status = run_pacman_pipelined(d, options, resolved, targets);
+		else
+		{
+			GPtrArray *args = pacman_args(options, op, targets);
+			status = run(NULL, (const char * const *)args->pdata);
+			g_ptr_array_free(args, TRUE);
+		}
+		if(before)
+		{
+			progress_downloaded(new_files_size(cachedir, before));
+			g_hash_table_unref(before);
+		}
+	}
+	
+	if(resolved && d->lockPath && status == 0)
+		lock_packages(d, options, resolved, targets);
+	
+	if(resolved)
+		g_ptr_array_unref(resolved);
+	g_free(op);
+	g_ptr_array_free(options, TRUE);
+	
+	if(d->cache && status == 0)
+	{
+		guint added = pkgcache_import(d->cache, cachedir);
+		if(added > 0)
+			println("Added %u packages to package cache", added);
+	}
+	return status;
+}
+
+#define LOCKFILE_HEADER "# vos-installer lockfile 1"
+
+// Writes the packages recorded by lock_packages to d->lockPath
+static int write_lockfile(Data *d)
+{
+	GString *lock = g_string_new(LOCKFILE_HEADER "\n");
+	for(guint i=0; d->lockExplicit && i<d->lockExplicit->len; ++i)
+		g_string_append_printf(lock, "explicit %s\n", (char *)g_ptr_array_index(d->lockExplicit, i));
+	for(guint i=0; d->locked && i<d->locked->len; ++i)
+	{
+		Package *package = g_ptr_array_index(d->locked, i);
+		g_string_append_printf(lock, "package %s %s %s %s %s %" G_GUINT64_FORMAT " %s\n",
+			package->repo,
+			package->name,
+			package->version,
+			package->filename,
+			package->sha256 ? package->sha256 : "",
+			package->size,
+			package->url);
+	}
+	
+	bool written = g_file_set_contents(d->lockPath, lock->str, lock->len, NULL);
+	g_string_free(lock, TRUE);
+	if(!written)
+		FAIL(1, , "Failed to write lockfile %s", d->lockPath)
+	println("Wrote %u packages to lockfile %s", d->locked ? d->locked->len : 0, d->lockPath);
+	return 0;
+}
+
+// Reads a lockfile written by write_lockfile. Returns the packages, and
+// sets *explicit to the names of the explicitly installed packages.
+// Returns NULL if the file can't be read or isn't a lockfile.
+static GPtrArray * read_lockfile(const char *path, GPtrArray **explicit)
+{
+	char *contents = NULL;
+	if(!g_file_get_contents(path, &contents, NULL, NULL))
+		return NULL;
+	if(!g_str_has_prefix(contents, LOCKFILE_HEADER "\n"))
+	{
+		g_free(contents);
+		return NULL;
 	}
+	
+	GPtrArray *packages = g_ptr_array_new_with_free_func((GDestroyNotify)free_package);
+	*explicit = g_ptr_array_new_with_free_func(g_free);
+	bool valid = true;
+	char **lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+	for(size_t i=1; valid && lines[i]!=NULL; ++i)
+	{
+		if(g_str_has_prefix(lines[i], "explicit "))
+			g_ptr_array_add(*explicit, g_strdup(lines[i] + strlen("explicit ")));
+		else if(g_str_has_prefix(lines[i], "package "))
+		{
+			Package *package = parse_package_line(lines[i] + strlen("package "));
+			if(package)
+				g_ptr_array_add(packages, package);
+			valid = (package != NULL);
+		}
+		else
+			valid = (lines[i][0] == '\0' || lines[i][0] == '#');
+	}
+	g_strfreev(lines);
+	
+	if(!valid)
+	{
+		g_ptr_array_unref(packages);
+		g_ptr_array_unref(*explicit);
+		*explicit = NULL;
+		return NULL;
+	}
+	return packages;
+}
+
+// Installs exactly the packages in d->fromLockPath, in one transaction.
+// Packages come from the shared cache, the seed directory or the offline
+// repository if they're there, and are downloaded otherwise. Everything
+// is checked against the lockfile's checksums before pacman sees it.
+static int install_from_lock(Data *d, const char *cachedir)
+{
+	GPtrArray *explicit = NULL;
+	GPtrArray *packages = read_lockfile(d->fromLockPath, &explicit);
+	if(!packages)
+		FAIL(1, , "Failed to read lockfile %s", d->fromLockPath)
+	
+	#define LOCK_CLEANUP { g_ptr_array_unref(packages); g_ptr_array_unref(explicit); g_free(cached); }
+	bool *cached = g_new0(bool, packages->len + 1);
+	for(guint i=0; i<packages->len; ++i)
+		if(!((Package *)g_ptr_array_index(packages, i))->sha256)
+			FAIL(1, LOCK_CLEANUP, "Lockfile %s has no checksum for %s", d->fromLockPath, ((Package *)g_ptr_array_index(packages, i))->name)
+	for(guint i=0; i<explicit->len; ++i)
+		if(g_strcmp0(g_ptr_array_index(explicit, i), "sudo") == 0)
+			d->enableSudoWheel = true;
+	println("Installing %u packages from lockfile %s", packages->len, d->fromLockPath);
+	
+	const char **filenames = g_new(const char *, packages->len + 1);
+	for(guint i=0; i<packages->len; ++i)
+		filenames[i] = ((Package *)g_ptr_array_index(packages, i))->filename;
+	filenames[packages->len] = NULL;
+	if(d->seedPath)
+		pkgcache_seed(d->seedPath, cachedir, filenames);
+	if(d->offlinePath)
+		pkgcache_seed(d->offlinePath, cachedir, filenames);
+	g_free(filenames);
+	
+	FetchItem *items = g_new0(FetchItem, packages->len);
+	guint numItems = 0;
+	for(guint i=0; i<packages->len; ++i)
+	{
+		Package *package = g_ptr_array_index(packages, i);
+		if(d->cache && (cached[i] = pkgcache_lookup(d->cache, package->filename, package->sha256)))
+			continue;
+		items[numItems].url = package->url;
+		items[numItems].filename = package->filename;
+		items[numItems].sha256 = package->sha256;
+		items[numItems].size = package->size;
+		++numItems;
+	}
+	
+	// Already present files are checked and skipped by the fetcher, so
+	// this verifies everything that isn't in the shared cache. Cache
+	// entries are stored by checksum, so pkgcache_lookup checked those.
+	guint missing = 0;
+	if(!d->offlinePath)
+		missing = fetch_files(cachedir, items, numItems, d->fetchConnections ? d->fetchConnections : 4, &d->killing);
+	for(guint i=0; d->offlinePath && i<numItems; ++i)
+	{
+		char *path = g_build_path("/", cachedir, items[i].filename, NULL);
+		char *sum = pkgcache_checksum_file(path);
+		if(g_strcmp0(sum, items[i].sha256) != 0)
+		{
+			println("%s is missing or doesn't match the lockfile", path);
+			++missing;
+		}
+		g_free(sum);
+		g_free(path);
+	}
+	g_free(items);
+	if(missing > 0)
+		FAIL(1, LOCK_CLEANUP, "%u packages from the lockfile are unavailable", missing)
+	
+	GPtrArray *args = g_ptr_array_new_with_free_func(g_free);
+	g_ptr_array_add(args, g_strdup("pacman"));
+	g_ptr_array_add(args, g_strdup("-r"));
+	g_ptr_array_add(args, g_strdup(d->mountPath));
+	g_ptr_array_add(args, g_strdup("--noconfirm"));
+	g_ptr_array_add(args, g_strdup("-U"));
+	g_ptr_array_add(args, g_strdup("--asdeps"));
+	for(guint i=0; i<packages->len; ++i)
+	{
+		Package *package = g_ptr_array_index(packages, i);
+		const char *dir = cached[i] ? pkgcache_get_path(d->cache) : cachedir;
+		g_ptr_array_add(args, g_build_path("/", dir, package->filename, NULL));
+	}
+	g_ptr_array_add(args, NULL);
+	int status = run(NULL, (const char * const *)args->pdata);
+	g_ptr_array_free(args, TRUE);
+	
+	if(status == 0 && explicit->len > 0)
+	{
+		args = g_ptr_array_new();
+		g_ptr_array_add(args, "pacman");
+		g_ptr_array_add(args, "-r");
+		g_ptr_array_add(args, d->mountPath);
+		g_ptr_array_add(args, "--noconfirm");
+		g_ptr_array_add(args, "-D");
+		g_ptr_array_add(args, "--asexplicit");
+		for(guint i=0; i<explicit->len; ++i)
+			g_ptr_array_add(args, g_ptr_array_index(explicit, i));
+		g_ptr_array_add(args, NULL);
+		status = run(NULL, (const char * const *)args->pdata);
+		g_ptr_array_free(args, TRUE);
+	}
+	
+	if(status == 0 && d->lockPath)
+	{
+		// Keep the set as is, including the explicit packages
+		if(!d->locked)
+		{
+			d->locked = g_ptr_array_new_with_free_func((GDestroyNotify)free_package);
+			d->lockExplicit = g_ptr_array_new_with_free_func(g_free);
+		}
+		for(guint i=0; i<packages->len; ++i)
+			g_ptr_array_add(d->locked, copy_package(g_ptr_array_index(packages, i)));
+		for(guint i=0; i<explicit->len; ++i)
+			g_ptr_array_add(d->lockExplicit, g_strdup(g_ptr_array_index(explicit, i)));
+	}
+	
+	LOCK_CLEANUP
+	#undef LOCK_CLEANUP
+	return status;
+}
+
+// Returns the directory the installer keeps things between installs in
+static const char * installer_cache_dir(Data *d)
+{
+	return d->cachePath ? d->cachePath : "/var/cache/vos-installer";
+}
+
+// Returns the directory signing keys are cached in. Free with g_free.
+static char * key_cache_dir(Data *d)
+{
+	return g_build_path("/", installer_cache_dir(d), "keys", NULL);
+}
+
+// Fetches the signing keys of every --repo into the key cache, racing
+// the keyservers. Offline, only keys already in the cache are available.
+// Missing keys aren't an error until add_repos needs them.
+static int fetch_keys(Data *d)
+{
+	if(!d->repos)
+		return 0;
+	
+	GPtrArray *fingerprints = g_ptr_array_new();
+	for(GList *it=d->repos; it!=NULL; it=it->next)
+		for(size_t i=0; ((Repo *)it->data)->keys[i]!=NULL; ++i)
+			g_ptr_array_add(fingerprints, ((Repo *)it->data)->keys[i]);
+	g_ptr_array_add(fingerprints, NULL);
+	
+	const char *defaultKeyservers[] = {
+		"hkps://keyserver.ubuntu.com",
+		"hkps://keys.openpgp.org",
+		"hkps://pgp.mit.edu",
+		NULL};
+	GPtrArray *keyservers = g_ptr_array_new();
+	for(GList *it=d->keyservers; it!=NULL; it=it->next)
+		g_ptr_array_add(keyservers, it->data);
+	for(size_t i=0; !d->keyservers && defaultKeyservers[i]!=NULL; ++i)
+		g_ptr_array_add(keyservers, (char *)defaultKeyservers[i]);
+	g_ptr_array_add(keyservers, NULL);
+	
+	char *keydir = key_cache_dir(d);
+	guint missing = keys_fetch((const char * const *)fingerprints->pdata,
+		d->offlinePath ? NULL : (const char * const *)keyservers->pdata,
+		keydir, &d->killing);
+	if(missing > 0)
+		println("%u signing keys unavailable", missing);
+	
+	g_free(keydir);
+	g_ptr_array_free(fingerprints, TRUE);
+	g_ptr_array_free(keyservers, TRUE);
+	return 0;
+}
+
+// Writes a pacman.conf that only knows the offline repository. Returns
+// its path, to be unlinked once done with, or NULL on failure.
+static char * write_offline_conf(Data *d)
+{
+	char *path = NULL;
+	int fd = g_file_open_tmp("vos-installer-XXXXXX.conf", &path, NULL);
+	if(fd < 0)
+		FAIL(NULL, , "Failed to write pacman.conf for offline install")
+	
+	// Official packages are only signed in their own repos' databases,
+	// so signatures in the offline repository are optional
+	char *conf = g_strdup_printf(
+		"[options]\n"
+		"Architecture = auto\n"
+		"SigLevel = Optional TrustedOnly\n"
+		"\n"
+		"[%s]\n"
+		"Server = file://%s\n",
+		kOfflineRepo, d->offlinePath);
+	ssize_t length = strlen(conf);
+	bool written = (write(fd, conf, length) == length);
+	close(fd);
+	g_free(conf);
+	if(!written)
+	{
+		unlink(path);
+		g_free(path);
+		FAIL(NULL, , "Failed to write pacman.conf for offline install")
+	}
+	return path;
+}
+
+// Ranks the host's mirrors, keeping the result in the package cache
+// directory if there is one. Returns the ranked mirrorlist, and sets
+// *hostconf to a copy of the host's pacman.conf that uses it, to be
+// unlinked once done with. Returns NULL if the host's mirrorlist should
+// be used as is.
+static char * rank_mirrors(Data *d, char **hostconf)
+{
+	*hostconf = NULL;
+	const char *dir = installer_cache_dir(d);
+	if(g_mkdir_with_parents(dir, 0755))
+		FAIL(NULL, , "Failed to create %s, using the host's mirrors", dir)
+	
+	char *ranked = g_build_path("/", dir, "mirrorlist", NULL);
+	char *contents = NULL;
+	if(!mirrors_rank("/etc/pacman.d/mirrorlist", ranked, d->mirrorCount, d->mirrorMaxHours, &d->killing)
+	|| !g_file_get_contents("/etc/pacman.conf", &contents, NULL, NULL))
+	{
+		g_free(ranked);
+		FAIL(NULL, , "Using the host's mirrors")
+	}
+	
+	// Point every repo that uses the host's mirrorlist at the ranking
+	GString *conf = g_string_new(NULL);
+	char **lines = g_strsplit(contents, "\n", -1);
+	for(size_t i=0; lines[i]!=NULL; ++i)
+	{
+		char *line = lines[i];
+		while(*line == ' ' || *line == '\t')
+			++line;
+		if(g_str_has_prefix(line, "Include") && strstr(line, "/etc/pacman.d/mirrorlist"))
+			g_string_append_printf(conf, "Include = %s\n", ranked);
+		else
+			g_string_append_printf(conf, "%s\n", lines[i]);
+	}
+	g_strfreev(lines);
+	g_free(contents);
+	
+	int fd = g_file_open_tmp("vos-installer-XXXXXX.conf", hostconf, NULL);
+	if(fd < 0 || write(fd, conf->str, conf->len) != (ssize_t)conf->len)
+	{
+		if(fd >= 0)
+		{
+			close(fd);
+			unlink(*hostconf);
+		}
+		g_free(*hostconf);
+		*hostconf = NULL;
+		g_free(ranked);
+		g_string_free(conf, TRUE);
+		FAIL(NULL, , "Failed to write pacman.conf for ranked mirrors, using the host's mirrors")
+	}
+	close(fd);
+	g_string_free(conf, TRUE);
+	return ranked;
+}
+
+// Resolves the packages the install would download, against the host's
+// sync databases (or the offline repository) as if nothing were installed
+// yet, or reads them from the lockfile. Packages from --repo repos aren't
+// known before their databases are synced, so if <packages> can't be
+// resolved, only base is. Returns NULL if nothing could be resolved.
+static GPtrArray * resolve_install_packages(Data *d)
+{
+	if(d->fromLockPath)
+	{
+		GPtrArray *explicit = NULL;
+		GPtrArray *packages = read_lockfile(d->fromLockPath, &explicit);
+		if(explicit)
+			g_ptr_array_unref(explicit);
+		return packages;
+	}
+	
+	const char *syncdir = d->offlinePath ? d->offlinePath : "/var/lib/pacman/sync";
+	char *dbpath = make_temp_dbpath(syncdir);
+	char *offlineconf = d->offlinePath ? write_offline_conf(d) : NULL;
+	if(!dbpath || (d->offlinePath && !offlineconf))
+	{
+		remove_temp_dbpath(dbpath);
+		g_free(offlineconf);
+		return NULL;
+	}
+	
+	GPtrArray *args = g_ptr_array_new();
+	g_ptr_array_add(args, "pacman");
+	g_ptr_array_add(args, "--dbpath");
+	g_ptr_array_add(args, dbpath);
+	if(offlineconf)
+	{
+		g_ptr_array_add(args, "--config");
+		g_ptr_array_add(args, offlineconf);
+	}
+	g_ptr_array_add(args, "-S");
+	g_ptr_array_add(args, "base");
+	if(d->refind)
+		g_ptr_array_add(args, "refind-efi");
+	guint baseLength = args->len;
+	
+	ensure_argument(d, &d->packages, "packages");
+	char **packages = split_packages(d);
+	for(size_t i=0;packages[i]!=NULL;++i)
+		g_ptr_array_add(args, packages[i]);
+	g_ptr_array_add(args, NULL);
+	
+	GPtrArray *resolved = resolve_packages((const char * const *)args->pdata);
+	if(!resolved && d->repos)
+	{
+		println("Some of <packages> are in --repo repos; only base is counted");
+		g_ptr_array_set_size(args, baseLength);
+		g_ptr_array_add(args, NULL);
+		resolved = resolve_packages((const char * const *)args->pdata);
+	}
+	
+	g_ptr_array_free(args, TRUE);
+	g_strfreev(packages);
+	if(offlineconf)
+		unlink(offlineconf);
+	g_free(offlineconf);
+	remove_temp_dbpath(dbpath);
+	return resolved;
+}
+
+// Estimates the download and installed size of the packages, and fails if
+// they won't fit on the destination. This runs before anything is erased
+// or downloaded. Downloads stay in the target's
+// package cache, so both count. Also estimates the download time from the
+// rate of the first mirror.
+static int check_install_size(Data *d)
+{
+	if(d->skipPacstrap)
+		return 0;
+	
+	GPtrArray *packages = resolve_install_packages(d);
+	if(!packages)
+	{
+		println("Couldn't resolve the packages to install, skipping the size check");
+		return 0;
+	}
+	
+	const char *syncdir = d->offlinePath ? d->offlinePath : "/var/lib/pacman/sync";
+	GHashTable *isizes = localrepo_read_installed_sizes(syncdir);
+	guint64 download = 0, installed = 0;
+	guint unknown = 0;
+	for(guint i=0; i<packages->len; ++i)
+	{
+		Package *package = g_ptr_array_index(packages, i);
+		download += package->size;
+		char *key = g_strdup_printf("%s-%s", package->name, package->version);
+		guint64 *isize = g_hash_table_lookup(isizes, key);
+		g_free(key);
+		if(isize)
+			installed += *isize;
+		else
+			++unknown;
+	}
+	guint numPackages = packages->len;
+	g_hash_table_unref(isizes);
+	g_ptr_array_unref(packages);
+	
+	d->installSize = download + installed;
+	progress_set_packages(numPackages, download);
+	println("%u packages: %.1f MiB to download, %.1f MiB installed", numPackages,
+		download / 1048576.0, installed / 1048576.0);
+	if(unknown > 0)
+		println("Installed size of %u packages unknown", unknown);
+	
+	// Leave room for the filesystem's own structures when it's made
+	// from scratch. An existing filesystem's free space is checked
+	// once it's mounted.
+	guint64 usable = d->destSize / 100 * 95;
+	if(d->writeExt4 && d->destSize > 0 && d->installSize > usable)
+		FAIL(1, , "%s is too small: the install needs %.1f MiB, and the partition has %.1f MiB (about %.1f MiB usable)",
+			d->dest, d->installSize / 1048576.0, d->destSize / 1048576.0, usable / 1048576.0)
+	
+	// A replay doesn't touch the network
+	if(download > 0 && !d->offlinePath && !executor_replaying())
+	{
+		double rate = mirrors_measure_rate("/etc/pacman.d/mirrorlist");
+		if(rate > 0)
+		{
+			guint seconds = download / rate;
+			println("Estimated download time: %um %02us at %.2f MiB/s", seconds / 60, seconds % 60, rate / 1048576.0);
+		}
+	}
+	return 0;
+}
+
+// Ranks the host's mirrors for the base install and the target's
+// mirrorlist. This runs alongside formatting and mounting the volume.
+static int rank_target_mirrors(Data *d)
+{
+	if(d->mirrorCount && !d->skipPacstrap && !d->fromLockPath)
+		d->rankedMirrors = rank_mirrors(d, &d->hostConf);
+	return 0;
+}
+
+// Where the target's keyring is initialized, out of the way of the
+// base install, whose packages' scriptlets use the real one
+static char * private_gpgdir(Data *d)
+{
+	return g_build_path("/", d->mountPath, "etc", "pacman.d", "gnupg.init", NULL);
+}
+
+// Initializes pacman's keyring for the target in a private directory.
+// This doesn't need anything from the target's base install, so it runs
+// alongside it. pacman-key --init can spend a long time waiting for
+// entropy.
+static int init_keyring(Data *d)
+{
+	char *gpgdir = private_gpgdir(d);
+	if(!remove_tree(gpgdir) && errno != ENOENT)
+	{
+		int err = errno;
+		FAIL(err, g_free(gpgdir), "Failed to remove %s (%i)", gpgdir, err)
+	}
+
+	char *args[] = {"pacman-key",
+		"--gpgdir", gpgdir,
+		"--init",
+		NULL};
+	
+	int status = run(NULL, (const char * const *)args);
+	g_free(gpgdir);
+	if(status > 0)
+		return status;
+	else if(status < 0)
+		FAIL(-status, , "pacman-key --init failed with code %i.", -status)
+	return 0;
+}
+
+// Moves the initialized keyring into place once the base install is
+// done, replacing any its scriptlets made, and populates it from the
+// keyring files the target's archlinux-keyring installed.
+static int populate_keyring(Data *d)
+{
+	char *private = private_gpgdir(d);
+	char *gpgdir = g_build_path("/", d->mountPath, "etc", "pacman.d", "gnupg", NULL);
+	char *keyrings = g_build_path("/", d->mountPath, "usr", "share", "pacman", "keyrings", NULL);
+
+	// It's already in place if this is running again, and was never
+	// really initialized in a replay
+	int err = 0;
+	if(g_file_test(private, G_FILE_TEST_IS_DIR)
+	&& ((!remove_tree(gpgdir) && errno != ENOENT) || rename(private, gpgdir)))
+		err = errno;
+	g_free(private);
+	if(err)
+		FAIL(err, {g_free(gpgdir); g_free(keyrings);}, "Failed to move the keyring to %s (%i)", gpgdir, err)
+
+	char *args[] = {"pacman-key",
+		"--gpgdir", gpgdir,
+		"--populate-from", keyrings,
+		"--populate",
+		NULL};
+	
+	int status = run(NULL, (const char * const *)args);
+	g_free(gpgdir);
+	g_free(keyrings);
+	if(status > 0)
+		return status;
+	else if(status < 0)
+		FAIL(-status, , "pacman-key --populate failed with code %i.", -status)
+	return 0;
+}
+
+// Without custom repos, the target's pacman.conf has nothing the host's
+// doesn't, so everything can go in one transaction. A lockfile already
+// lists every package, custom repos' included.
+static bool single_transaction(Data *d)
+{
+	return (d->fromLockPath || (d->singleSync && !d->repos)) && !d->skipPacstrap;
+}
+
+// Installs base first, before user packages. That way we can modify
+// pacman.conf's repository list and add signing keys.
+static int install_base(Data *d)
+{
+	if(d->skipPacstrap)
+		return 0;
+	
+	// Offline, both transactions only use the offline repository. A
+	// retry reuses the one already written.
+	if(d->offlinePath && !d->offlineConf && !(d->offlineConf = write_offline_conf(d)))
+		return 1;
+	
+	char *cachedir = g_build_path("/", d->mountPath, "var", "cache", "pacman", "pkg", NULL);
+	int status = 0;
+	if(d->fromLockPath)
+	{
+		status = install_from_lock(d, cachedir);
+		g_free(cachedir);
+		return status;
+	}
+	
+	GPtrArray *options = g_ptr_array_new();
+	g_ptr_array_add(options, "pacman");
+	g_ptr_array_add(options, "-r");
+	g_ptr_array_add(options, d->mountPath);
+	g_ptr_array_add(options, "--cachedir");
+	g_ptr_array_add(options, cachedir);
+	g_ptr_array_add(options, "--noconfirm");
+	
+	if(d->hostConf || d->offlineConf)
+	{
+		g_ptr_array_add(options, "--config");
+		g_ptr_array_add(options, d->offlineConf ? d->offlineConf : d->hostConf);
+	}
+	
+	if(d->singleSync)
+	{
+		// Sync once, up front, so that the transactions
+		// below don't need to
+		if(!d->offlineConf)
+			copy_host_sync_dbs(d);
+		GPtrArray *args = pacman_args(options, "-Sy", NULL);
+		status = run(NULL, (const char * const *)args->pdata);
+		g_ptr_array_free(args, TRUE);
+	}
+	
+	GPtrArray *targets = g_ptr_array_new();
+	g_ptr_array_add(targets, "base");
+	if(d->refind)
+		g_ptr_array_add(targets, "refind-efi");
+	
+	char **packages = NULL;
+	if(single_transaction(d))
+	{
+		ensure_argument(d, &d->packages, "packages");
+		packages = split_packages(d);
+		for(size_t i=0;packages[i]!=NULL;++i)
+			g_ptr_array_add(targets, packages[i]);
+	}
+	g_ptr_array_add(targets, NULL);
+	
+	if(status == 0)
+		status = run_pacman(d, cachedir, options, d->singleSync ? "-S" : "-Sy", (char **)targets->pdata);
+	g_ptr_array_free(options, TRUE);
+	g_ptr_array_free(targets, TRUE);
+	g_strfreev(packages);
+	g_free(cachedir);
+	
+	// The target's mirrorlist comes from pacman-mirrorlist in base
+	if(d->rankedMirrors && status == 0)
+	{
+		char *mirrorlist = g_build_path("/", d->mountPath, "etc", "pacman.d", "mirrorlist", NULL);
+		int error = pkgcache_copy_file(d->rankedMirrors, mirrorlist);
+		if(error)
+			println("Failed to write ranked mirrors to %s (%i)", mirrorlist, error);
+		g_free(mirrorlist);
+	}
+	// A retry still wants the ranked mirrors
+	if(d->hostConf && status == 0)
+	{
+		unlink(d->hostConf);
+		g_free(d->hostConf);
+		d->hostConf = NULL;
+	}
+	
+	if(status > 0)
+		return status;
+	else if(status < 0)
+		FAIL(-status, , "pacman failed with code %i.", -status)
+	return 0;
+}
+
+// Adds the --repo repos to the target's pacman.conf, and their signing
+// keys (fetched into the key cache alongside the base install) and any
+// --keyfile keys to its keyring
+static int add_repos(Data *d)
+{
+	char *confpath = g_build_path("/", d->mountPath, "etc", "pacman.conf", NULL);
+	char *keydir = key_cache_dir(d);
+	GPtrArray *keyfiles = g_ptr_array_new_with_free_func(g_free);
+	for(GList *it=d->keyfiles; it!=NULL; it=it->next)
+		g_ptr_array_add(keyfiles, g_strdup(it->data));
 
 	if(d->repos)
 	{
@@ -1081,109 +3445,94 @@ static int run_pacstrap(Data *d)
 					repo->server);
 			}
 			
-			println("Downloading signing keys for %s from pgp.mit.edu...", repo->name);
-			
-			size_t nkeys = g_strv_length(repo->keys);
-			char **args = g_new(char *, nkeys+7);
-			args[0] = "pacman-key";
-			args[1] = "--keyserver";
-			args[2] = "pgp.mit.edu";
-			args[3] = "--gpgdir";
-			args[4] = gpgdir;
-			args[5] = "--recv-keys";
-			for(size_t i=0;i<nkeys;++i)
-				args[6+i] = repo->keys[i];
-			args[nkeys+6] = NULL;
-			int status = run(NULL, (const char * const *)args);
-
-			if(status > 0)
-			{
-				g_free(args);
-				g_free(confpath);
-				g_free(gpgdir);
-				g_free(cachedir);
-				return status;
-			}
-
-			if(status < 0)
-			{
-				println("pacman-key --recv-keys on pgp.mit.edu failed with code %i", -status);
-				println("Trying pool.sks-keyservers.net");
-				args[2] = "pool.sks-keyservers.net";
-				status = run(NULL, (const char * const *)args);
-				if(status)
-				{
-					g_free(args);
-					g_free(confpath);
-					g_free(gpgdir);
-					g_free(cachedir);
-				}
-				
-				if(status > 0)
-					return status;
-				else if(status < 0)
-					FAIL(-status, , "pacman-key --recv-keys failed with code %i.", -status)
-			}
+			for(size_t i=0; repo->keys[i]!=NULL; ++i)
+				g_ptr_array_add(keyfiles, keys_get_path(keydir, repo->keys[i]));
 		}
 		
 		fclose(conf);
 	}
+	g_free(confpath);
+	g_free(keydir);
 	
-	step(d);
-	
-	if(d->skipPacstrap)
+	int status = 0;
+	if(keyfiles->len > 0)
 	{
-		g_free(confpath);
+		// All keys were fetched into the key cache alongside the base
+		// install, so this doesn't touch the network
+		for(guint i=0; i<keyfiles->len; ++i)
+		{
+			const char *keyfile = g_ptr_array_index(keyfiles, i);
+			if(!g_file_test(keyfile, G_FILE_TEST_IS_REGULAR))
+				FAIL(1, g_ptr_array_unref(keyfiles), "Signing key %s is unavailable", keyfile)
+		}
+		
+		println("Adding %u signing keys to pacman's keyring...", keyfiles->len);
+		char *gpgdir = g_build_path("/", d->mountPath, "etc", "pacman.d", "gnupg", NULL);
+		GPtrArray *args = g_ptr_array_new();
+		g_ptr_array_add(args, "pacman-key");
+		g_ptr_array_add(args, "--gpgdir");
+		g_ptr_array_add(args, gpgdir);
+		g_ptr_array_add(args, "--add");
+		for(guint i=0; i<keyfiles->len; ++i)
+			g_ptr_array_add(args, g_ptr_array_index(keyfiles, i));
+		g_ptr_array_add(args, NULL);
+		status = run(NULL, (const char * const *)args->pdata);
+		g_ptr_array_free(args, TRUE);
 		g_free(gpgdir);
-		g_free(cachedir);
-		step(d);
-		return run_genfstab(d);
 	}
+	g_ptr_array_unref(keyfiles);
+	
+	if(status > 0)
+		return status;
+	else if(status < 0)
+		FAIL(-status, , "pacman-key --add failed with code %i.", -status)
+	return 0;
+}
+
+// Installs <packages>, from the repos added by add_repos too, unless
+// install_base installed everything already
+static int install_packages(Data *d)
+{
+	if(d->skipPacstrap)
+		return 0;
+	if(single_transaction(d))
+		return d->lockPath ? write_lockfile(d) : 0;
 
 	ensure_argument(d, &d->packages, "packages");
-	char ** split = g_strsplit(d->packages, " ", -1);
-	size_t numPackages = 0;
-	for(size_t i=0;split[i]!=NULL;++i)
-		if(split[i][0] != '\0') // two spaces between packages create empty splits
-			numPackages++;
-	
-	char **args = g_new(char *, numPackages + 12);
-	args[0] = "pacman";
-	args[1] = "--noconfirm";
-	args[2] = "--root";
-	args[3] = d->mountPath;
-	args[4] = "--cachedir";
-	args[5] = cachedir;
-	args[6] = "--config";
-	args[7] = confpath;
-	args[8] = "--gpgdir";
-	args[9] = gpgdir;
-	args[10] = "-Syu";
-	for(size_t i=0,j=11;split[i]!=NULL;++i)
-	{
-		if(split[i][0] != '\0')
-		{
-			if(g_strcmp0(split[i], "sudo") == 0)
-				d->enableSudoWheel = true;
-			args[j++] = split[i];
-		}
-	}
-	args[numPackages+11] = '\0';
-		
-	int status = run(NULL, (const char * const *)args);
-	g_free(args);
-	g_strfreev(split);
+	char **packages = split_packages(d);
+	char *cachedir = g_build_path("/", d->mountPath, "var", "cache", "pacman", "pkg", NULL);
+	char *confpath = g_build_path("/", d->mountPath, "etc", "pacman.conf", NULL);
+	char *gpgdir = g_build_path("/", d->mountPath, "etc", "pacman.d", "gnupg", NULL);
+	
+	GPtrArray *options = g_ptr_array_new();
+	g_ptr_array_add(options, "pacman");
+	g_ptr_array_add(options, "--noconfirm");
+	g_ptr_array_add(options, "--root");
+	g_ptr_array_add(options, d->mountPath);
+	g_ptr_array_add(options, "--cachedir");
+	g_ptr_array_add(options, cachedir);
+	g_ptr_array_add(options, "--config");
+	g_ptr_array_add(options, d->offlineConf ? d->offlineConf : confpath);
+	g_ptr_array_add(options, "--gpgdir");
+	g_ptr_array_add(options, gpgdir);
+	
+	// With singleSync, this only downloads the databases of the repos
+	// added above. The others were synced by the base install.
+	int status = run_pacman(d, cachedir, options, "-Syu", packages);
+	g_ptr_array_free(options, TRUE);
+	g_strfreev(packages);
+	g_free(cachedir);
 	g_free(confpath);
 	g_free(gpgdir);
-	g_free(cachedir);
 	
 	if(status > 0)
 		return status;
 	else if(status < 0)
 		FAIL(-status, , "pacman failed with code %i.", -status)
 	
-	step(d);
-	return run_genfstab(d);
+	if(d->lockPath)
+		return write_lockfile(d);
+	return 0;
 }
 
 static int run_genfstab(Data *d)
@@ -1211,103 +3560,224 @@ static int run_genfstab(Data *d)
 	
 	fclose(fstab);
 	
-	step(d);
-	return run_chroot(d);
+	return 0;
 }
 
-static int run_chroot(Data *d)
+// Opens path in the target, relative to targetFd, like open in a
+// chroot. Where the kernel supports it, absolute symlinks and .. are
+// resolved as if the target were root, too. Returns -1 with errno set
+// on failure.
+static int target_open(Data *d, const char *path, int flags, mode_t mode)
 {
-	println("Changing root to %s", d->mountPath);
-	if(!exitable_chroot(d->mountPath))
-		FAIL(1, , "Chroot failed (must run as root).")
-	
-	step(d);
-	int r = set_passwd(d);
-	println("Leaving chroot");
-	exitable_chroot(NULL);
-	return r;
+	while(*path == '/')
+		++path;
+#ifdef SYS_openat2
+	struct open_how how = {0};
+	how.flags = flags | O_CLOEXEC;
+	how.mode = (flags & O_CREAT) ? mode : 0;
+	how.resolve = RESOLVE_IN_ROOT;
+	int fd = syscall(SYS_openat2, d->targetFd, path, &how, sizeof(how));
+	if(fd >= 0 || errno != ENOSYS)
+		return fd;
+#endif
+	return openat(d->targetFd, path, flags | O_CLOEXEC, mode);
 }
 
-static int chpasswd(Data *d, const char *user, const char *password)
+// Opens the directory in the target that path is in, and stores the
+// last component of path in name (free with g_free). Returns -1 with
+// errno set on failure.
+static int target_open_parent(Data *d, const char *path, char **name)
 {
-	println("Running chpasswd on %s", user);
-	
-	int fd[2];
-	if(pipe(fd) || NONBLOCK(fd[0]) || NONBLOCK(fd[1]))
-		FAIL(errno, , "Failed to open pipe")
-	
-	pid_t ppid = getpid();
-	pid_t pid = fork();
-	
-	if(pid == -1)
+	char *dir = g_path_get_dirname(path);
+	int fd = target_open(d, dir, O_RDONLY|O_DIRECTORY, 0);
+	g_free(dir);
+	*name = (fd >= 0) ? g_path_get_basename(path) : NULL;
+	return fd;
+}
+
+// Reads the whole file at path in the target into contents (free with
+// g_free), and its stat into st (if non-NULL). Returns false on failure.
+static bool target_read_file(Data *d, const char *path, char **contents, struct stat *st)
+{
+	int fd = target_open(d, path, O_RDONLY, 0);
+	if(fd < 0)
+		return false;
+
+	struct stat fst;
+	GString *buf = g_string_new(NULL);
+	bool ok = (fstat(fd, &fst) == 0);
+	char chunk[4096];
+	ssize_t num;
+	while(ok && (num = read(fd, chunk, sizeof(chunk))) != 0)
 	{
-		FAIL(errno, , "Failed to fork new process")
+		if(num > 0)
+			g_string_append_len(buf, chunk, num);
+		else if(errno != EINTR)
+			ok = false;
 	}
-	else if(pid == 0)
+	close(fd);
+
+	if(ok && st)
+		*st = fst;
+	*contents = g_string_free(buf, !ok);
+	if(ok && executor_recording())
+		executor_add_file(path, *contents);
+	return ok;
+}
+
+// Replaces the file at path in the target with contents, with the given
+// mode, by writing it next to path and renaming it over, like
+// g_file_set_contents. Returns false on failure.
+static bool target_write_file(Data *d, const char *path, const char *contents, mode_t mode)
+{
+	char *name = NULL;
+	int dir = target_open_parent(d, path, &name);
+	if(dir < 0)
+		return false;
+
+	char *tmp = g_strdup_printf(".%s.vos-installer", name);
+	int fd = openat(dir, tmp, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC, mode);
+	bool ok = (fd >= 0);
+	size_t len = strlen(contents);
+	for(size_t done=0; ok && done<len;)
 	{
-		close(fd[1]);
-		dup2(fd[0], STDIN_FILENO);
-		
-		// See run()
-		if(prctl(PR_SET_PDEATHSIG, SIGHUP))
-			abort();
-		if(getppid() != ppid)
-			abort();
-		
-		char * const args[] = {"chpasswd", NULL};
-		execvp("chpasswd", args);
-		abort();
+		ssize_t num = write(fd, contents + done, len - done);
+		if(num > 0)
+			done += num;
+		else if(num < 0 && errno != EINTR)
+			ok = false;
+	}
+	// fchmod, since mode was masked by the umask
+	if(fd >= 0)
+	{
+		ok = ok && fchmod(fd, mode) == 0 && fsync(fd) == 0;
+		ok = (close(fd) == 0) && ok;
 	}
+	ok = ok && renameat(dir, tmp, dir, name) == 0;
+	if(!ok && fd >= 0)
+		unlinkat(dir, tmp, 0);
 
-	int userlen = strlen(user);
-	int pwdlen = strlen(password);
-	
-	if(write(fd[1], user, userlen) != userlen 
-	|| write(fd[1], ":", 1) != 1
-	|| write(fd[1], password, pwdlen) != pwdlen
-	|| close(fd[1]))
+	close(dir);
+	g_free(tmp);
+	g_free(name);
+	return ok;
+}
+
+// Replaces every match of the (extended, multiline) regex pattern in the
+// file at path in the target with replacement, like sed -i -E, keeping
+// the file's mode. Done in-process, since forking sed for it costs more
+// than the edit. Returns false on failure.
+static bool edit_file(Data *d, const char *path, const char *pattern, const char *replacement)
+{
+	GRegex *regex = g_regex_new(pattern, G_REGEX_MULTILINE, 0, NULL);
+	char *contents = NULL;
+	struct stat st;
+	if(!regex || !target_read_file(d, path, &contents, &st))
 	{
-		FAIL(errno, , "Failed to write to chpasswd")
+		if(regex)
+			g_regex_unref(regex);
+		return false;
 	}
 
-	// See run()
-	int exitstatus = 0;
-	while(1)
-	{
-		fd_set rfds;
-		FD_ZERO(&rfds);
-		FD_SET(d->selfpipe[0], &rfds);
-		errno = 0;
-		select(d->selfpipe[0]+1, &rfds, NULL, NULL, NULL);
-		if(errno != 0 && errno != EINTR)
-			d->killing = true;
-		static char dummy[PIPE_BUF];
-		while(read(d->selfpipe[0], dummy, sizeof(dummy)) > 0);
-		
-		if(!d->killing)
-		{
-			errno = 0;
-			if(waitpid(pid, &exitstatus, WNOHANG) > 0)
-				break;
-			else if(errno == 0 || errno == EINTR) // 0 for WNOHANG
-				continue;
-		}
-		
-		// Something went wrong; stop the child process.
-		kill(pid, SIGKILL);
-		waitpid(pid, NULL, 0);
-		
-		if(d->killing)
-			FAIL(1, , "Install aborted")
-		else
-			FAIL(errno, , "Error monitoring process")
+	char *edited = g_regex_replace(regex, contents, -1, 0, replacement, 0, NULL);
+	g_regex_unref(regex);
+	bool ok = (edited != NULL);
+	if(ok && strcmp(edited, contents) != 0)
+		ok = target_write_file(d, path, edited, st.st_mode & 07777);
+	g_free(contents);
+	g_free(edited);
+	return ok;
+}
+
+// Stores the first match of the (multiline) regex pattern in the file
+// at path in the target in match, which is left empty if nothing
+// matches, like grep -m1. Returns false if the file can't be read.
+static bool find_in_file(Data *d, const char *path, const char *pattern, GString *match)
+{
+	GRegex *regex = g_regex_new(pattern, G_REGEX_MULTILINE, 0, NULL);
+	char *contents = NULL;
+	if(!regex || !target_read_file(d, path, &contents, NULL))
+	{
+		if(regex)
+			g_regex_unref(regex);
+		return false;
 	}
-	
-	int exit = 1;
-	if(WIFEXITED(exitstatus))
-		exit = WEXITSTATUS(exitstatus);
-	if(exit != 0)
-		FAIL(exit, , "chpasswd failed with code %i.", exit)
+
+	GMatchInfo *info = NULL;
+	if(g_regex_match(regex, contents, 0, &info))
+	{
+		char *text = g_match_info_fetch(info, 0);
+		g_string_assign(match, text);
+		g_free(text);
+	}
+	g_match_info_free(info);
+	g_regex_unref(regex);
+	g_free(contents);
+	return true;
+}
+
+// The steps between these two work in the target, without the installer
+// leaving the host's root: their commands are chrooted into it (see
+// run_full), and they open files relative to targetFd. The chroot helper
+// is started in the target, so the steps' commands are spawned from a
+// small process instead of forking the installer for each.
+static int enter_chroot(Data *d)
+{
+	println("Changing root to %s for the target's commands", d->mountPath);
+	d->targetFd = open(d->mountPath, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if(d->targetFd < 0)
+		FAIL(errno, , "Failed to open %s", d->mountPath)
+
+	// Nothing really runs in a replay's target
+	if(executor_replaying())
+		return 0;
+
+	supervisor_fork();
+	d->helper = helper_start(d->mountPath, cgroup_home_fd(), &d->helperPid);
+	if(d->helper)
+	{
+		supervisor_track(d->helperPid, "chroot", 0, 0);
+		return 0;
+	}
+
+	int err = errno;
+	supervisor_fork_failed();
+	if(err == EPERM)
+		FAIL(1, , "Chroot failed (must run as root).")
+	println("Failed to start the chroot helper, forking for each command instead");
+	return 0;
+}
+
+static int leave_chroot(Data *d)
+{
+	println("Leaving chroot");
+	if(d->helper)
+	{
+		// It exits once the commands it's running are done, which
+		// they are by now
+		helper_stop(d->helper);
+		d->helper = NULL;
+		wait_child(d->helperPid, NULL, NULL);
+	}
+	if(d->targetFd >= 0)
+		close(d->targetFd);
+	d->targetFd = -1;
+	return 0;
+}
+
+static int chpasswd(UNUSED Data *d, const char *user, const char *password)
+{
+	println("Running chpasswd on %s", user);
+
+	char *input = g_strdup_printf("%s:%s", user, password);
+	const char *args[] = {"chpasswd", NULL};
+	int status = run_full(NULL, NULL, TRUE, TRUE, input, args);
+	memset(input, 0, strlen(input));
+	g_free(input);
+	if(status > 0)
+		return status;
+	else if(status < 0)
+		FAIL(-status, , "chpasswd failed with code %i.", -status)
 	return 0;
 }
 
@@ -1317,16 +3787,14 @@ static int set_passwd(Data *d)
 	if(d->password[0] == '\0')
 	{
 		println("Skipping set password");
-		step(d);
-		return set_locale(d);
+		return 0;
 	}
 	
 	int status = 0;
 	if((status = chpasswd(d, "root", d->password)))
 		return status;
 	
-	step(d);
-	return set_locale(d);
+	return 0;
 }
 
 static int set_locale(Data *d)
@@ -1339,62 +3807,44 @@ static int set_locale(Data *d)
 	char *localeesc = g_regex_escape_string(locale, -1);
 
 	// Remove comments from any lines matching the given locale prefix
-	char *pattern = g_strdup_printf("s/^#(%s.*$)/\\1/", localeesc);
-	int status = RUN(NULL, "sed", "-i", "-E", pattern, "/etc/locale.gen");
+	char *pattern = g_strdup_printf("^#(%s.*)$", localeesc);
+	bool edited = edit_file(d, "/etc/locale.gen", pattern, "\\1");
 	g_free(pattern);
-	if(status > 0)
-	{
-		g_free(localeesc);
-		return status;
-	}
-	else if(status < 0)
-		FAIL(-status, g_free(localeesc), "Edit of /etc/locale.gen failed with code %i.", -status)
-	
+	if(!edited)
+		FAIL(1, g_free(localeesc), "Edit of /etc/locale.gen failed.")
+
 	// Write first locale match to /etc/locale.conf (for the LANG variable)
-	
-	pattern = g_strdup_printf("^%s", localeesc);
+
+	pattern = g_strdup_printf("^%s.*$", localeesc);
 	g_free(localeesc);
-	int fd;
-	status = RUN(&fd, "grep", "-m1", "-e", pattern, "/etc/locale.gen");
+	GString *match = g_string_new(NULL);
+	bool found = find_in_file(d, "/etc/locale.gen", pattern, match);
 	g_free(pattern);
-	if(status > 0)
-		return status;
-	else if(status < -1) // exit code of 1 means no lines found, not error
-		FAIL(-status, , "grep failed with code %i.", -status)
-	
-	int lconff = open("/etc/locale.conf", O_WRONLY|O_CREAT);
+	if(!found)
+		FAIL(1, g_string_free(match, TRUE), "Failed to read /etc/locale.gen.")
+
+	int lconff = target_open(d, "/etc/locale.conf", O_WRONLY|O_CREAT, 0644);
 	if(lconff < 0)
-		FAIL(errno, , "Failed to open locale.conf for writing")
+		FAIL(errno, g_string_free(match, TRUE), "Failed to open locale.conf for writing")
 	
 	write(lconff, "LANG=", 5);
 	
-	char buf[1024];
-	size_t num = 0;
-	while((num = read(fd, buf, sizeof(buf))) > 0)
-	{
-		// Only write until the first space
-		const char *space = strchr(buf, ' ');
-		if(space != NULL)
-			num = (space - buf);
-
-		if(write(lconff, buf, num) != (int)num)
-			FAIL(1, close(lconff);, "Failed to write %lu bytes to locale.conf", num)
-		
-		if(space != NULL)
-			break;
-	}	
+	// Only write until the first space
+	size_t num = strcspn(match->str, " \n");
+	if(write(lconff, match->str, num) != (ssize_t)num)
+		FAIL(1, close(lconff); g_string_free(match, TRUE);, "Failed to write %lu bytes to locale.conf", num)
+	g_string_free(match, TRUE);
 	write(lconff, "\n", 1);
 	close(lconff);
 
 	// Run locale-gen
-	status = RUN(NULL, "locale-gen");
+	int status = RUN_TARGET(NULL, "locale-gen");
 	if(status > 0)
 		return status;
 	else if(status < 0)
 		FAIL(-status, , "locale-gen failed with code %i.", -status)
 	
-	step(d);
-	return set_zone(d);
+	return 0;
 }
 
 static int set_zone(Data *d)
@@ -1407,8 +3857,13 @@ static int set_zone(Data *d)
 	char *path = g_build_path("/", "/usr/share/zoneinfo/", zone, NULL);
 	println("Symlinking %s to /etc/localtime", path);
 
+	char *name = NULL;
+	int etc = target_open_parent(d, "/etc/localtime", &name);
+	if(etc < 0)
+		FAIL(errno, g_free(path), "Failed to open /etc")
+
 	errno = 0;
-	if(symlink(path, "/etc/localtime"))
+	if(symlinkat(path, etc, name))
 	{
 		// Try to symlink first before deleting the file
 		// If unlink first, then symlink, and symlink fails, then the
@@ -1419,26 +3874,27 @@ static int set_zone(Data *d)
 		{
 			errno = 0;
 			println("/etc/localtime already exists, replacing");
-			if(!unlink("/etc/localtime"))
-				symlink(path, "/etc/localtime");
+			if(!unlinkat(etc, name, 0))
+				symlinkat(path, etc, name);
 		}
 	}
+	int err = errno;
+	close(etc);
+	g_free(name);
 	
-	if(errno)
-		FAIL(errno, g_free(path), "Error symlinking: %i", errno);
+	if(err)
+		FAIL(err, g_free(path), "Error symlinking: %i", err);
 	
-	step(d);
 	g_free(path);
 	
 	// Set /etc/adjtime
-	int status = RUN(NULL, "hwclock", "--systohc");
+	int status = RUN_TARGET(NULL, "hwclock", "--systohc");
 	if(status > 0)
 		return status;
 	else if(status < 0)
 		FAIL(-status, , "Failed to set system clock with error %i.", -status)
 	
-	step(d);
-	return set_hostname(d);
+	return 0;
 }
 
 static int set_hostname(Data *d)
@@ -1447,12 +3903,11 @@ static int set_hostname(Data *d)
 	if(d->hostname[0] == '\0')
 	{
 		println("Skipping setting hostname");
-		step(d);
-		return create_user(d);
+		return 0;
 	}
 	
 	println("Writing %s to hostname", d->hostname);
-	int hostf = open("/etc/hostname", O_WRONLY|O_CREAT);
+	int hostf = target_open(d, "/etc/hostname", O_WRONLY|O_CREAT, 0644);
 	if(hostf < 0)
 		FAIL(errno, , "Failed to open /etc/hostname for writing")
 	int len = strlen(d->hostname);
@@ -1460,8 +3915,27 @@ static int set_hostname(Data *d)
 	write(hostf, "\n", 1);
 	close(hostf);
 	
-	step(d);
-	return create_user(d);
+	return 0;
+}
+
+// Sets enableSudoWheel if sudo is one of <packages>, or one of the
+// lockfile's explicitly installed packages
+static void find_sudo(Data *d)
+{
+	if(d->fromLockPath)
+	{
+		GPtrArray *explicit = NULL;
+		GPtrArray *packages = read_lockfile(d->fromLockPath, &explicit);
+		for(guint i=0; explicit && i<explicit->len; ++i)
+			if(g_strcmp0(g_ptr_array_index(explicit, i), "sudo") == 0)
+				d->enableSudoWheel = true;
+		if(packages)
+			g_ptr_array_unref(packages);
+		if(explicit)
+			g_ptr_array_unref(explicit);
+	}
+	else if(d->packages)
+		g_strfreev(split_packages(d));
 }
 
 static int create_user(Data *d)
@@ -1470,12 +3944,10 @@ static int create_user(Data *d)
 	if(d->username[0] == '\0')
 	{
 		println("Skipping create user");
-		d->steps++; // create_user has two steps
-		step(d);
-		return enable_services(d);
+		return 0;
 	}
 	
-	int status = RUN(NULL, "useradd", "-m", "-G", "wheel", d->username);
+	int status = RUN_TARGET(NULL, "useradd", "-m", "-G", "wheel", d->username);
 	
 	if(status > 0)
 		return status;
@@ -1505,7 +3977,7 @@ static int create_user(Data *d)
 	}
 	else
 	{
-		int status = RUN(NULL, "chfn", "-f", d->name, d->username);
+		int status = RUN_TARGET(NULL, "chfn", "-f", d->name, d->username);
 		
 		if(status > 0)
 			return status;
@@ -1513,21 +3985,20 @@ static int create_user(Data *d)
 			FAIL(-status, , "Failed to create user, error code %i.", -status)
 	}
 	
-	step(d);
+	// A resumed install may have skipped the package install that
+	// would have noticed sudo
+	if(!d->enableSudoWheel)
+		find_sudo(d);
 	
 	// Enable sudo for user
 	if(d->enableSudoWheel)
 	{
 		println("Enabling sudo for user %s", d->username);
-		int status = RUN(NULL, "sed", "-i", "-E", "s/#\\s?(%wheel ALL=\\(ALL\\) ALL)/\\1/", "/etc/sudoers");
-		if(status > 0)
-			return status;
-		else if(status < 0)
-			FAIL(-status, , "Edit of /etc/sudoers failed with code %i.", -status)
+		if(!edit_file(d, "/etc/sudoers", "#\\s?(%wheel ALL=\\(ALL\\) ALL)", "\\1"))
+			FAIL(1, , "Edit of /etc/sudoers failed.")
 	}
 	
-	step(d);
-	return enable_services(d);
+	return 0;
 }
 
 static int enable_services(Data *d)
@@ -1536,8 +4007,7 @@ static int enable_services(Data *d)
 	if(d->services[0] == '\0')
 	{
 		println("No services to enable");
-		step(d);
-		return run_postcmd(d);
+		return 0;
 	}
 	
 	char ** split = g_strsplit(d->services, " ", -1);
@@ -1554,7 +4024,7 @@ static int enable_services(Data *d)
 			args[j++] = split[i];
 	args[numServices+2] = '\0';
 		
-	int status = run(NULL, (const char * const *)args);
+	int status = run_target(NULL, (const char * const *)args);
 	g_free(args);
 	g_strfreev(split);
 	
@@ -1563,8 +4033,7 @@ static int enable_services(Data *d)
 	else if(status < 0)
 		FAIL(-status, , "systemctl enable failed with code %i.", -status)
 	
-	step(d);
-	return run_postcmd(d);
+	return 0;
 }
 
 static int run_postcmd(Data *d)
@@ -1572,13 +4041,12 @@ static int run_postcmd(Data *d)
 	if(d->postcmds == NULL)
 	{
 		println("No postcmds");
-		step(d);
-		return install_refind(d);
+		return 0;
 	}
 	
 	for(GList *it=d->postcmds; it!=NULL; it=it->next)
 	{
-		int status = RUN(NULL, "/bin/sh", "-c", it->data);
+		int status = RUN_TARGET(NULL, "/bin/sh", "-c", it->data);
 		
 		if(status > 0)
 			return status;
@@ -1586,8 +4054,7 @@ static int run_postcmd(Data *d)
 			FAIL(-status, , "Postcmd '%s' failed with code %i.", (char *)it->data, -status)
 	}
 	
-	step(d);
-	return install_refind(d);
+	return 0;
 }
 
 static int install_refind(Data *d)
@@ -1595,18 +4062,17 @@ static int install_refind(Data *d)
 	if(!d->refind)
 	{
 		println("Not installing rEFInd bootmanager");
-		step(d);
 		return 0;
 	}
 
 	int status;
 	
-	// the run_pacstrap section will automatically install
+	// install_base will automatically install
 	// the 'refind-efi' package if d->refind
 	if(d->refindDest && d->refindExternal)
 	{
 		println("Installing rEFInd external EFI standard location");
-		status = RUN(NULL, "refind-install", "--yes", "--usedefault", d->refindDest);
+		status = RUN_TARGET(NULL, "refind-install", "--yes", "--usedefault", d->refindDest);
 	}
 	else if(d->refindDest && !d->refindExternal)
 	{
@@ -1619,27 +4085,214 @@ static int install_refind(Data *d)
 		// an install location, which is not what the user asked for.
 		// This should be good enough
 		
-		// boot/efi created earlier
-		// also in chroot still, so use absolute path
-		if(mount(d->refindDest, "/boot/efi", "vfat", MS_SYNCHRONOUS, "") && errno != EBUSY)
-			FAIL(errno, , "Failed to mount EFI partition")
+		// boot/efi created earlier. The installer is still in the
+		// host's root, and the mount shows up in the target.
+		char *efi = g_build_path("/", d->mountPath, "boot", "efi", NULL);
+		if(!executor_replaying() && mount(d->refindDest, efi, "vfat", MS_SYNCHRONOUS, "") && errno != EBUSY)
+			FAIL(errno, g_free(efi), "Failed to mount EFI partition")
 		
-		status = RUN(NULL, "refind-install", "--yes");
+		status = RUN_TARGET(NULL, "refind-install", "--yes");
 		
-		umount("/boot/efi");
+		umount(efi);
+		g_free(efi);
 	}
 	else
 	{
 		println("Installing rEFInd automatically");
 		
-		status = RUN(NULL, "refind-install", "--yes");
+		status = RUN_TARGET(NULL, "refind-install", "--yes");
 	}
 	
 	if(status > 0)
 		return status;
 	else if(status < 0)
 		FAIL(-status, , "refind-install failed with code %i.", -status)
+	return 0;
+}
+
+// Exports or prunes the target's package cache, once everything that
+// installs packages is done
+static int clean_target_cache(Data *d)
+{
+	if(d->targetCache == kTargetCacheKeep)
+		return 0;
+	
+	char *cachedir = g_build_path("/", d->mountPath, "var", "cache", "pacman", "pkg", NULL);
+	if(d->targetCache == kTargetCacheExport)
+	{
+		println("Moving the target's packages into %s", pkgcache_get_path(d->cache));
+		guint added = pkgcache_export(d->cache, cachedir);
+		println("Added %u packages to the package cache", added);
+	}
+	
+	// Anything left (signatures, partial downloads, and packages that
+	// failed to export) is removed either way
+	GDir *dir = g_dir_open(cachedir, 0, NULL);
+	if(!dir)
+		FAIL(1, g_free(cachedir), "Failed to open %s", cachedir)
 	
-	step(d);
+	guint64 freed = 0;
+	guint removed = 0;
+	const char *filename;
+	while((filename = g_dir_read_name(dir)))
+	{
+		char *path = g_build_path("/", cachedir, filename, NULL);
+		struct stat st;
+		if(lstat(path, &st) == 0 && S_ISREG(st.st_mode) && unlink(path) == 0)
+		{
+			freed += st.st_size;
+			++removed;
+		}
+		g_free(path);
+	}
+	g_dir_close(dir);
+	g_free(cachedir);
+	
+	if(removed > 0)
+		println("Removed %u files (%.1f MiB) from the target's package cache", removed, freed / 1048576.0);
 	return 0;
 }
+
+static void apply_policy_override(StepPolicy *policy, const PolicyOverride *o)
+{
+	if(!o)
+		return;
+	if(o->numSet > 0)
+		policy->timeout = o->policy.timeout;
+	if(o->numSet > 1)
+		policy->stall = o->policy.stall;
+	if(o->numSet > 2)
+		policy->retries = o->policy.retries;
+	if(o->numSet > 3)
+		policy->backoff = o->policy.backoff;
+}
+
+static void step_policy(const char *step, StepPolicy *policy, gpointer data)
+{
+	Data *d = data;
+	*policy = kDefaultPolicy;
+	for(size_t i=0; i<G_N_ELEMENTS(kPolicies); ++i)
+		if(g_strcmp0(kPolicies[i].step, step) == 0)
+			*policy = kPolicies[i].policy;
+	if(d->policies)
+	{
+		apply_policy_override(policy, g_hash_table_lookup(d->policies, "all"));
+		apply_policy_override(policy, g_hash_table_lookup(d->policies, step));
+	}
+	// Don't retry what's failing because the install was stopped
+	if(d->killing)
+		policy->retries = 0;
+}
+
+static gboolean journal_step_completed(const char *step, const char *hash, gpointer data)
+{
+	Data *d = data;
+	return d->resume && journal_contains(d->journal, step, hash);
+}
+
+static void journal_step_record(const char *step, const char *hash, gpointer data)
+{
+	Data *d = data;
+	journal_record(d->journal, step, hash);
+}
+
+// The inputs of each journaled step: everything its result depends on,
+// other than the steps before it. Arguments the step would wait for are
+// waited for here.
+
+static char * ext4_inputs(Data *d)
+{
+	return g_strdup_printf("%i %s %s", d->writeExt4, d->partuuid, d->newFSLabel);
+}
+
+static char * keyring_inputs(UNUSED Data *d)
+{
+	return g_strdup("");
+}
+
+static char * base_inputs(Data *d)
+{
+	GString *inputs = g_string_new(NULL);
+	g_string_append_printf(inputs, "%i %i %s", d->skipPacstrap, d->refind, d->offlinePath);
+	if(d->fromLockPath)
+	{
+		char *sha256 = pkgcache_checksum_file(d->fromLockPath);
+		g_string_append_printf(inputs, " %s", sha256);
+		g_free(sha256);
+	}
+	else if(single_transaction(d))
+	{
+		ensure_argument(d, &d->packages, "packages");
+		g_string_append_printf(inputs, " %s", d->packages);
+	}
+	return g_string_free(inputs, FALSE);
+}
+
+static char * repos_inputs(Data *d)
+{
+	GString *inputs = g_string_new(NULL);
+	for(GList *it=d->repos; it!=NULL; it=it->next)
+	{
+		Repo *repo = it->data;
+		char *keys = g_strjoinv(",", repo->keys);
+		g_string_append_printf(inputs, "repo %s %s %s %s\n", repo->name, repo->server, repo->siglevel, keys);
+		g_free(keys);
+	}
+	for(GList *it=d->keyfiles; it!=NULL; it=it->next)
+	{
+		char *sha256 = pkgcache_checksum_file(it->data);
+		g_string_append_printf(inputs, "keyfile %s\n", sha256);
+		g_free(sha256);
+	}
+	return g_string_free(inputs, FALSE);
+}
+
+static char * packages_inputs(Data *d)
+{
+	if(d->skipPacstrap || single_transaction(d))
+		return g_strdup_printf("%i %s", d->skipPacstrap, d->lockPath);
+	ensure_argument(d, &d->packages, "packages");
+	return g_strdup_printf("%s %s %s", d->packages, d->offlinePath, d->lockPath);
+}
+
+static char * fstab_inputs(Data *d)
+{
+	return g_strdup_printf("%s %s", d->partuuid, d->writeExt4 ? "ext4" : d->ofstype);
+}
+
+static char * locale_inputs(Data *d)
+{
+	ensure_argument(d, &d->locale, "locale");
+	return g_strdup(d->locale);
+}
+
+static char * zone_inputs(Data *d)
+{
+	ensure_argument(d, &d->zone, "zone");
+	return g_strdup(d->zone);
+}
+
+static char * hostname_inputs(Data *d)
+{
+	ensure_argument(d, &d->hostname, "hostname");
+	return g_strdup(d->hostname);
+}
+
+static char * services_inputs(Data *d)
+{
+	ensure_argument(d, &d->services, "services");
+	return g_strdup(d->services);
+}
+
+static char * refind_inputs(Data *d)
+{
+	return g_strdup_printf("%i %s %i", d->refind, d->refindDest, d->refindExternal);
+}
+
+static char * postcmd_inputs(Data *d)
+{
+	GString *inputs = g_string_new(NULL);
+	for(GList *it=d->postcmds; it!=NULL; it=it->next)
+		g_string_append_printf(inputs, "%s\n", (char *)it->data);
+	return g_string_free(inputs, FALSE);
+}
@@ -0,0 +1,290 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Ranks pacman mirrors by probing them in parallel.
+ */
+
+#include "mirrors.h"
+#include "fetch.h"
+#include "output.h"
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <curl/curl.h>
+
+// Mirrors probed at once
+#define PROBE_CONNECTIONS 16
+
+// Seconds before a mirror is counted as unreachable
+#define PROBE_TIMEOUT 10L
+
+// First line of a ranked mirrorlist, followed by the checksum of the
+// mirrorlist it was ranked from
+#define RANKED_HEADER "## Ranked by vos-installer from "
+
+typedef struct
+{
+	char *server; // As written in the mirrorlist
+	char *url; // Of the probe file
+	bool commented;
+	CURL *easy;
+	gboolean ok;
+	double latency; // Seconds until the first byte
+	double total; // Seconds for the whole file
+	curl_off_t size;
+} Mirror;
+
+static size_t on_write(UNUSED char *data, size_t size, size_t nmemb, UNUSED void *userdata)
+{
+	return size * nmemb;
+}
+
+// Returns a newly allocated copy of str with every find replaced
+static char * replace_all(const char *str, const char *find, const char *replace)
+{
+	char **parts = g_strsplit(str, find, -1);
+	char *joined = g_strjoinv(replace, parts);
+	g_strfreev(parts);
+	return joined;
+}
+
+static void free_mirror(Mirror *mirror)
+{
+	g_free(mirror->server);
+	g_free(mirror->url);
+	g_free(mirror);
+}
+
+// Reads the servers from the contents of a mirrorlist
+static GPtrArray * parse_mirrorlist(const char *contents)
+{
+	struct utsname uts;
+	const char *arch = (uname(&uts) == 0) ? uts.machine : "x86_64";
+
+	GPtrArray *mirrors = g_ptr_array_new_with_free_func((GDestroyNotify)free_mirror);
+	char **lines = g_strsplit(contents, "\n", -1);
+	for(size_t i=0; lines[i]!=NULL; ++i)
+	{
+		char *line = g_strstrip(lines[i]);
+		bool commented = (*line == '#');
+		while(*line == '#')
+			++line;
+		char **kv = g_strsplit(line, "=", 2);
+		if(g_strv_length(kv) == 2 && g_strcmp0(g_strstrip(kv[0]), "Server") == 0)
+		{
+			char *server = g_strstrip(kv[1]);
+			char *withRepo = replace_all(server, "$repo", "core");
+			char *base = replace_all(withRepo, "$arch", arch);
+
+			Mirror *mirror = g_new0(Mirror, 1);
+			mirror->server = g_strdup(server);
+			mirror->url = g_strconcat(base, "/core.db", NULL);
+			mirror->commented = commented;
+			g_ptr_array_add(mirrors, mirror);
+			g_free(withRepo);
+			g_free(base);
+		}
+		g_strfreev(kv);
+	}
+	g_strfreev(lines);
+	return mirrors;
+}
+
+static gint compare_mirror(gconstpointer a, gconstpointer b)
+{
+	const Mirror *ma = *(Mirror **)a;
+	const Mirror *mb = *(Mirror **)b;
+	if(ma->ok != mb->ok)
+		return ma->ok ? -1 : 1;
+	return (ma->total > mb->total) - (ma->total < mb->total);
+}
+
+static CURL * start_probe(CURLM *multi, Mirror *mirror)
+{
+	CURL *easy = curl_easy_init();
+	if(!easy)
+		return NULL;
+	curl_easy_setopt(easy, CURLOPT_URL, mirror->url);
+	curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, on_write);
+	curl_easy_setopt(easy, CURLOPT_PRIVATE, mirror);
+	curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(easy, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(easy, CURLOPT_TIMEOUT, PROBE_TIMEOUT);
+	curl_easy_setopt(easy, CURLOPT_USERAGENT, "vos-install-cli");
+	curl_multi_add_handle(multi, easy);
+	return easy;
+}
+
+// Probes every mirror, at most PROBE_CONNECTIONS at a time
+static void probe_mirrors(GPtrArray *mirrors, const volatile bool *cancel)
+{
+	fetch_init_curl();
+
+	CURLM *multi = curl_multi_init();
+	if(!multi)
+		return;
+
+	guint next = 0, active = 0;
+	while((next < mirrors->len || active > 0) && !(cancel && *cancel))
+	{
+		for(; next < mirrors->len && active < PROBE_CONNECTIONS; ++next)
+		{
+			Mirror *mirror = g_ptr_array_index(mirrors, next);
+			if((mirror->easy = start_probe(multi, mirror)))
+				++active;
+		}
+
+		int running = 0;
+		curl_multi_perform(multi, &running);
+
+		CURLMsg *msg;
+		int queued;
+		while((msg = curl_multi_info_read(multi, &queued)))
+		{
+			if(msg->msg != CURLMSG_DONE)
+				continue;
+			Mirror *mirror = NULL;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&mirror);
+			if(msg->data.result == CURLE_OK)
+			{
+				mirror->ok = TRUE;
+				curl_easy_getinfo(mirror->easy, CURLINFO_STARTTRANSFER_TIME, &mirror->latency);
+				curl_easy_getinfo(mirror->easy, CURLINFO_TOTAL_TIME, &mirror->total);
+				curl_easy_getinfo(mirror->easy, CURLINFO_SIZE_DOWNLOAD_T, &mirror->size);
+			}
+			curl_multi_remove_handle(multi, mirror->easy);
+			curl_easy_cleanup(mirror->easy);
+			mirror->easy = NULL;
+			--active;
+		}
+
+		if(active > 0)
+			curl_multi_poll(multi, NULL, 0, 100, NULL);
+	}
+
+	// Only left over if cancelled
+	for(guint i=0; i<mirrors->len; ++i)
+	{
+		Mirror *mirror = g_ptr_array_index(mirrors, i);
+		if(mirror->easy)
+		{
+			curl_multi_remove_handle(multi, mirror->easy);
+			curl_easy_cleanup(mirror->easy);
+			mirror->easy = NULL;
+		}
+	}
+	curl_multi_cleanup(multi);
+}
+
+// Checks if out is a ranking of the mirrorlist with checksum sum, made
+// less than ttlHours ago
+static gboolean is_ranking_fresh(const char *out, const char *sum, guint ttlHours)
+{
+	struct stat st;
+	if(stat(out, &st) != 0 || time(NULL) - st.st_mtime >= (time_t)ttlHours * 3600)
+		return FALSE;
+
+	char *contents = NULL;
+	if(!g_file_get_contents(out, &contents, NULL, NULL))
+		return FALSE;
+	char *header = g_strconcat(RANKED_HEADER, sum, "\n", NULL);
+	gboolean fresh = g_str_has_prefix(contents, header);
+	g_free(header);
+	g_free(contents);
+	return fresh;
+}
+
+gboolean mirrors_rank(const char *mirrorlist, const char *out, guint count, guint ttlHours, const volatile bool *cancel)
+{
+	g_return_val_if_fail(mirrorlist && out, FALSE);
+
+	char *contents = NULL;
+	gsize length = 0;
+	if(!g_file_get_contents(mirrorlist, &contents, &length, NULL))
+	{
+		output_println("Failed to read %s", mirrorlist);
+		return FALSE;
+	}
+
+	char *sum = g_compute_checksum_for_data(G_CHECKSUM_SHA256, (const guchar *)contents, length);
+	if(ttlHours > 0 && is_ranking_fresh(out, sum, ttlHours))
+	{
+		output_println("Using mirrors ranked within the last %u hours from %s", ttlHours, out);
+		g_free(sum);
+		g_free(contents);
+		return TRUE;
+	}
+
+	GPtrArray *mirrors = parse_mirrorlist(contents);
+	g_free(contents);
+	output_println("Probing %u mirrors...", mirrors->len);
+
+	gint64 start = g_get_monotonic_time();
+	probe_mirrors(mirrors, cancel);
+	g_ptr_array_sort(mirrors, compare_mirror);
+
+	GString *ranked = g_string_new(NULL);
+	g_string_append_printf(ranked, RANKED_HEADER "%s\n", sum);
+	guint written = 0;
+	for(guint i=0; i<mirrors->len && written<count; ++i)
+	{
+		Mirror *mirror = g_ptr_array_index(mirrors, i);
+		if(!mirror->ok)
+			break;
+		double transfer = mirror->total - mirror->latency;
+		double rate = transfer > 0 ? mirror->size / transfer : 0;
+		output_println("  %.0f ms, %.2f MiB/s: %s", mirror->latency * 1000, rate / 1048576.0, mirror->server);
+		g_string_append_printf(ranked, "## %.0f ms, %.2f MiB/s\nServer = %s\n",
+			mirror->latency * 1000, rate / 1048576.0, mirror->server);
+		++written;
+	}
+	output_println("Probed mirrors in %.1fs", (g_get_monotonic_time() - start) / (double)G_USEC_PER_SEC);
+
+	gboolean success = FALSE;
+	if(written == 0)
+		output_println("No mirrors responded");
+	else if(!(cancel && *cancel))
+		success = g_file_set_contents(out, ranked->str, ranked->len, NULL);
+
+	g_string_free(ranked, TRUE);
+	g_ptr_array_free(mirrors, TRUE);
+	g_free(sum);
+	return success;
+}
+
+double mirrors_measure_rate(const char *mirrorlist)
+{
+	g_return_val_if_fail(mirrorlist, 0);
+
+	char *contents = NULL;
+	if(!g_file_get_contents(mirrorlist, &contents, NULL, NULL))
+		return 0;
+	GPtrArray *mirrors = parse_mirrorlist(contents);
+	g_free(contents);
+
+	// pacman uses the first server that isn't commented out
+	for(guint i=0; i<mirrors->len;)
+	{
+		if(((Mirror *)g_ptr_array_index(mirrors, i))->commented)
+			g_ptr_array_remove_index(mirrors, i);
+		else
+			++i;
+	}
+	if(mirrors->len > 1)
+		g_ptr_array_set_size(mirrors, 1);
+
+	probe_mirrors(mirrors, NULL);
+	double rate = 0;
+	if(mirrors->len > 0)
+	{
+		Mirror *mirror = g_ptr_array_index(mirrors, 0);
+		if(mirror->ok && mirror->total > 0)
+			rate = mirror->size / mirror->total;
+	}
+	g_ptr_array_free(mirrors, TRUE);
+	return rate;
+}
@@ -0,0 +1,29 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Ranks pacman mirrors by probing them in parallel, and writes the
+ * fastest to a new mirrorlist.
+ */
+
+#include <glib.h>
+#include <stdbool.h>
+
+/*
+ * Times the download of core's database (a small file every mirror has)
+ * from each server in mirrorlist, including commented out ones, and
+ * writes the count fastest to out, fastest first. If out was ranked from
+ * the same mirrorlist less than ttlHours ago, it's kept as is. Stops
+ * probing early if *cancel becomes true. Returns FALSE if out couldn't be
+ * written, or no mirror responded.
+ */
+gboolean mirrors_rank(const char *mirrorlist, const char *out, guint count, guint ttlHours, const volatile bool *cancel);
+
+/*
+ * Measures the download rate, in bytes per second, from the server
+ * pacman would use first in mirrorlist, by downloading core's database
+ * from it. The rate includes the time to connect, like a real download.
+ * Returns 0 if it couldn't be measured.
+ */
+double mirrors_measure_rate(const char *mirrorlist);
@@ -0,0 +1,261 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Runs the install in its own mount and PID namespaces, and those in a
+ * user namespace when run without root.
+ */
+
+#define _GNU_SOURCE
+#include "namespace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <grp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mount.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+static pid_t child;
+static pid_t parent; // Of this process, outside the namespaces
+
+// Passes signals sent with kill (or sigqueue) on to the installer, and
+// the SIGHUP asked for when the parent exits. Signals from the terminal
+// already reach it, since it's in the same process group, and passing
+// those on too would count as a second abort.
+static void forward_signal(int sig, siginfo_t *info, UNUSED void *context)
+{
+	if((info->si_code <= 0 || getppid() != parent) && child > 0)
+		kill(child, sig);
+}
+
+static int pidfd_open(pid_t pid)
+{
+	return syscall(SYS_pidfd_open, pid, 0);
+}
+
+gboolean namespace_enter(void)
+{
+	if(unshare(CLONE_NEWNS|CLONE_NEWPID))
+		return FALSE;
+
+	// Slave, so that the host unmounting <dest> (as udisks does before
+	// it's formatted) applies in here too
+	if(mount(NULL, "/", NULL, MS_REC|MS_SLAVE, NULL))
+		return FALSE;
+
+	// Closes when this process exits, so the child can tell if it
+	// already had before it asked for a signal when it does
+	int alive[2];
+	if(pipe2(alive, O_CLOEXEC))
+		return FALSE;
+
+	parent = getppid();
+	child = fork();
+	if(child < 0)
+	{
+		close(alive[0]);
+		close(alive[1]);
+		return FALSE;
+	}
+	if(child == 0)
+	{
+		close(alive[1]);
+		// getppid is 0 in the new namespace, so the supervisor can't
+		// watch the parent itself. SIGHUP aborts the install.
+		prctl(PR_SET_PDEATHSIG, SIGHUP);
+		struct pollfd fd = {alive[0], POLLIN, 0};
+		if(poll(&fd, 1, 0) != 0)
+			_exit(1);
+		close(alive[0]);
+		return TRUE;
+	}
+	close(alive[0]);
+
+	struct sigaction action = {0};
+	action.sa_sigaction = forward_signal;
+	action.sa_flags = SA_SIGINFO|SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGHUP, &action, NULL);
+
+	// The installer's parent is outside its PID namespace, so it can't
+	// watch it; this process does, and hangs the installer up when the
+	// parent exits. Without pidfds, it asks for SIGHUP then instead.
+	int childfd = pidfd_open(child);
+	int parentfd = (childfd >= 0) ? pidfd_open(parent) : -1;
+	if(parentfd < 0)
+		prctl(PR_SET_PDEATHSIG, SIGHUP);
+	if(getppid() != parent)
+		kill(child, SIGHUP);
+	while(parentfd >= 0)
+	{
+		struct pollfd fds[] = {{childfd, POLLIN, 0}, {parentfd, POLLIN, 0}};
+		if(poll(fds, 2, -1) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		if(fds[1].revents)
+		{
+			kill(child, SIGHUP);
+			close(parentfd);
+			parentfd = -1;
+		}
+		if(fds[0].revents)
+			break;
+	}
+
+	// By the time the installer is reaped, so is everything else in its
+	// namespaces, and its mounts are gone
+	int status;
+	pid_t pid;
+	while((pid = waitpid(child, &status, 0)) < 0 && errno == EINTR);
+	exit((pid > 0 && WIFEXITED(status)) ? WEXITSTATUS(status) : 1);
+}
+
+// Writes the string to the file at path. Returns false on failure.
+static bool write_file(const char *path, const char *contents)
+{
+	int fd = open(path, O_WRONLY|O_CLOEXEC);
+	if(fd < 0)
+		return false;
+	size_t len = strlen(contents);
+	bool ok = (write(fd, contents, len) == (ssize_t)len);
+	return (close(fd) == 0) && ok;
+}
+
+// Finds the first range of subordinate ids in file (/etc/subuid or
+// /etc/subgid) for the user with the given name or id. Returns false if
+// there's none.
+static bool find_subids(const char *file, const char *name, guint id, guint64 *start, guint64 *count)
+{
+	char *contents = NULL;
+	if(!g_file_get_contents(file, &contents, NULL, NULL))
+		return false;
+	char *idstr = g_strdup_printf("%u", id);
+	char **lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+	bool found = false;
+	for(size_t i=0; !found && lines[i]!=NULL; ++i)
+	{
+		// <user name or id>:<first id>:<count>
+		char **fields = g_strsplit(lines[i], ":", 3);
+		if(g_strv_length(fields) == 3 && (g_strcmp0(fields[0], name) == 0 || strcmp(fields[0], idstr) == 0))
+		{
+			*start = g_ascii_strtoull(fields[1], NULL, 10);
+			*count = g_ascii_strtoull(fields[2], NULL, 10);
+			found = (*count > 0);
+		}
+		g_strfreev(fields);
+	}
+	g_strfreev(lines);
+	g_free(idstr);
+	return found;
+}
+
+// Maps root to id and 1 and up to the subordinate ids, in pid's user
+// namespace, with tool (newuidmap or newgidmap). Returns false on failure.
+static bool map_subids(const char *tool, const char *file, pid_t pid, const char *name, guint id)
+{
+	guint64 start, count;
+	if(!find_subids(file, name, id, &start, &count))
+		return false;
+
+	char *pidstr = g_strdup_printf("%d", pid);
+	char *idstr = g_strdup_printf("%u", id);
+	char *startstr = g_strdup_printf("%" G_GUINT64_FORMAT, start);
+	char *countstr = g_strdup_printf("%" G_GUINT64_FORMAT, count);
+	const char *args[] = {tool, pidstr, "0", idstr, "1", "1", startstr, countstr, NULL};
+	pid_t mapper = fork();
+	if(mapper == 0)
+	{
+		execvp(tool, (char * const *)args);
+		_exit(127);
+	}
+	int status = 0;
+	while(mapper > 0 && waitpid(mapper, &status, 0) < 0 && errno == EINTR);
+	g_free(pidstr);
+	g_free(idstr);
+	g_free(startstr);
+	g_free(countstr);
+	return mapper > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+gboolean namespace_enter_user(void)
+{
+	uid_t uid = geteuid();
+	gid_t gid = getegid();
+	struct passwd *pw = getpwuid(uid);
+	char *name = g_strdup(pw ? pw->pw_name : NULL);
+
+	// newuidmap and newgidmap have to map the new namespace from outside
+	// it, so a child does that once it's been made
+	int sync[2];
+	if(pipe2(sync, O_CLOEXEC))
+	{
+		g_free(name);
+		return FALSE;
+	}
+	pid_t parent = getpid();
+	pid_t mapper = fork();
+	if(mapper == 0)
+	{
+		close(sync[1]);
+		char c;
+		if(read(sync[0], &c, 1) != 1)
+			_exit(1);
+		bool mapped = map_subids("newuidmap", "/etc/subuid", parent, name, uid)
+			&& map_subids("newgidmap", "/etc/subgid", parent, name, gid);
+		_exit(mapped ? 0 : 1);
+	}
+	close(sync[0]);
+	g_free(name);
+
+	bool unshared = (mapper > 0 && unshare(CLONE_NEWUSER) == 0);
+	int err = errno;
+	if(unshared)
+		write(sync[1], "", 1);
+	close(sync[1]);
+	int status = 1;
+	while(mapper > 0 && waitpid(mapper, &status, 0) < 0 && errno == EINTR);
+	if(!unshared)
+	{
+		errno = err;
+		return FALSE;
+	}
+
+	if(WIFEXITED(status) && WEXITSTATUS(status) == 0)
+	{
+		// The host's supplementary groups aren't mapped
+		setgroups(0, NULL);
+		return TRUE;
+	}
+
+	// Without subordinate ids, only the user's own ids map, and setgroups
+	// has to be denied before the gid can be
+	char *uidmap = g_strdup_printf("0 %u 1\n", uid);
+	char *gidmap = g_strdup_printf("0 %u 1\n", gid);
+	bool mapped = write_file("/proc/self/uid_map", uidmap)
+		&& write_file("/proc/self/setgroups", "deny")
+		&& write_file("/proc/self/gid_map", gidmap);
+	g_free(uidmap);
+	g_free(gidmap);
+	return mapped;
+}
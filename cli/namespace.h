@@ -0,0 +1,35 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Runs the install in its own mount and PID namespaces. Nothing the
+ * installer mounts shows up on the host, and when the installer exits,
+ * the kernel kills whatever its children left running (such as
+ * gpg-agent) and unmounts everything it mounted, all at once.
+ */
+
+#include <glib.h>
+
+/*
+ * Unshares the mount and PID namespaces and forks the installer into
+ * them, as the init of the new PID namespace. Mounts made on the host
+ * still show up inside, but not the other way around. This must be
+ * called before any threads start.
+ *
+ * Returns TRUE in the new process. The original process stays outside,
+ * passing on the stop signals it's sent, and exits with the new one's
+ * exit code, so this only returns to it (FALSE) on failure.
+ */
+gboolean namespace_enter(void);
+
+/*
+ * Unshares the user namespace, as a user without root, and maps the
+ * user to root in it, so that namespace_enter and the install's mounts
+ * (of filesystems a user namespace may mount) and chroots work. The
+ * user's subordinate ids (from /etc/subuid and /etc/subgid) are mapped
+ * too, with newuidmap and newgidmap, where those are set up, so that
+ * packages can own files as other users; otherwise only root is. This
+ * must be called before any threads start. Returns FALSE on failure.
+ */
+gboolean namespace_enter_user(void);
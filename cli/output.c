@@ -0,0 +1,391 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Multiplexes the output of child processes onto stdout and a log file.
+ */
+
+#define _GNU_SOURCE // splice, tee
+#include "output.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+// Default pipe capacity, and so the most a child's pipe holds at once
+#define PIPE_CHUNK (64 * 1024)
+// Most output kept for the log before it's attached
+#define MAX_PENDING_LOG (1024 * 1024)
+
+struct _OutputChild
+{
+	char *prefix; // "[label] ", or ""
+	int fd; // Read end of the child's pipe
+	GString *tail;
+	bool lineStart; // The next byte starts a line
+	bool eof;
+	bool finished;
+};
+
+// stdout, the log and everything about where lines are at are guarded
+// by stdout's lock (flockfile), so whole lines from the installer's own
+// printfs aren't broken up either. The rest is guarded by lock.
+static struct
+{
+	GMutex lock;
+	GCond cond; // Signaled when a child is finished
+	GPtrArray *finishing; // Children output_child_finish is waiting on
+	int epoll;
+	int wakefd;
+	int scratch[2]; // Pipe for peeking at a child's output
+	int logpipe[2]; // Pipe for duplicating a child's output to the log
+	int logfd;
+	GString *pending; // Output before the log was attached
+	bool spliceStdout; // False once stdout turns out not to support splice
+	bool spliceLog;
+	OutputChild *partial; // Child whose last line on stdout is unfinished
+} O = {.logfd = -1, .spliceStdout = true, .spliceLog = true};
+
+static void write_all(int fd, const char *data, size_t len)
+{
+	while(len > 0)
+	{
+		ssize_t r = write(fd, data, len);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			return;
+		data += r;
+		len -= r;
+	}
+}
+
+// Reads and throws away len bytes from the pipe fd
+static void discard(int fd, size_t len)
+{
+	static char buf[PIPE_CHUNK];
+	while(len > 0)
+	{
+		ssize_t r = read(fd, buf, MIN(len, sizeof(buf)));
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			return;
+		len -= r;
+	}
+}
+
+// Moves len bytes from the pipe from to to with splice, or where to
+// doesn't support that, writes data (a copy of the same bytes) instead.
+static void move_out(int from, int to, const char *data, size_t len, bool *canSplice)
+{
+	size_t moved = 0;
+	while(*canSplice && moved < len)
+	{
+		ssize_t r = splice(from, NULL, to, NULL, len - moved, SPLICE_F_MOVE);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+		{
+			if(r < 0 && errno == EINVAL)
+				*canSplice = false;
+			break;
+		}
+		moved += r;
+	}
+
+	if(moved < len)
+	{
+		discard(from, len - moved);
+		write_all(to, data + moved, len - moved);
+	}
+}
+
+// Writes data to the log, or keeps it for when the log is attached
+static void log_write(const char *data, size_t len)
+{
+	if(O.logfd >= 0)
+		write_all(O.logfd, data, len);
+	else if(!O.pending)
+		O.pending = g_string_new_len(data, MIN(len, MAX_PENDING_LOG));
+	else if(O.pending->len + len <= MAX_PENDING_LOG)
+		g_string_append_len(O.pending, data, len);
+}
+
+// Writes data to stdout and the log
+static void emit(const char *data, size_t len)
+{
+	write_all(STDOUT_FILENO, data, len);
+	log_write(data, len);
+}
+
+// Finishes the unfinished line of a child before something else is
+// written, so the child's next output starts with its prefix again
+static void end_partial(void)
+{
+	if(!O.partial)
+		return;
+	emit("\n", 1);
+	O.partial->lineStart = true;
+	O.partial = NULL;
+}
+
+// Moves a segment of the output at the front of child's pipe, a copy
+// of which is data, to the log and to stdout
+static void copy_segment(OutputChild *child, const char *data, size_t len)
+{
+	if(O.logfd >= 0)
+	{
+		ssize_t teed = O.spliceLog ? tee(child->fd, O.logpipe[1], len, SPLICE_F_NONBLOCK) : 0;
+		if(teed < 0)
+			teed = 0;
+		if(teed > 0)
+			move_out(O.logpipe[0], O.logfd, data, teed, &O.spliceLog);
+		if((size_t)teed < len)
+			write_all(O.logfd, data + teed, len - teed);
+	}
+	else
+		log_write(data, len);
+
+	move_out(child->fd, STDOUT_FILENO, data, len, &O.spliceStdout);
+}
+
+// Copies out what's in child's pipe. Returns false once the pipe is
+// empty (or closed).
+static bool pump(OutputChild *child)
+{
+	if(child->eof)
+		return false;
+
+	// Peek at the output to find where lines start, and keep its tail.
+	// This is the only copy of it made in userspace.
+	static char buf[PIPE_CHUNK];
+	ssize_t num = tee(child->fd, O.scratch[1], sizeof(buf), SPLICE_F_NONBLOCK);
+	if(num == 0 || (num < 0 && errno != EAGAIN && errno != EINTR))
+	{
+		child->eof = true;
+		epoll_ctl(O.epoll, EPOLL_CTL_DEL, child->fd, NULL);
+		return false;
+	}
+	if(num < 0)
+		return false;
+
+	ssize_t got = 0;
+	while(got < num)
+	{
+		ssize_t r = read(O.scratch[0], buf + got, num - got);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			break;
+		got += r;
+	}
+	num = got;
+
+	g_string_append_len(child->tail, buf, num);
+	if(child->tail->len > OUTPUT_TAIL_SIZE)
+		g_string_erase(child->tail, 0, child->tail->len - OUTPUT_TAIL_SIZE);
+
+	flockfile(stdout);
+	fflush(stdout);
+	size_t prefixLen = strlen(child->prefix);
+	for(ssize_t start=0; start<num;)
+	{
+		const char *newline = memchr(buf + start, '\n', num - start);
+		ssize_t end = newline ? (newline - buf) + 1 : num;
+		if(O.partial && O.partial != child)
+			end_partial();
+		if(child->lineStart)
+			emit(child->prefix, prefixLen);
+		copy_segment(child, buf + start, end - start);
+		child->lineStart = (newline != NULL);
+		O.partial = newline ? NULL : child;
+		start = end;
+	}
+	funlockfile(stdout);
+	return true;
+}
+
+static void finish(OutputChild *child)
+{
+	while(pump(child));
+	if(!child->eof)
+		epoll_ctl(O.epoll, EPOLL_CTL_DEL, child->fd, NULL);
+	close(child->fd);
+
+	flockfile(stdout);
+	if(O.partial == child)
+		end_partial();
+	funlockfile(stdout);
+
+	g_mutex_lock(&O.lock);
+	child->finished = true;
+	g_cond_broadcast(&O.cond);
+	g_mutex_unlock(&O.lock);
+}
+
+static gpointer thread_mux(UNUSED gpointer data)
+{
+	struct epoll_event events[16];
+	while(true)
+	{
+		int num = epoll_wait(O.epoll, events, G_N_ELEMENTS(events), -1);
+		if(num < 0 && errno != EINTR)
+			return NULL;
+
+		for(int i=0; i<num; ++i)
+		{
+			if(events[i].data.ptr)
+			{
+				pump(events[i].data.ptr);
+				continue;
+			}
+
+			// Woken to finish children
+			guint64 count;
+			(void)read(O.wakefd, &count, sizeof(count));
+			g_mutex_lock(&O.lock);
+			GPtrArray *finishing = O.finishing;
+			O.finishing = g_ptr_array_new();
+			g_mutex_unlock(&O.lock);
+			for(guint j=0; j<finishing->len; ++j)
+				finish(g_ptr_array_index(finishing, j));
+			g_ptr_array_unref(finishing);
+		}
+	}
+	return NULL;
+}
+
+gboolean output_start(void)
+{
+	g_mutex_init(&O.lock);
+	g_cond_init(&O.cond);
+	O.finishing = g_ptr_array_new();
+
+	O.epoll = epoll_create1(EPOLL_CLOEXEC);
+	O.wakefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if(O.epoll < 0 || O.wakefd < 0
+	|| pipe2(O.scratch, O_CLOEXEC) || pipe2(O.logpipe, O_CLOEXEC))
+		return FALSE;
+
+	struct epoll_event event = {0};
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if(epoll_ctl(O.epoll, EPOLL_CTL_ADD, O.wakefd, &event))
+		return FALSE;
+
+	g_thread_unref(g_thread_new("output", thread_mux, NULL));
+	return TRUE;
+}
+
+gboolean output_attach_log(const char *path)
+{
+	g_return_val_if_fail(path, FALSE);
+
+	char *dir = g_path_get_dirname(path);
+	int r = g_mkdir_with_parents(dir, 0755);
+	g_free(dir);
+	int fd = r ? -1 : open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0600);
+	if(fd < 0)
+		return FALSE;
+
+	flockfile(stdout);
+	if(O.logfd >= 0)
+		close(O.logfd);
+	O.logfd = fd;
+	if(O.pending)
+	{
+		write_all(fd, O.pending->str, O.pending->len);
+		g_string_free(O.pending, TRUE);
+		O.pending = NULL;
+	}
+	funlockfile(stdout);
+	return TRUE;
+}
+
+void output_detach_log(void)
+{
+	flockfile(stdout);
+	if(O.logfd >= 0)
+		close(O.logfd);
+	O.logfd = -1;
+	funlockfile(stdout);
+}
+
+void output_println(const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	char *text = g_strdup_vprintf(fmt, args);
+	va_end(args);
+	char *line = g_strconcat(text, "\n", NULL);
+	g_free(text);
+
+	flockfile(stdout);
+	fflush(stdout);
+	end_partial();
+	emit(line, strlen(line));
+	funlockfile(stdout);
+	g_free(line);
+}
+
+OutputChild * output_child_new(const char *label, int *fd)
+{
+	g_return_val_if_fail(fd, NULL);
+
+	int p[2];
+	if(pipe2(p, O_CLOEXEC))
+		return NULL;
+
+	OutputChild *child = g_new0(OutputChild, 1);
+	child->prefix = label ? g_strdup_printf("[%s] ", label) : g_strdup("");
+	child->fd = p[0];
+	child->tail = g_string_new(NULL);
+	child->lineStart = true;
+
+	struct epoll_event event = {0};
+	event.events = EPOLLIN;
+	event.data.ptr = child;
+	if(epoll_ctl(O.epoll, EPOLL_CTL_ADD, child->fd, &event))
+	{
+		close(p[0]);
+		close(p[1]);
+		g_free(child->prefix);
+		g_string_free(child->tail, TRUE);
+		g_free(child);
+		return NULL;
+	}
+
+	*fd = p[1];
+	return child;
+}
+
+void output_child_finish(OutputChild *child, GString *tail)
+{
+	if(!child)
+		return;
+
+	g_mutex_lock(&O.lock);
+	g_ptr_array_add(O.finishing, child);
+	g_mutex_unlock(&O.lock);
+
+	guint64 one = 1;
+	(void)write(O.wakefd, &one, sizeof(one));
+
+	g_mutex_lock(&O.lock);
+	while(!child->finished)
+		g_cond_wait(&O.cond, &O.lock);
+	g_mutex_unlock(&O.lock);
+
+	if(tail)
+		g_string_append_len(tail, child->tail->str, child->tail->len);
+	g_free(child->prefix);
+	g_string_free(child->tail, TRUE);
+	g_free(child);
+}
@@ -0,0 +1,55 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Multiplexes the output of child processes onto stdout and a log file.
+ * Every child writes into its own pipe, and one thread waits on all of
+ * them with epoll. Lines are moved out of the pipes with tee() and
+ * splice(), so they aren't copied through userspace on their way to
+ * stdout and the log, and each is prefixed with the label of the child
+ * (the step that started it), so the output of steps running at the
+ * same time can be told apart. The end of each child's output is kept
+ * for parsing.
+ */
+
+#include <glib.h>
+
+#define OUTPUT_TAIL_SIZE (64 * 1024)
+
+typedef struct _OutputChild OutputChild;
+
+/*
+ * Starts the multiplexer thread. Returns FALSE on failure.
+ */
+gboolean output_start(void);
+
+/*
+ * Opens the log file at path (appending to it if it exists), writes the
+ * output so far to it, and keeps writing output to it until detached.
+ * Until a log is attached, output is kept in memory (up to a limit).
+ * Returns FALSE if it can't be opened.
+ */
+gboolean output_attach_log(const char *path);
+void output_detach_log(void);
+
+/*
+ * Writes a line from the installer itself, without a prefix, to stdout
+ * and the log.
+ */
+void output_println(const char *fmt, ...) G_GNUC_PRINTF(1, 2);
+
+/*
+ * Opens a pipe for a child process's output, whose lines get prefixed
+ * with label (if non-NULL). Stores the write end in fd, for the child to
+ * use as stdout and stderr; the parent closes it after forking. Returns
+ * NULL on failure.
+ */
+OutputChild * output_child_new(const char *label, int *fd);
+
+/*
+ * Call once the child has exited. Waits until what's left of its output
+ * has been written out, appends the last OUTPUT_TAIL_SIZE bytes of its
+ * output to tail (if non-NULL), and frees child.
+ */
+void output_child_finish(OutputChild *child, GString *tail);
@@ -0,0 +1,519 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * A package cache on the host, shared between installs.
+ */
+
+#define _GNU_SOURCE // copy_file_range
+#include "pkgcache.h"
+#include "output.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+// Files are copied on this many threads by pkgcache_seed
+#define SEED_THREADS 4
+
+struct _PkgCache
+{
+	char *path;
+	char *objects;
+	guint64 maxSize;
+	guint maxAgeDays;
+	gint hits;
+	gint misses;
+	gint imports;
+};
+
+typedef struct
+{
+	char *name;
+	guint64 size;
+	time_t mtime;
+} CacheEntry;
+
+PkgCache * pkgcache_open(const char *path, guint64 maxSize, guint maxAgeDays)
+{
+	g_return_val_if_fail(path, NULL);
+
+	char *objects = g_build_path("/", path, "objects", NULL);
+	if(g_mkdir_with_parents(objects, 0755))
+	{
+		output_println("Failed to create package cache at %s (%i)", path, errno);
+		g_free(objects);
+		return NULL;
+	}
+
+	PkgCache *cache = g_new0(PkgCache, 1);
+	cache->path = g_strdup(path);
+	cache->objects = objects;
+	cache->maxSize = maxSize;
+	cache->maxAgeDays = maxAgeDays;
+	return cache;
+}
+
+void pkgcache_close(PkgCache *cache)
+{
+	if(!cache)
+		return;
+	g_free(cache->path);
+	g_free(cache->objects);
+	g_free(cache);
+}
+
+const char * pkgcache_get_path(PkgCache *cache)
+{
+	g_return_val_if_fail(cache, NULL);
+	return cache->path;
+}
+
+// Takes the cache's lock. Imports share it; eviction needs it exclusively
+// so that it doesn't remove an object while an import is linking it.
+static int lock_cache(PkgCache *cache, int operation)
+{
+	char *lockpath = g_build_path("/", cache->path, ".lock", NULL);
+	int fd = open(lockpath, O_RDONLY|O_CREAT|O_CLOEXEC, 0644);
+	g_free(lockpath);
+	if(fd < 0)
+		return -1;
+	while(flock(fd, operation) && errno == EINTR);
+	return fd;
+}
+
+static void unlock_cache(int fd)
+{
+	if(fd >= 0)
+		close(fd); // Releases the flock
+}
+
+gboolean pkgcache_is_package_file(const char *name)
+{
+	return strstr(name, ".pkg.tar") != NULL
+		&& !g_str_has_suffix(name, ".part")
+		&& !g_str_has_suffix(name, ".part.state")
+		&& !g_str_has_suffix(name, ".sig")
+		&& name[0] != '.';
+}
+
+gboolean pkgcache_lookup(PkgCache *cache, const char *filename, const char *sha256)
+{
+	g_return_val_if_fail(cache && filename, FALSE);
+
+	char *path = g_build_path("/", cache->path, filename, NULL);
+	struct stat st;
+	gboolean hit = (stat(path, &st) == 0 && S_ISREG(st.st_mode));
+
+	if(hit && sha256)
+	{
+		// Every filename is a link to the object named by its checksum
+		char *object = g_build_path("/", cache->objects, sha256, NULL);
+		struct stat ost;
+		hit = (stat(object, &ost) == 0 && ost.st_ino == st.st_ino && ost.st_dev == st.st_dev);
+		g_free(object);
+	}
+
+	// Mark as recently used for eviction
+	if(hit)
+		utimensat(AT_FDCWD, path, NULL, 0);
+	g_free(path);
+
+	g_atomic_int_add(hit ? &cache->hits : &cache->misses, 1);
+	return hit;
+}
+
+char * pkgcache_checksum_file(const char *path)
+{
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	if(fd < 0)
+		return NULL;
+
+	GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	guchar buf[65536];
+	ssize_t num;
+	while((num = read(fd, buf, sizeof(buf))) > 0)
+		g_checksum_update(checksum, buf, num);
+	close(fd);
+
+	char *sum = (num < 0) ? NULL : g_strdup(g_checksum_get_string(checksum));
+	g_checksum_free(checksum);
+	return sum;
+}
+
+// Copies all of in to out. Tries a reflink first, which shares the data
+// blocks instead of copying them on filesystems that support it (btrfs,
+// xfs). Otherwise copy_file_range, which at least keeps the data in the
+// kernel, and can be offloaded by some filesystems. Falls back to read
+// and write if neither is supported between the two filesystems.
+static int copy_fd(int in, int out)
+{
+	if(ioctl(out, FICLONE, in) == 0)
+		return 0;
+
+	ssize_t num;
+	while((num = copy_file_range(in, NULL, out, NULL, 1<<30, 0)) > 0);
+	if(num == 0)
+		return 0;
+	if(errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+		return errno;
+
+	// Start over in case copy_file_range copied some before failing
+	if(lseek(in, 0, SEEK_SET) < 0 || lseek(out, 0, SEEK_SET) < 0 || ftruncate(out, 0))
+		return errno;
+
+	char buf[65536];
+	while((num = read(in, buf, sizeof(buf))) > 0)
+	{
+		for(ssize_t done = 0; done < num;)
+		{
+			ssize_t w = write(out, buf + done, num - done);
+			if(w < 0)
+				return errno;
+			done += w;
+		}
+	}
+	return (num < 0) ? errno : 0;
+}
+
+int pkgcache_copy_file(const char *src, const char *dst)
+{
+	g_return_val_if_fail(src && dst, EINVAL);
+
+	int in = open(src, O_RDONLY|O_CLOEXEC);
+	if(in < 0)
+		return errno;
+
+	char *tmp = g_strdup_printf("%s.XXXXXX", dst);
+	int out = mkstemp(tmp);
+	int err = (out < 0) ? errno : 0;
+
+	struct stat st;
+	if(!err && fstat(in, &st))
+		err = errno;
+	if(!err)
+		err = copy_fd(in, out);
+	if(!err)
+	{
+		struct timespec times[2] = {st.st_atim, st.st_mtim};
+		if(fchmod(out, st.st_mode & 0777) || futimens(out, times))
+			err = errno;
+	}
+	close(in);
+	if(out >= 0 && close(out) && !err)
+		err = errno;
+	if(!err && rename(tmp, dst))
+		err = errno;
+	if(err && out >= 0)
+		unlink(tmp);
+	g_free(tmp);
+	return err;
+}
+
+typedef struct
+{
+	const char *srcdir;
+	const char *destdir;
+	gint copied;
+} SeedData;
+
+static void seed_file(const char *filename, SeedData *seed)
+{
+	char *src = g_build_path("/", seed->srcdir, filename, NULL);
+	char *dst = g_build_path("/", seed->destdir, filename, NULL);
+	if(access(src, R_OK) == 0 && access(dst, F_OK) != 0)
+	{
+		int err = pkgcache_copy_file(src, dst);
+		if(err)
+			output_println("Warning: Failed to copy %s (%i)", src, err);
+		else
+			g_atomic_int_inc(&seed->copied);
+	}
+	g_free(src);
+	g_free(dst);
+}
+
+guint pkgcache_seed(const char *srcdir, const char *destdir, const char * const *filenames)
+{
+	g_return_val_if_fail(srcdir && destdir && filenames, 0);
+
+	SeedData seed = {srcdir, destdir, 0};
+	GThreadPool *pool = g_thread_pool_new((GFunc)seed_file, &seed, SEED_THREADS, TRUE, NULL);
+	if(!pool)
+		return 0;
+	for(size_t i=0; filenames[i]!=NULL; ++i)
+		g_thread_pool_push(pool, (gpointer)filenames[i], NULL);
+	g_thread_pool_free(pool, FALSE, TRUE);
+	return seed.copied;
+}
+
+// Writes a copy of src into the objects directory under the name sha256.
+// The copy is written to a temporary file and renamed into place, so
+// nobody can see a partial object.
+static bool store_object(PkgCache *cache, const char *src, const char *sha256)
+{
+	char *object = g_build_path("/", cache->objects, sha256, NULL);
+	if(access(object, F_OK) == 0)
+	{
+		g_free(object);
+		return true;
+	}
+
+	char *tmp = g_build_path("/", cache->objects, ".tmp-XXXXXX", NULL);
+	int out = mkstemp(tmp);
+	int in = open(src, O_RDONLY|O_CLOEXEC);
+	int err = (out < 0 || in < 0) ? errno : 0;
+
+	if(!err)
+		err = copy_fd(in, out);
+	if(!err && (fchmod(out, 0644) || fsync(out)))
+		err = errno;
+	if(in >= 0)
+		close(in);
+	if(out >= 0 && close(out) && !err)
+		err = errno;
+	if(!err && rename(tmp, object))
+		err = errno;
+
+	if(err)
+	{
+		output_println("Warning: Failed to add %s to package cache (%i)", src, err);
+		unlink(tmp);
+	}
+	g_free(tmp);
+	g_free(object);
+	return err == 0;
+}
+
+// Points filename at the object named sha256, replacing any
+// existing entry atomically.
+static bool link_object(PkgCache *cache, const char *filename, const char *sha256)
+{
+	char *object = g_build_path("/", cache->objects, sha256, NULL);
+	char *tmp = g_strdup_printf("%s/.link-%i-%s", cache->path, (int)getpid(), filename);
+	char *path = g_build_path("/", cache->path, filename, NULL);
+
+	unlink(tmp);
+	bool success = (link(object, tmp) == 0 && rename(tmp, path) == 0);
+	if(!success)
+	{
+		output_println("Warning: Failed to link %s in package cache (%i)", filename, errno);
+		unlink(tmp);
+	}
+
+	g_free(object);
+	g_free(tmp);
+	g_free(path);
+	return success;
+}
+
+guint pkgcache_import(PkgCache *cache, const char *dir)
+{
+	g_return_val_if_fail(cache && dir, 0);
+
+	GDir *gdir = g_dir_open(dir, 0, NULL);
+	if(!gdir)
+		return 0;
+
+	int lock = lock_cache(cache, LOCK_SH);
+	guint count = 0;
+	const char *name;
+	while((name = g_dir_read_name(gdir)) != NULL)
+	{
+		if(!pkgcache_is_package_file(name))
+			continue;
+
+		char *src = g_build_path("/", dir, name, NULL);
+		struct stat sst, dst_;
+		if(stat(src, &sst) != 0) // Removed since it was listed
+		{
+			g_free(src);
+			continue;
+		}
+		char *dst = g_build_path("/", cache->path, name, NULL);
+		bool cached = (stat(dst, &dst_) == 0 && sst.st_size == dst_.st_size);
+		g_free(dst);
+
+		if(!cached && S_ISREG(sst.st_mode))
+		{
+			char *sha256 = pkgcache_checksum_file(src);
+			if(sha256 && store_object(cache, src, sha256) && link_object(cache, name, sha256))
+				++count;
+			g_free(sha256);
+		}
+		g_free(src);
+	}
+	unlock_cache(lock);
+	g_dir_close(gdir);
+
+	g_atomic_int_add(&cache->imports, count);
+	return count;
+}
+
+// Moves src into the objects directory under the name sha256. A rename
+// if src is on the cache's filesystem, otherwise a copy, after which src
+// is removed.
+static bool move_object(PkgCache *cache, const char *src, const char *sha256)
+{
+	char *object = g_build_path("/", cache->objects, sha256, NULL);
+	bool moved = (access(object, F_OK) != 0 && chmod(src, 0644) == 0 && rename(src, object) == 0);
+	// A new entry counts as just used, however old the download is
+	if(moved)
+		utimensat(AT_FDCWD, object, NULL, 0);
+	g_free(object);
+	if(moved)
+		return true;
+
+	if(!store_object(cache, src, sha256))
+		return false;
+	unlink(src);
+	return true;
+}
+
+guint pkgcache_export(PkgCache *cache, const char *dir)
+{
+	g_return_val_if_fail(cache && dir, 0);
+
+	GDir *gdir = g_dir_open(dir, 0, NULL);
+	if(!gdir)
+		return 0;
+
+	int lock = lock_cache(cache, LOCK_SH);
+	guint count = 0;
+	const char *name;
+	while((name = g_dir_read_name(gdir)) != NULL)
+	{
+		if(!pkgcache_is_package_file(name))
+			continue;
+
+		char *src = g_build_path("/", dir, name, NULL);
+		struct stat sst, dst_;
+		if(stat(src, &sst) != 0) // Removed since it was listed
+		{
+			g_free(src);
+			continue;
+		}
+		char *dst = g_build_path("/", cache->path, name, NULL);
+		bool cached = (stat(dst, &dst_) == 0 && sst.st_size == dst_.st_size);
+		g_free(dst);
+
+		if(cached)
+			unlink(src);
+		else if(S_ISREG(sst.st_mode))
+		{
+			char *sha256 = pkgcache_checksum_file(src);
+			if(sha256 && move_object(cache, src, sha256) && link_object(cache, name, sha256))
+				++count;
+			g_free(sha256);
+		}
+		g_free(src);
+	}
+	unlock_cache(lock);
+	g_dir_close(gdir);
+
+	g_atomic_int_add(&cache->imports, count);
+	return count;
+}
+
+static gint compare_entry_age(gconstpointer a, gconstpointer b)
+{
+	const CacheEntry *ea = *(CacheEntry * const *)a;
+	const CacheEntry *eb = *(CacheEntry * const *)b;
+	return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+static void free_entry(CacheEntry *entry)
+{
+	g_free(entry->name);
+	g_free(entry);
+}
+
+void pkgcache_evict(PkgCache *cache)
+{
+	g_return_if_fail(cache);
+
+	GDir *gdir = g_dir_open(cache->path, 0, NULL);
+	if(!gdir)
+		return;
+
+	int lock = lock_cache(cache, LOCK_EX);
+
+	// Oldest first
+	GPtrArray *entries = g_ptr_array_new_with_free_func((GDestroyNotify)free_entry);
+	guint64 total = 0;
+	const char *name;
+	while((name = g_dir_read_name(gdir)) != NULL)
+	{
+		char *path = g_build_path("/", cache->path, name, NULL);
+		struct stat st;
+		if(pkgcache_is_package_file(name) && stat(path, &st) == 0 && S_ISREG(st.st_mode))
+		{
+			CacheEntry *entry = g_new(CacheEntry, 1);
+			entry->name = g_strdup(name);
+			entry->size = st.st_size;
+			entry->mtime = st.st_mtime;
+			g_ptr_array_add(entries, entry);
+			total += st.st_size;
+		}
+		g_free(path);
+	}
+	g_dir_close(gdir);
+	g_ptr_array_sort(entries, compare_entry_age);
+
+	time_t cutoff = time(NULL) - (time_t)cache->maxAgeDays * 24 * 60 * 60;
+	guint removed = 0;
+	for(guint i=0; i<entries->len; ++i)
+	{
+		CacheEntry *entry = g_ptr_array_index(entries, i);
+		bool old = cache->maxAgeDays && entry->mtime < cutoff;
+		bool big = cache->maxSize && total > cache->maxSize;
+		if(!old && !big)
+			break;
+
+		char *path = g_build_path("/", cache->path, entry->name, NULL);
+		if(unlink(path) == 0)
+		{
+			total -= entry->size;
+			++removed;
+		}
+		g_free(path);
+	}
+	g_ptr_array_unref(entries);
+
+	// Remove objects no longer linked from any filename
+	gdir = g_dir_open(cache->objects, 0, NULL);
+	while(gdir && (name = g_dir_read_name(gdir)) != NULL)
+	{
+		char *path = g_build_path("/", cache->objects, name, NULL);
+		struct stat st;
+		if(stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1)
+			unlink(path);
+		g_free(path);
+	}
+	if(gdir)
+		g_dir_close(gdir);
+
+	unlock_cache(lock);
+
+	if(removed > 0)
+		output_println("Evicted %u packages from package cache", removed);
+}
+
+void pkgcache_print_stats(PkgCache *cache)
+{
+	g_return_if_fail(cache);
+	output_println("Package cache %s: %i hits, %i misses, %i added",
+		cache->path,
+		g_atomic_int_get(&cache->hits),
+		g_atomic_int_get(&cache->misses),
+		g_atomic_int_get(&cache->imports));
+}
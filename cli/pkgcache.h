@@ -0,0 +1,83 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * A package cache on the host, shared between installs. Packages are
+ * stored once per checksum under objects/, and hard linked to their
+ * filename at the top level of the cache, so the cache directory can
+ * be passed straight to pacman's --cachedir. Entries are only ever
+ * replaced by rename, so several installs can share one cache.
+ */
+
+#include <glib.h>
+
+typedef struct _PkgCache PkgCache;
+
+/*
+ * Opens (creating if necessary) the cache at path. maxSize (in bytes)
+ * and maxAgeDays limit the cache during pkgcache_evict; 0 for no limit.
+ * Returns NULL if the cache directory can't be created.
+ */
+PkgCache * pkgcache_open(const char *path, guint64 maxSize, guint maxAgeDays);
+void pkgcache_close(PkgCache *cache);
+
+const char * pkgcache_get_path(PkgCache *cache);
+
+/*
+ * Checks if the cache has filename. If sha256 is non-NULL, the cached
+ * file must also have that checksum. Counts a hit or miss, and marks a
+ * hit entry as recently used.
+ */
+gboolean pkgcache_lookup(PkgCache *cache, const char *filename, const char *sha256);
+
+/*
+ * Adds every package file in dir that isn't already in the cache.
+ * Returns the number of packages added.
+ */
+guint pkgcache_import(PkgCache *cache, const char *dir);
+
+/*
+ * Like pkgcache_import, but moves the package files out of dir (renaming
+ * them where dir is on the cache's filesystem), and removes those the
+ * cache already has. Returns the number of packages added.
+ */
+guint pkgcache_export(PkgCache *cache, const char *dir);
+
+/*
+ * Removes entries older than the maximum age, and then the least
+ * recently used entries until the cache fits in its maximum size.
+ */
+void pkgcache_evict(PkgCache *cache);
+
+/*
+ * Checks if a filename is a whole package file (not a partial download,
+ * signature or hidden file).
+ */
+gboolean pkgcache_is_package_file(const char *name);
+
+/*
+ * Copies src to dst, without passing the data through userspace where
+ * possible (as a reflink, or with copy_file_range). The copy is written
+ * next to dst and renamed into place, and keeps src's permissions and
+ * modification time. Returns 0 on success, or errno on failure.
+ */
+int pkgcache_copy_file(const char *src, const char *dst);
+
+/*
+ * Copies each file in the NULL-terminated filenames list that exists in
+ * srcdir and not yet in destdir from srcdir to destdir, on a small pool
+ * of threads. Blocks until done, and returns the number of files copied.
+ */
+guint pkgcache_seed(const char *srcdir, const char *destdir, const char * const *filenames);
+
+/*
+ * Returns the hex SHA-256 of the file at path, or NULL on failure.
+ * Free with g_free.
+ */
+char * pkgcache_checksum_file(const char *path);
+
+/*
+ * Prints the number of hits, misses and imports since opening.
+ */
+void pkgcache_print_stats(PkgCache *cache);
@@ -0,0 +1,329 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Reports the install's progress as JSON lines on a file descriptor.
+ */
+
+#define _GNU_SOURCE
+#include "progress.h"
+#include "json.h"
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/statvfs.h>
+
+// How often progress is reported, in microseconds
+#define REPORT_INTERVAL G_USEC_PER_SEC
+
+static struct
+{
+	GMutex lock; // Guards everything below
+	GCond cond; // Signaled when there are events to write, or on stopping
+	int fd; // -1 if not reporting
+	GString *pending; // Events for the reporter to write
+	bool stopping;
+	GThread *reporter;
+	gint64 start;
+
+	double fraction;
+	guint64 downloaded;
+	guint packagesTotal;
+	guint64 downloadTotal;
+	char *target; // Where the target is mounted, or NULL
+	guint64 targetUsed; // Bytes used on the target when it was mounted
+	guint targetPackages; // Packages on the target when it was mounted
+} P = {.fd = -1};
+
+// Starts an event's object, up to its own fields
+static GString * begin_event(const char *event)
+{
+	GString *json = g_string_new("{\"event\":");
+	json_append_string(json, event);
+	g_string_append_printf(json, ",\"time\":%.3f", (g_get_monotonic_time() - P.start) / (double)G_USEC_PER_SEC);
+	return json;
+}
+
+// Finishes an event, queues it for the reporter to write, and frees it.
+// Called with the lock held.
+static void send_event(GString *json)
+{
+	g_string_append(json, "}\n");
+	if(P.fd >= 0)
+	{
+		g_string_append_len(P.pending, json->str, json->len);
+		g_cond_signal(&P.cond);
+	}
+	g_string_free(json, TRUE);
+}
+
+// Writes all of buf to fd. Returns false if it can't.
+static bool write_all(int fd, const char *buf, size_t left)
+{
+	// If the reader has gone, writing raises SIGPIPE, which would kill
+	// the installer. It's blocked on this thread instead, and taken back
+	// if raised, so the reports just stop.
+	sigset_t pipe, old;
+	sigemptyset(&pipe);
+	sigaddset(&pipe, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe, &old);
+	bool written = true;
+	while(left > 0)
+	{
+		ssize_t num = write(fd, buf, left);
+		if(num < 0 && errno == EINTR)
+			continue;
+		if(num <= 0)
+		{
+			if(errno == EPIPE)
+			{
+				struct timespec none = {0};
+				sigtimedwait(&pipe, NULL, &none);
+			}
+			written = false;
+			break;
+		}
+		buf += num;
+		left -= num;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return written;
+}
+
+// Writes the queued events with the lock released, so that a slow
+// reader holds up only the reporter, not the steps. Only the reporter
+// calls this, so writes don't interleave. Called with the lock held.
+static void flush(void)
+{
+	if(P.fd < 0 || P.pending->len == 0)
+		return;
+	GString *events = P.pending;
+	P.pending = g_string_new(NULL);
+	int fd = P.fd;
+	g_mutex_unlock(&P.lock);
+	bool written = write_all(fd, events->str, events->len);
+	g_string_free(events, TRUE);
+	g_mutex_lock(&P.lock);
+	if(!written)
+		P.fd = -1;
+}
+
+// Space used on the filesystem at path, in bytes
+static guint64 used_space(const char *path)
+{
+	struct statvfs fs;
+	if(statvfs(path, &fs))
+		return 0;
+	return (guint64)(fs.f_blocks - fs.f_bfree) * fs.f_frsize;
+}
+
+// Number of packages in the pacman database of the target at path
+static guint count_packages(const char *path)
+{
+	char *local = g_build_path("/", path, "var/lib/pacman/local", NULL);
+	GDir *dir = g_dir_open(local, 0, NULL);
+	guint count = 0;
+	const char *name;
+	while(dir && (name = g_dir_read_name(dir)) != NULL)
+	{
+		// Each package has a directory, next to the ALPM_DB_VERSION file
+		char *entry = g_build_path("/", local, name, NULL);
+		if(g_file_test(entry, G_FILE_TEST_IS_DIR))
+			++count;
+		g_free(entry);
+	}
+	if(dir)
+		g_dir_close(dir);
+	g_free(local);
+	return count;
+}
+
+// Reports the counters. Called with the lock held.
+static void report(void)
+{
+	if(P.fd < 0)
+		return;
+
+	guint64 written = 0;
+	guint packages = 0;
+	if(P.target)
+	{
+		guint64 used = used_space(P.target);
+		written = (used > P.targetUsed) ? used - P.targetUsed : 0;
+		guint count = count_packages(P.target);
+		packages = (count > P.targetPackages) ? count - P.targetPackages : 0;
+	}
+
+	GString *json = begin_event("progress");
+	g_string_append_printf(json, ",\"fraction\":%.4f,\"downloaded\":%" G_GUINT64_FORMAT ",\"download_total\":%" G_GUINT64_FORMAT
+		",\"written\":%" G_GUINT64_FORMAT ",\"packages\":%u,\"packages_total\":%u,\"eta\":",
+		P.fraction, P.downloaded, P.downloadTotal, written, P.packagesTotal ? MIN(packages, P.packagesTotal) : packages, P.packagesTotal);
+	// Assumes the rest of the steps go as fast as the ones so far
+	double elapsed = (g_get_monotonic_time() - P.start) / (double)G_USEC_PER_SEC;
+	if(P.fraction > 0 && P.fraction < 1)
+		g_string_append_printf(json, "%.0f", elapsed * (1 - P.fraction) / P.fraction);
+	else if(P.fraction >= 1)
+		g_string_append(json, "0");
+	else
+		g_string_append(json, "null");
+	send_event(json);
+}
+
+static gpointer thread_report(UNUSED gpointer data)
+{
+	g_mutex_lock(&P.lock);
+	gint64 next = g_get_monotonic_time() + REPORT_INTERVAL;
+	while(!P.stopping)
+	{
+		if(P.pending->len == 0)
+			g_cond_wait_until(&P.cond, &P.lock, next);
+		if(!P.stopping && g_get_monotonic_time() >= next)
+		{
+			report();
+			next = g_get_monotonic_time() + REPORT_INTERVAL;
+		}
+		flush();
+	}
+	g_mutex_unlock(&P.lock);
+	return NULL;
+}
+
+gboolean progress_open(int fd)
+{
+	int flags = fcntl(fd, F_GETFD);
+	if(flags < 0)
+		return FALSE;
+	// The installer's children don't need it
+	fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+
+	g_mutex_init(&P.lock);
+	g_cond_init(&P.cond);
+	P.start = g_get_monotonic_time();
+	P.pending = g_string_new(NULL);
+	P.fd = fd;
+	P.reporter = g_thread_new("progress", thread_report, NULL);
+	return TRUE;
+}
+
+void progress_close(int status)
+{
+	if(!P.reporter)
+		return;
+
+	g_mutex_lock(&P.lock);
+	P.stopping = true;
+	g_cond_signal(&P.cond);
+	g_mutex_unlock(&P.lock);
+	g_thread_join(P.reporter);
+	P.reporter = NULL;
+
+	g_mutex_lock(&P.lock);
+	report();
+	GString *json = begin_event("done");
+	g_string_append_printf(json, ",\"status\":%i", status);
+	send_event(json);
+	flush();
+	P.fd = -1;
+	g_string_free(P.pending, TRUE);
+	P.pending = NULL;
+	g_free(P.target);
+	P.target = NULL;
+	g_mutex_unlock(&P.lock);
+}
+
+void progress_step_start(const char *name)
+{
+	if(!P.reporter)
+		return;
+	g_mutex_lock(&P.lock);
+	GString *json = begin_event("step");
+	g_string_append(json, ",\"step\":");
+	json_append_string(json, name);
+	g_string_append(json, ",\"state\":\"start\"");
+	send_event(json);
+	g_mutex_unlock(&P.lock);
+}
+
+void progress_step_end(const char *name, int status, double seconds)
+{
+	if(!P.reporter)
+		return;
+	g_mutex_lock(&P.lock);
+	GString *json = begin_event("step");
+	g_string_append(json, ",\"step\":");
+	json_append_string(json, name);
+	g_string_append_printf(json, ",\"state\":\"end\",\"status\":%i,\"seconds\":%.3f", status, seconds);
+	send_event(json);
+	g_mutex_unlock(&P.lock);
+}
+
+void progress_fraction(double fraction)
+{
+	if(!P.reporter)
+		return;
+	g_mutex_lock(&P.lock);
+	P.fraction = CLAMP(fraction, 0, 1);
+	report();
+	g_mutex_unlock(&P.lock);
+}
+
+void progress_process(const char *step, const char * const *args)
+{
+	if(!P.reporter || !args)
+		return;
+	g_mutex_lock(&P.lock);
+	GString *json = begin_event("process");
+	g_string_append(json, ",\"step\":");
+	if(step)
+		json_append_string(json, step);
+	else
+		g_string_append(json, "null");
+	g_string_append(json, ",\"argv\":[");
+	for(size_t i=0; args[i]!=NULL; ++i)
+	{
+		if(i > 0)
+			g_string_append_c(json, ',');
+		json_append_string(json, args[i]);
+	}
+	g_string_append_c(json, ']');
+	send_event(json);
+	g_mutex_unlock(&P.lock);
+}
+
+void progress_downloaded(guint64 bytes)
+{
+	if(!P.reporter)
+		return;
+	g_mutex_lock(&P.lock);
+	P.downloaded += bytes;
+	g_mutex_unlock(&P.lock);
+}
+
+void progress_set_packages(guint total, guint64 downloadTotal)
+{
+	if(!P.reporter)
+		return;
+	g_mutex_lock(&P.lock);
+	P.packagesTotal = total;
+	P.downloadTotal = downloadTotal;
+	g_mutex_unlock(&P.lock);
+}
+
+void progress_set_target(const char *path)
+{
+	if(!P.reporter)
+		return;
+	g_mutex_lock(&P.lock);
+	g_free(P.target);
+	P.target = g_strdup(path);
+	if(path)
+	{
+		P.targetUsed = used_space(path);
+		P.targetPackages = count_packages(path);
+	}
+	g_mutex_unlock(&P.lock);
+}
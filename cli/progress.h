@@ -0,0 +1,70 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Reports the install's progress to a program watching it, one JSON
+ * object per line on a file descriptor of its choosing. Each object has
+ * an "event" and "time" (seconds since the install started):
+ *
+ *   {"event":"step","step":<name>,"state":"start"}
+ *   {"event":"step","step":<name>,"state":"end","status":<int>,"seconds":<float>}
+ *   {"event":"process","step":<name>,"argv":[<string>...]}
+ *   {"event":"progress","fraction":<0-1>,"downloaded":<bytes>,
+ *    "download_total":<bytes>,"written":<bytes>,"packages":<int>,
+ *    "packages_total":<int>,"eta":<seconds>}
+ *   {"event":"done","status":<int>}
+ *
+ * progress comes every second, and whenever a step finishes. downloaded
+ * counts the bytes of packages the install downloaded itself (not those
+ * found in a cache), and written the space used on the target since it
+ * was mounted. packages
+ * counts packages in the target's pacman database since then. The
+ * totals are 0 and eta is null until they're known.
+ */
+
+#include <glib.h>
+
+/*
+ * Starts reporting to fd, which is left open. Until then, the rest do
+ * nothing. Returns FALSE if fd isn't open.
+ */
+gboolean progress_open(int fd);
+
+/*
+ * Reports that the install finished with status, and stops reporting.
+ */
+void progress_close(int status);
+
+/*
+ * Reports that a step started, or ended with status after seconds.
+ */
+void progress_step_start(const char *name);
+void progress_step_end(const char *name, int status, double seconds);
+
+/*
+ * Reports the fraction (0-1) of the install's steps done.
+ */
+void progress_fraction(double fraction);
+
+/*
+ * Reports that step is running a process with args.
+ */
+void progress_process(const char *step, const char * const *args);
+
+/*
+ * Adds bytes to what the install has downloaded.
+ */
+void progress_downloaded(guint64 bytes);
+
+/*
+ * Sets the number of packages to install, and how many bytes they take
+ * to download.
+ */
+void progress_set_packages(guint total, guint64 downloadTotal);
+
+/*
+ * Sets where the target is mounted, to measure what's written to it
+ * from now on, or NULL once it's about to be unmounted.
+ */
+void progress_set_target(const char *path);
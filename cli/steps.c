@@ -0,0 +1,444 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Runs a table of steps in dependency order, each on its own thread.
+ */
+
+#include "steps.h"
+#include "output.h"
+#include "cgroup.h"
+#include "trace.h"
+#include "progress.h"
+#include <stdbool.h>
+
+typedef enum
+{
+	kStepPending,
+	kStepRunning,
+	kStepDone,
+	kStepFailed,
+	kStepSkipped,
+} StepState;
+
+typedef struct
+{
+	const Step *steps;
+	guint numSteps;
+	gpointer data;
+	StepProgressFunc progress;
+	const StepJournal *journal;
+	StepPolicyFunc policy;
+
+	gint *deps; // numSteps rows of MAX_STEP_DEPS indices, -1 for none
+	gint *cleans; // Index of the step each cleans, or -1
+
+	GMutex lock;
+	GCond cond;
+	StepState *states;
+	char **hashes; // Each step's, once it starts
+	gint64 *starts;
+	gint64 *ends;
+	guint *processes; // Processes each step started
+	gint64 *spawnTimes; // Time each step spent starting them
+	CgroupUsage *usage; // What each step's processes used
+	bool *measured; // Whether each step's usage was measured
+	guint running;
+	guint64 doneWeight;
+	guint64 totalWeight;
+	int result;
+} Scheduler;
+
+typedef struct
+{
+	Scheduler *s;
+	guint index;
+} Job;
+
+// What's running on a step's thread, and on any helper threads it has
+typedef struct _StepContext
+{
+	const char *name;
+	gint64 deadline;
+	guint stall;
+	guint processes;
+	gint64 spawnTime;
+	Cgroup *cgroup;
+} Current;
+
+static GPrivate currentStep = G_PRIVATE_INIT(NULL);
+static GMutex countLock; // For processes and spawnTime, which helper threads count too
+
+static gint find_step(const Step *steps, guint numSteps, const char *name)
+{
+	for(guint i=0; i<numSteps; ++i)
+		if(g_strcmp0(steps[i].name, name) == 0)
+			return i;
+	return -1;
+}
+
+// Looks up every step's dependencies by name. Returns false if one
+// doesn't exist or comes later in the table.
+static bool resolve_deps(Scheduler *s)
+{
+	for(guint i=0; i<s->numSteps; ++i)
+	{
+		const Step *step = &s->steps[i];
+		for(guint j=0; j<MAX_STEP_DEPS; ++j)
+		{
+			gint dep = step->after[j] ? find_step(s->steps, s->numSteps, step->after[j]) : -1;
+			if(step->after[j] && (dep < 0 || (guint)dep >= i))
+			{
+				output_println("Step %s depends on unknown or later step %s", step->name, step->after[j]);
+				return false;
+			}
+			s->deps[i * MAX_STEP_DEPS + j] = dep;
+		}
+
+		s->cleans[i] = step->cleans ? find_step(s->steps, s->numSteps, step->cleans) : -1;
+		if(step->cleans && (s->cleans[i] < 0 || (guint)s->cleans[i] >= i))
+		{
+			output_println("Step %s cleans unknown or later step %s", step->name, step->cleans);
+			return false;
+		}
+	}
+	return true;
+}
+
+static gpointer thread_step(gpointer data)
+{
+	Job *job = data;
+	Scheduler *s = job->s;
+	const Step *step = &s->steps[job->index];
+
+	// Every dependency has finished, so their hashes are set. Getting
+	// the inputs may wait for arguments, so it happens here.
+	char *inputs = step->inputs ? step->inputs(s->data) : NULL;
+	GString *key = g_string_new(step->name);
+	if(inputs)
+		g_string_append_printf(key, "\n%s", inputs);
+	for(guint j=0; j<MAX_STEP_DEPS; ++j)
+	{
+		gint dep = s->deps[job->index * MAX_STEP_DEPS + j];
+		if(dep >= 0)
+			g_string_append_printf(key, "\n%s", s->hashes[dep]);
+	}
+	char *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA256, key->str, key->len);
+	g_string_free(key, TRUE);
+	s->hashes[job->index] = hash;
+	progress_step_start(step->name);
+
+	int status;
+	bool journaled = (inputs && s->journal);
+	g_free(inputs);
+	if(journaled && s->journal->completed(step->name, hash, s->data))
+	{
+		output_println("Step %s was already done", step->name);
+		status = 0;
+	}
+	else
+	{
+		Current current = {step->name, 0, 0, 0, 0, cgroup_new(step->name)};
+		g_private_set(&currentStep, &current);
+		for(guint attempt=0;; ++attempt)
+		{
+			StepPolicy policy = {0};
+			if(s->policy)
+				s->policy(step->name, &policy, s->data);
+			if(attempt > 0)
+			{
+				if(attempt > policy.retries)
+					break;
+				// The doubling stops at an hour (or the first backoff,
+				// if that's longer)
+				guint64 delay = (guint64)policy.backoff << MIN(attempt - 1, 16);
+				delay = MIN(delay, MAX(policy.backoff, 3600));
+				output_println("RETRY %s %u %u %" G_GUINT64_FORMAT, step->name, attempt, policy.retries, delay);
+
+				// Asks the policy again every tenth of a second, so an
+				// abort doesn't have to wait out the backoff
+				gint64 until = g_get_monotonic_time() + (gint64)delay * G_USEC_PER_SEC;
+				gint64 left;
+				while(attempt <= policy.retries && (left = until - g_get_monotonic_time()) > 0)
+				{
+					g_usleep(MIN(left, G_USEC_PER_SEC / 10));
+					s->policy(step->name, &policy, s->data);
+				}
+				if(attempt > policy.retries)
+					break;
+			}
+
+			current.deadline = policy.timeout ? g_get_monotonic_time() + (gint64)policy.timeout * G_USEC_PER_SEC : 0;
+			current.stall = policy.stall;
+			status = step->run(s->data);
+			if(status == 0)
+				break;
+		}
+		g_private_set(&currentStep, NULL);
+		if(status == 0 && journaled)
+			s->journal->record(step->name, hash, s->data);
+		s->processes[job->index] = current.processes;
+		s->spawnTimes[job->index] = current.spawnTime;
+
+		CgroupUsage *usage = &s->usage[job->index];
+		s->measured[job->index] = cgroup_free(current.cgroup, usage);
+		if(s->measured[job->index])
+			output_println("USAGE %s %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
+				step->name, usage->userUsec, usage->systemUsec, usage->readBytes, usage->writeBytes, usage->memoryPeak);
+	}
+
+	// starts is set before the thread is, so it's safe to read here
+	gint64 end = g_get_monotonic_time();
+	trace_step(step->name, s->starts[job->index], end, status);
+	progress_step_end(step->name, status, (end - s->starts[job->index]) / (double)G_USEC_PER_SEC);
+
+	g_mutex_lock(&s->lock);
+	s->ends[job->index] = end;
+	s->states[job->index] = status ? kStepFailed : kStepDone;
+	if(status)
+	{
+		output_println("Step %s failed", step->name);
+		if(!s->result)
+			s->result = status;
+	}
+	else
+	{
+		s->doneWeight += step->weight;
+		if(s->progress && s->totalWeight > 0)
+			s->progress((double)s->doneWeight / s->totalWeight, s->data);
+	}
+	--s->running;
+	g_cond_signal(&s->cond);
+	g_mutex_unlock(&s->lock);
+
+	g_free(job);
+	return NULL;
+}
+
+// Starts or skips whatever steps can be. Returns true if anything changed.
+// Called with the lock held.
+static bool schedule(Scheduler *s)
+{
+	bool changed = false;
+	for(guint i=0; i<s->numSteps; ++i)
+	{
+		if(s->states[i] != kStepPending)
+			continue;
+
+		bool finished = true; // Every dependency has finished one way or another
+		bool blocked = false; // Some dependency didn't succeed
+		for(guint j=0; j<MAX_STEP_DEPS; ++j)
+		{
+			gint dep = s->deps[i * MAX_STEP_DEPS + j];
+			if(dep < 0)
+				continue;
+			if(s->states[dep] == kStepPending || s->states[dep] == kStepRunning)
+				finished = false;
+			else if(s->states[dep] != kStepDone)
+				blocked = true;
+		}
+
+		gint cleans = s->cleans[i];
+		if(cleans < 0)
+		{
+			if(s->result || blocked)
+			{
+				s->states[i] = kStepSkipped;
+				changed = true;
+				continue;
+			}
+			if(!finished)
+				continue;
+		}
+		else
+		{
+			if(s->states[cleans] == kStepPending || s->states[cleans] == kStepRunning)
+				continue;
+			if(s->states[cleans] != kStepDone)
+			{
+				s->states[i] = kStepSkipped;
+				changed = true;
+				continue;
+			}
+			if(!finished || s->running > 0)
+				continue;
+		}
+
+		Job *job = g_new(Job, 1);
+		job->s = s;
+		job->index = i;
+		s->states[i] = kStepRunning;
+		s->starts[i] = g_get_monotonic_time();
+		++s->running;
+		g_thread_unref(g_thread_new(s->steps[i].name, thread_step, job));
+		changed = true;
+
+		// A cleanup step runs alone
+		if(cleans >= 0)
+			break;
+	}
+	return changed;
+}
+
+// Prints how long each step took (and how much of that went to starting
+// processes, and what its processes used), and how long the install
+// would have taken running one step at a time, against how long it did
+// take
+static void print_times(Scheduler *s, gint64 wall)
+{
+	gint64 serial = 0;
+	gint64 critical = 0;
+	guint processes = 0;
+	gint64 spawnTime = 0;
+	gint64 *finish = g_new0(gint64, s->numSteps);
+	for(guint i=0; i<s->numSteps; ++i)
+	{
+		if(s->states[i] != kStepDone && s->states[i] != kStepFailed)
+			continue;
+		gint64 duration = s->ends[i] - s->starts[i];
+		serial += duration;
+		if(s->processes[i])
+			output_println("Step %s took %.2f s (%u processes, %.1f ms starting them)", s->steps[i].name,
+				duration / (double)G_USEC_PER_SEC, s->processes[i], s->spawnTimes[i] / 1000.0);
+		else
+			output_println("Step %s took %.2f s", s->steps[i].name, duration / (double)G_USEC_PER_SEC);
+		processes += s->processes[i];
+		spawnTime += s->spawnTimes[i];
+		if(s->measured[i] && s->processes[i])
+		{
+			const CgroupUsage *usage = &s->usage[i];
+			output_println("Step %s used %.2f s user and %.2f s system CPU, read %.1f MiB, wrote %.1f MiB, peak memory %.1f MiB", s->steps[i].name,
+				usage->userUsec / (double)G_USEC_PER_SEC, usage->systemUsec / (double)G_USEC_PER_SEC,
+				usage->readBytes / 1048576.0, usage->writeBytes / 1048576.0, usage->memoryPeak / 1048576.0);
+		}
+
+		// Longest chain of dependent steps ending with this one
+		gint64 longest = 0;
+		for(guint j=0; j<MAX_STEP_DEPS; ++j)
+		{
+			gint dep = s->deps[i * MAX_STEP_DEPS + j];
+			if(dep >= 0 && finish[dep] > longest)
+				longest = finish[dep];
+		}
+		finish[i] = longest + duration;
+		if(finish[i] > critical)
+			critical = finish[i];
+	}
+	g_free(finish);
+
+	output_println("Steps took %.2f s in total, and %.2f s running in parallel (%.2fx); the longest chain of steps took %.2f s",
+		serial / (double)G_USEC_PER_SEC,
+		wall / (double)G_USEC_PER_SEC,
+		wall > 0 ? serial / (double)wall : 1.0,
+		critical / (double)G_USEC_PER_SEC);
+	output_println("Steps started %u processes, taking %.1f ms", processes, spawnTime / 1000.0);
+}
+
+int steps_run(const Step *steps, guint numSteps, gpointer data, StepProgressFunc progress, const StepJournal *journal, StepPolicyFunc policy)
+{
+	g_return_val_if_fail(steps, 1);
+
+	Scheduler s = {0};
+	s.steps = steps;
+	s.numSteps = numSteps;
+	s.data = data;
+	s.progress = progress;
+	s.journal = journal;
+	s.policy = policy;
+	s.deps = g_new(gint, numSteps * MAX_STEP_DEPS);
+	s.cleans = g_new(gint, numSteps);
+	if(!resolve_deps(&s))
+	{
+		g_free(s.deps);
+		g_free(s.cleans);
+		return 1;
+	}
+
+	s.states = g_new0(StepState, numSteps);
+	s.hashes = g_new0(char *, numSteps);
+	s.starts = g_new0(gint64, numSteps);
+	s.ends = g_new0(gint64, numSteps);
+	s.processes = g_new0(guint, numSteps);
+	s.spawnTimes = g_new0(gint64, numSteps);
+	s.usage = g_new0(CgroupUsage, numSteps);
+	s.measured = g_new0(bool, numSteps);
+	for(guint i=0; i<numSteps; ++i)
+		s.totalWeight += steps[i].weight;
+
+	gint64 start = g_get_monotonic_time();
+	g_mutex_init(&s.lock);
+	g_cond_init(&s.cond);
+	g_mutex_lock(&s.lock);
+	while(true)
+	{
+		while(schedule(&s));
+		if(s.running == 0)
+			break;
+		g_cond_wait(&s.cond, &s.lock);
+	}
+	g_mutex_unlock(&s.lock);
+	g_mutex_clear(&s.lock);
+	g_cond_clear(&s.cond);
+
+	print_times(&s, g_get_monotonic_time() - start);
+
+	g_free(s.deps);
+	g_free(s.cleans);
+	g_free(s.states);
+	for(guint i=0; i<numSteps; ++i)
+		g_free(s.hashes[i]);
+	g_free(s.hashes);
+	g_free(s.starts);
+	g_free(s.ends);
+	g_free(s.processes);
+	g_free(s.spawnTimes);
+	g_free(s.usage);
+	g_free(s.measured);
+	return s.result;
+}
+
+const char * steps_current(void)
+{
+	Current *current = g_private_get(&currentStep);
+	return current ? current->name : NULL;
+}
+
+gint64 steps_current_deadline(void)
+{
+	Current *current = g_private_get(&currentStep);
+	return current ? current->deadline : 0;
+}
+
+guint steps_current_stall(void)
+{
+	Current *current = g_private_get(&currentStep);
+	return current ? current->stall : 0;
+}
+
+StepContext * steps_current_context(void)
+{
+	return g_private_get(&currentStep);
+}
+
+void steps_enter(StepContext *context)
+{
+	g_private_set(&currentStep, context);
+}
+
+Cgroup * steps_current_cgroup(void)
+{
+	Current *current = g_private_get(&currentStep);
+	return current ? current->cgroup : NULL;
+}
+
+void steps_count_process(gint64 spawnTime)
+{
+	Current *current = g_private_get(&currentStep);
+	if(!current)
+		return;
+	g_mutex_lock(&countLock);
+	current->processes++;
+	current->spawnTime += spawnTime;
+	g_mutex_unlock(&countLock);
+}
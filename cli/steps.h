@@ -0,0 +1,137 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Runs a table of steps in dependency order, each on its own thread as
+ * soon as the steps it depends on are done, so independent steps run
+ * at the same time.
+ */
+
+#include <glib.h>
+
+#define MAX_STEP_DEPS 8
+
+typedef struct _Cgroup Cgroup; // See cgroup.h
+typedef struct _StepContext StepContext;
+
+// Returns 0 on success, or an exit code
+typedef int (*StepFunc)(gpointer data);
+
+typedef void (*StepProgressFunc)(double fraction, gpointer data);
+
+// Returns everything a step's result depends on (besides the steps it
+// runs after), as a string. Free with g_free.
+typedef char * (*StepInputsFunc)(gpointer data);
+
+typedef struct
+{
+	const char *name;
+	StepFunc run;
+	guint weight; // Share of the install's progress
+	const char *after[MAX_STEP_DEPS]; // Steps that must succeed first; unused entries are NULL
+	const char *cleans; // For a step that undoes another's work (such as an unmount), the step it undoes
+	StepInputsFunc inputs; // NULL for a step that always runs
+} Step;
+
+// Limits on how a step runs, and what to do when it fails
+typedef struct
+{
+	guint timeout; // Seconds the step may take, or 0 for no limit
+	guint stall; // Seconds a command the step runs may go without output or I/O, or 0 for no limit
+	guint retries; // Times to run the step again if it fails
+	guint backoff; // Seconds to wait before the first retry, doubling for each one after (up to an hour)
+} StepPolicy;
+
+// Fills in the policy of a step. Called before every attempt at the
+// step, and during the backoff before one, so that retries can be
+// stopped (such as after an abort).
+typedef void (*StepPolicyFunc)(const char *step, StepPolicy *policy, gpointer data);
+
+// Remembers which steps have completed, across runs. A step is
+// identified by its name and a hash of its name, its inputs and the
+// hashes of the steps it runs after, so if anything a step depends on
+// changes, it and everything after it run again.
+typedef struct
+{
+	gboolean (*completed)(const char *step, const char *hash, gpointer data);
+	void (*record)(const char *step, const char *hash, gpointer data);
+} StepJournal;
+
+/*
+ * Runs steps. A step starts once everything in its after list has
+ * succeeded; every step in after must come earlier in the table. Once a
+ * step fails, no more steps start, except cleanup steps (those with
+ * cleans set). A cleanup step runs if the step it cleans succeeded, once
+ * everything in its after list has finished or been skipped and nothing
+ * else is running, whether or not anything failed.
+ *
+ * If journal is non-NULL, every step with inputs that succeeds is
+ * recorded in it, and a step with inputs the journal says has completed
+ * is skipped (and counts as having succeeded).
+ *
+ * If policy is non-NULL, a step that fails is run again after a backoff,
+ * as many times as its policy allows, and each retry is reported with a
+ * "RETRY <step> <attempt> <max> <delay>" line. A step's timeout and stall
+ * limits are only enforced by whoever runs its commands, using
+ * steps_current_deadline and steps_current_stall.
+ *
+ * Each step that runs gets a cgroup (see cgroup_new), for whoever runs
+ * its commands to start them in, using steps_current_cgroup. Once the
+ * step finishes, what its processes used is reported with a "USAGE
+ * <step> <user usec> <system usec> <read bytes> <written bytes> <peak
+ * memory bytes>" line, and anything they left running is killed.
+ *
+ * progress is called with the fraction of the total weight done after
+ * each step succeeds. At the end, the time each step took is printed
+ * (with the processes it counted with steps_count_process, and what they
+ * used), along with how much time running steps at the same time saved.
+ * Returns the status of the first step to fail, or 0.
+ */
+int steps_run(const Step *steps, guint numSteps, gpointer data, StepProgressFunc progress, const StepJournal *journal, StepPolicyFunc policy);
+
+/*
+ * Returns the name of the step running on the calling thread, or NULL if
+ * it isn't a step's thread.
+ */
+const char * steps_current(void);
+
+/*
+ * Returns the step running on the calling thread, for steps_enter, or
+ * NULL if it isn't a step's thread.
+ */
+StepContext * steps_current_context(void);
+
+/*
+ * Makes context (from steps_current_context, or NULL for none) the step
+ * running on the calling thread, so the commands a helper thread runs
+ * for a step get its deadline, stall limit, cgroup and name. The step's
+ * own thread must wait for the helper thread to finish.
+ */
+void steps_enter(StepContext *context);
+
+/*
+ * Returns when (in g_get_monotonic_time's clock) the current attempt at
+ * the step running on the calling thread must be done by, or 0 if there
+ * is no limit.
+ */
+gint64 steps_current_deadline(void);
+
+/*
+ * Returns the stall limit in seconds of the step running on the calling
+ * thread, or 0 if there is no limit.
+ */
+guint steps_current_stall(void);
+
+/*
+ * Returns the cgroup of the step running on the calling thread, or NULL
+ * if it has none.
+ */
+Cgroup * steps_current_cgroup(void);
+
+/*
+ * Counts a process started by the step running on the calling thread,
+ * which took spawnTime microseconds to start (from fork or spawn until
+ * it was exec'd), for the times printed at the end.
+ */
+void steps_count_process(gint64 spawnTime);
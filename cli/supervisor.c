@@ -0,0 +1,610 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Supervises the installer's child processes from one epoll thread.
+ */
+
+#define _GNU_SOURCE
+#include "supervisor.h"
+#include "output.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+typedef struct
+{
+	pid_t pid;
+	int pidfd; // -1 where pidfds aren't supported, and once exited
+	bool foreign; // Not the installer's child, so not reaped here
+	bool exited;
+	int status;
+	struct rusage usage;
+
+	char *label;
+	gint64 deadline; // 0 for none
+	guint stall; // Seconds, 0 for none
+	guint64 io; // Bytes read and written by the group, when last checked
+	gint64 lastProgress;
+	bool stallReported;
+	ChildEnd end;
+	gint64 killAt; // When to SIGKILL a group that was sent SIGTERM, or 0
+} Child;
+
+// Identifies the epoll sources that aren't children
+typedef enum
+{
+	kSourceSignal,
+	kSourceTimer,
+	kSourceTick,
+	kSourceParent,
+	kSourceFifo,
+} Source;
+
+static struct
+{
+	GMutex lock;
+	GCond cond; // Signaled when a child exits
+	GHashTable *children; // pid -> Child
+	int epoll;
+	int signalfd;
+	int timerfd;
+	int tickfd; // Runs while any child has limits
+	bool ticking;
+	int parentfd;
+	int fifofd;
+	guint forking; // Children forked but not yet tracked
+	volatile bool *aborted;
+	guint graceMs;
+	sigset_t signals;
+} S;
+
+// Marks the epoll events of a non-child source. Children use their Child.
+static Source kSources[] = {kSourceSignal, kSourceTimer, kSourceTick, kSourceParent, kSourceFifo};
+
+static int pidfd_open(pid_t pid)
+{
+	return syscall(SYS_pidfd_open, pid, 0);
+}
+
+static bool is_source(void *ptr)
+{
+	return ptr >= (void *)kSources && ptr < (void *)(kSources + G_N_ELEMENTS(kSources));
+}
+
+static bool watch(int fd, void *ptr)
+{
+	struct epoll_event event = {0};
+	event.events = EPOLLIN;
+	event.data.ptr = ptr;
+	return epoll_ctl(S.epoll, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+// Sends sig to every running child's process group. Called with the lock held.
+static void signal_children(int sig)
+{
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, S.children);
+	while(g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		Child *child = value;
+		if(!child->exited)
+			kill(-child->pid, sig);
+	}
+}
+
+static void abort_install(const char *reason)
+{
+	g_mutex_lock(&S.lock);
+	if(*S.aborted)
+	{
+		// Assume two interrupts = they really want it dead
+		signal_children(SIGKILL);
+		g_mutex_unlock(&S.lock);
+		return;
+	}
+
+	output_println("%s, stopping install", reason);
+	*S.aborted = true;
+	signal_children(SIGINT);
+	g_mutex_unlock(&S.lock);
+
+	// Children that are still around after the grace period are killed
+	struct itimerspec timer = {0};
+	timer.it_value.tv_sec = S.graceMs / 1000;
+	timer.it_value.tv_nsec = (S.graceMs % 1000) * 1000000L;
+	timerfd_settime(S.timerfd, 0, &timer, NULL);
+}
+
+// Reaps child if it has exited, and wakes its waiter. Called with the lock held.
+static void reap(Child *child)
+{
+	int status = 0;
+	struct rusage usage = {0};
+	if(child->foreign || child->exited || wait4(child->pid, &status, WNOHANG, &usage) <= 0)
+		return;
+	child->exited = true;
+	child->status = status;
+	child->usage = usage;
+	if(child->pidfd >= 0)
+		close(child->pidfd); // Also removes it from the epoll set
+	child->pidfd = -1;
+	g_cond_broadcast(&S.cond);
+}
+
+static void free_child(Child *child)
+{
+	g_free(child->label);
+	g_free(child);
+}
+
+// Adds the bytes read and written by pid, and by its descendants still
+// in the process group pgid, to *total. They're found through each
+// thread's children list, rather than by looking at every process on
+// the host. Returns false if pid isn't in the group or its I/O can't
+// be read.
+static bool tree_io(pid_t pid, pid_t pgid, guint64 *total)
+{
+	// The process group is the third field after the
+	// parenthesized command name, which can contain spaces
+	char *path = g_strdup_printf("/proc/%d/stat", pid);
+	char *stat = NULL;
+	g_file_get_contents(path, &stat, NULL, NULL);
+	g_free(path);
+	const char *fields = stat ? strrchr(stat, ')') : NULL;
+	int pgrp = 0;
+	bool member = (fields && sscanf(fields, ") %*c %*d %d", &pgrp) == 1 && pgrp == pgid);
+	g_free(stat);
+	if(!member)
+		return false;
+
+	path = g_strdup_printf("/proc/%d/io", pid);
+	char *io = NULL;
+	g_file_get_contents(path, &io, NULL, NULL);
+	g_free(path);
+	const char *rchar = io ? strstr(io, "rchar: ") : NULL;
+	const char *wchar = io ? strstr(io, "wchar: ") : NULL;
+	bool found = (rchar && wchar);
+	if(found)
+		*total += g_ascii_strtoull(rchar + 7, NULL, 10) + g_ascii_strtoull(wchar + 7, NULL, 10);
+	g_free(io);
+
+	path = g_strdup_printf("/proc/%d/task", pid);
+	DIR *tasks = opendir(path);
+	g_free(path);
+	struct dirent *entry;
+	while(tasks && (entry = readdir(tasks)) != NULL)
+	{
+		if(atoi(entry->d_name) <= 0)
+			continue;
+		path = g_strdup_printf("/proc/%d/task/%s/children", pid, entry->d_name);
+		char *children = NULL;
+		g_file_get_contents(path, &children, NULL, NULL);
+		g_free(path);
+		char *next = children;
+		while(next && *next)
+		{
+			char *end;
+			pid_t child = strtol(next, &end, 10);
+			if(end == next)
+				break;
+			tree_io(child, pgid, total);
+			next = end;
+		}
+		g_free(children);
+	}
+	if(tasks)
+		closedir(tasks);
+	return found;
+}
+
+// Sums the bytes read and written by the process group led by pgid.
+// Returns false if that can't be found out.
+static bool group_io(pid_t pgid, guint64 *total)
+{
+	*total = 0;
+	return tree_io(pgid, pgid, total);
+}
+
+// Stops a child that ran out of time: SIGTERM now, SIGKILL after the
+// grace period. Called with the lock held.
+static void stop_child(Child *child, ChildEnd end, gint64 now)
+{
+	child->end = end;
+	kill(-child->pid, SIGTERM);
+	child->killAt = now + (gint64)S.graceMs * 1000;
+}
+
+// Checks children with a deadline or a stall limit, once a second
+static void on_tick(void)
+{
+	guint64 expirations;
+	if(read(S.tickfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+
+	gint64 now = g_get_monotonic_time();
+	bool limited = false;
+	g_mutex_lock(&S.lock);
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, S.children);
+	while(g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		Child *child = value;
+		if(child->exited)
+			continue;
+		if(child->killAt)
+		{
+			limited = true;
+			if(now >= child->killAt)
+			{
+				kill(-child->pid, SIGKILL);
+				child->killAt = 0;
+			}
+			continue;
+		}
+		if(child->end != kChildExited || (!child->deadline && !child->stall))
+			continue;
+		limited = true;
+
+		const char *label = child->label ? child->label : "?";
+		if(child->deadline && now >= child->deadline)
+		{
+			output_println("TIMEOUT %s deadline", label);
+			stop_child(child, kChildTimedOut, now);
+			continue;
+		}
+		if(!child->stall)
+			continue;
+
+		// Without a way to tell, assume it's making progress
+		guint64 io = 0;
+		if(!group_io(child->pid, &io) || io != child->io)
+		{
+			child->io = io;
+			child->lastProgress = now;
+			if(child->stallReported)
+				output_println("RESUMED %s", label);
+			child->stallReported = false;
+			continue;
+		}
+
+		guint idle = (now - child->lastProgress) / G_USEC_PER_SEC;
+		if(idle >= child->stall)
+		{
+			output_println("TIMEOUT %s stalled", label);
+			stop_child(child, kChildStalled, now);
+		}
+		else if(!child->stallReported && idle >= child->stall / 2)
+		{
+			output_println("STALLED %s %u", label, idle);
+			child->stallReported = true;
+		}
+	}
+
+	if(!limited)
+	{
+		struct itimerspec off = {0};
+		timerfd_settime(S.tickfd, 0, &off, NULL);
+		S.ticking = false;
+	}
+	g_mutex_unlock(&S.lock);
+}
+
+// Reaps every exited child: tracked ones for their waiters, and the
+// rest, which are orphans reparented to the installer as its PID
+// namespace's init (gpg-agent, fuse2fs). Unknown children may also be
+// ones about to be tracked, so nothing is reaped while any are forking.
+// Called with the lock held.
+static void reap_all(void)
+{
+	while(S.forking == 0)
+	{
+		siginfo_t info = {0};
+		if(waitid(P_ALL, 0, &info, WEXITED|WNOHANG|WNOWAIT) || info.si_pid <= 0)
+			return;
+		Child *child = g_hash_table_lookup(S.children, GINT_TO_POINTER(info.si_pid));
+		if(child && !child->foreign)
+			reap(child);
+		else
+			waitpid(info.si_pid, NULL, WNOHANG);
+	}
+}
+
+static void on_signal(void)
+{
+	struct signalfd_siginfo info;
+	bool reapAll = false;
+	while(read(S.signalfd, &info, sizeof(info)) == sizeof(info))
+	{
+		if(info.ssi_signo == SIGCHLD)
+			reapAll = true;
+		else
+			abort_install(info.ssi_signo == SIGHUP ? "Hangup" : "Interrupted");
+	}
+
+	// Without pidfds, SIGCHLD is the only way to know a child exited
+	if(reapAll)
+	{
+		g_mutex_lock(&S.lock);
+		reap_all();
+		g_mutex_unlock(&S.lock);
+	}
+}
+
+static gpointer thread_supervise(UNUSED gpointer data)
+{
+	struct epoll_event events[16];
+	while(true)
+	{
+		int num = epoll_wait(S.epoll, events, G_N_ELEMENTS(events), -1);
+		if(num < 0 && errno != EINTR)
+		{
+			abort_install("Supervisor failed");
+			return NULL;
+		}
+
+		for(int i=0; i<num; ++i)
+		{
+			void *ptr = events[i].data.ptr;
+			if(!is_source(ptr))
+			{
+				g_mutex_lock(&S.lock);
+				reap(ptr);
+				g_mutex_unlock(&S.lock);
+				continue;
+			}
+
+			switch(*(Source *)ptr)
+			{
+			case kSourceSignal:
+				on_signal();
+				break;
+			case kSourceTimer:
+			{
+				guint64 expirations;
+				if(read(S.timerfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+				{
+					g_mutex_lock(&S.lock);
+					signal_children(SIGKILL);
+					g_mutex_unlock(&S.lock);
+				}
+				break;
+			}
+			case kSourceTick:
+				on_tick();
+				break;
+			case kSourceParent:
+				epoll_ctl(S.epoll, EPOLL_CTL_DEL, S.parentfd, NULL);
+				abort_install("Parent exited");
+				break;
+			case kSourceFifo:
+			{
+				// The fifo is open for writing too, so it never
+				// reads EOF; only data means abort
+				char buf[64];
+				bool got = false;
+				while(read(S.fifofd, buf, sizeof(buf)) > 0)
+					got = true;
+				if(got)
+					abort_install("Kill requested");
+				break;
+			}
+			}
+		}
+	}
+	return NULL;
+}
+
+gboolean supervisor_start(const char *killfifo, volatile bool *aborted, guint graceMs)
+{
+	g_return_val_if_fail(aborted, FALSE);
+
+	g_mutex_init(&S.lock);
+	g_cond_init(&S.cond);
+	S.children = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)free_child);
+	S.aborted = aborted;
+	S.graceMs = graceMs;
+	S.parentfd = S.fifofd = -1;
+
+	sigemptyset(&S.signals);
+	sigaddset(&S.signals, SIGINT);
+	sigaddset(&S.signals, SIGTERM);
+	sigaddset(&S.signals, SIGHUP);
+	sigaddset(&S.signals, SIGCHLD);
+	if(pthread_sigmask(SIG_BLOCK, &S.signals, NULL))
+		return FALSE;
+
+	S.epoll = epoll_create1(EPOLL_CLOEXEC);
+	S.signalfd = signalfd(-1, &S.signals, SFD_NONBLOCK|SFD_CLOEXEC);
+	S.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	S.tickfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if(S.epoll < 0 || S.signalfd < 0 || S.timerfd < 0 || S.tickfd < 0
+	|| !watch(S.signalfd, &kSources[kSourceSignal])
+	|| !watch(S.timerfd, &kSources[kSourceTimer])
+	|| !watch(S.tickfd, &kSources[kSourceTick]))
+		return FALSE;
+
+	// The parent's pidfd becomes readable when it exits. Without
+	// pidfds, ask for SIGHUP instead.
+	pid_t ppid = getppid();
+	S.parentfd = pidfd_open(ppid);
+	if(S.parentfd >= 0)
+	{
+		fcntl(S.parentfd, F_SETFD, FD_CLOEXEC);
+		if(!watch(S.parentfd, &kSources[kSourceParent]))
+			return FALSE;
+	}
+	else if(prctl(PR_SET_PDEATHSIG, SIGHUP))
+		return FALSE;
+	if(getppid() != ppid)
+		*aborted = true;
+
+	if(killfifo)
+	{
+		// Opening for writing as well means this doesn't wait for a
+		// writer, and the fifo doesn't read EOF when writers close
+		S.fifofd = open(killfifo, O_RDWR|O_NONBLOCK|O_CLOEXEC);
+		if(S.fifofd < 0 || !watch(S.fifofd, &kSources[kSourceFifo]))
+			return FALSE;
+	}
+
+	g_thread_unref(g_thread_new("supervisor", thread_supervise, NULL));
+	if(*aborted)
+		output_println("Parent exited, stopping install");
+	return TRUE;
+}
+
+void supervisor_prepare_child(pid_t parent)
+{
+	setpgrp();
+	sigset_t none;
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+
+	// Child processes should be killed cleanly, but just in case
+	// something bad happens (parent segfaults or SIGKILL'd), this
+	// is a last resort to get the child to die.
+	if(prctl(PR_SET_PDEATHSIG, SIGHUP))
+		abort();
+	// Prevent race condition of parent dying before prctl is called
+	if(getppid() != parent)
+		abort();
+}
+
+static Child * new_child(pid_t pid, const char *label, gint64 deadline, guint stall)
+{
+	Child *child = g_new0(Child, 1);
+	child->pid = pid;
+	child->label = g_strdup(label);
+	child->deadline = deadline;
+	child->stall = stall;
+	child->lastProgress = g_get_monotonic_time();
+	return child;
+}
+
+// Called with the lock held
+static void add_child(Child *child)
+{
+	g_hash_table_insert(S.children, GINT_TO_POINTER(child->pid), child);
+	// An abort between starting the child and tracking it would have
+	// missed it
+	if(*S.aborted)
+		kill(-child->pid, SIGKILL);
+	if((child->deadline || child->stall) && !S.ticking)
+	{
+		struct itimerspec tick = {{1, 0}, {1, 0}};
+		timerfd_settime(S.tickfd, 0, &tick, NULL);
+		S.ticking = true;
+	}
+}
+
+void supervisor_fork(void)
+{
+	g_mutex_lock(&S.lock);
+	S.forking++;
+	g_mutex_unlock(&S.lock);
+}
+
+void supervisor_fork_failed(void)
+{
+	g_mutex_lock(&S.lock);
+	if(S.forking > 0 && --S.forking == 0)
+		reap_all();
+	g_mutex_unlock(&S.lock);
+}
+
+void supervisor_track(pid_t pid, const char *label, gint64 deadline, guint stall)
+{
+	// The child also does this itself, but the parent has to
+	// as well so that the group exists before anyone signals it.
+	setpgid(pid, pid);
+
+	Child *child = new_child(pid, label, deadline, stall);
+	child->pidfd = pidfd_open(pid);
+	if(child->pidfd >= 0)
+		fcntl(child->pidfd, F_SETFD, FD_CLOEXEC);
+
+	g_mutex_lock(&S.lock);
+	add_child(child);
+	// It may have exited already, and without a pidfd, its SIGCHLD may
+	// have come before it was tracked
+	if(child->pidfd < 0 || !watch(child->pidfd, child))
+	{
+		if(child->pidfd >= 0)
+			close(child->pidfd);
+		child->pidfd = -1;
+		reap(child);
+	}
+	// Orphans that exited while it was forking are still to be reaped
+	if(S.forking > 0 && --S.forking == 0)
+		reap_all();
+	g_mutex_unlock(&S.lock);
+}
+
+void supervisor_watch(pid_t pid, const char *label, gint64 deadline, guint stall)
+{
+	Child *child = new_child(pid, label, deadline, stall);
+	child->pidfd = -1;
+	child->foreign = true;
+
+	g_mutex_lock(&S.lock);
+	add_child(child);
+	g_mutex_unlock(&S.lock);
+}
+
+gboolean supervisor_unwatch(pid_t pid, ChildEnd *end)
+{
+	g_mutex_lock(&S.lock);
+	Child *child = g_hash_table_lookup(S.children, GINT_TO_POINTER(pid));
+	if(!child || !child->foreign)
+	{
+		g_mutex_unlock(&S.lock);
+		return FALSE;
+	}
+	if(end)
+		*end = child->end;
+	g_hash_table_remove(S.children, GINT_TO_POINTER(pid));
+	g_mutex_unlock(&S.lock);
+	return TRUE;
+}
+
+gboolean supervisor_wait(pid_t pid, int *status, ChildEnd *end, struct rusage *usage)
+{
+	g_mutex_lock(&S.lock);
+	Child *child = g_hash_table_lookup(S.children, GINT_TO_POINTER(pid));
+	if(!child || child->foreign)
+	{
+		g_mutex_unlock(&S.lock);
+		return FALSE;
+	}
+	while(!child->exited)
+		g_cond_wait(&S.cond, &S.lock);
+	if(status)
+		*status = child->status;
+	if(end)
+		*end = child->end;
+	if(usage)
+		*usage = child->usage;
+	g_hash_table_remove(S.children, GINT_TO_POINTER(pid));
+	g_mutex_unlock(&S.lock);
+	return TRUE;
+}
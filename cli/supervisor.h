@@ -0,0 +1,93 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Supervises the installer's child processes, and aborts them all when
+ * the install is stopped, from one thread waiting on an epoll set of a
+ * signalfd, a pidfd per child, a pidfd of the installer's parent, and
+ * the kill fifo. It also reaps orphans, since the installer is its PID
+ * namespace's init. It uses no CPU while nothing happens, other than a
+ * check every second on children with a deadline or a stall limit.
+ */
+
+#include <glib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+typedef enum
+{
+	kChildExited,
+	kChildTimedOut, // Killed for running past its deadline
+	kChildStalled, // Killed for going too long without output or I/O
+} ChildEnd;
+
+/*
+ * Starts supervising. SIGINT, SIGTERM and SIGHUP are blocked and handled
+ * by the supervisor instead, so this must be called before any other
+ * threads start, for them to inherit the blocked signals. The install is
+ * aborted on any of those signals, when anything is written to killfifo
+ * (if non-NULL), or when the installer's parent exits. On abort, *aborted
+ * is set true, every child's process group gets SIGINT, and any still
+ * running after graceMs (or after a second abort signal) get SIGKILL.
+ * Returns FALSE on failure.
+ */
+gboolean supervisor_start(const char *killfifo, volatile bool *aborted, guint graceMs);
+
+/*
+ * Call in a forked child before exec. Gives the child its own process
+ * group, unblocks the signals supervisor_start blocked, and makes the
+ * child die with the installer. Aborts the child if the installer
+ * (parent) already died.
+ */
+void supervisor_prepare_child(pid_t parent);
+
+/*
+ * Call before forking a child to track. Until the child is tracked (or
+ * supervisor_fork_failed is called), the supervisor leaves unknown
+ * children alone, rather than reaping them as orphans.
+ */
+void supervisor_fork(void);
+
+/*
+ * Call instead of supervisor_track when the fork after supervisor_fork
+ * failed, or once the caller reaped the child itself.
+ */
+void supervisor_fork_failed(void);
+
+/*
+ * Supervises a forked child until supervisor_wait reaps it. A child
+ * tracked after an abort is killed straight away.
+ *
+ * If deadline (in g_get_monotonic_time's clock) is non-zero, the child's
+ * process group is stopped (SIGTERM, then SIGKILL after the grace period)
+ * once it passes. If stall is non-zero, the group is stopped once none of
+ * its processes has read or written anything (which includes output and
+ * network traffic) for stall seconds. Halfway there, a "STALLED <label>
+ * <seconds>" line is printed, followed by "RESUMED <label>" if it picks up
+ * again, and a "TIMEOUT <label> deadline|stalled" line when it's stopped.
+ */
+void supervisor_track(pid_t pid, const char *label, gint64 deadline, guint stall);
+
+/*
+ * Waits for a tracked child to exit, and stores its wait status in
+ * status, why it ended in end and its resource usage in usage (if
+ * non-NULL). Any number of threads can wait on their own children at
+ * once. Returns FALSE if pid isn't tracked.
+ */
+gboolean supervisor_wait(pid_t pid, int *status, ChildEnd *end, struct rusage *usage);
+
+/*
+ * Supervises a process that isn't the installer's child (one started by
+ * the chroot helper), which must lead its own process group, the same
+ * way as supervisor_track, until supervisor_unwatch. Whoever started it
+ * reaps it.
+ */
+void supervisor_watch(pid_t pid, const char *label, gint64 deadline, guint stall);
+
+/*
+ * Stops supervising a watched process once it has exited, and stores
+ * why it ended in end (if non-NULL). Returns FALSE if pid isn't watched.
+ */
+gboolean supervisor_unwatch(pid_t pid, ChildEnd *end);
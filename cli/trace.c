@@ -0,0 +1,193 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Writes a timeline of the install in the Chrome trace event format.
+ */
+
+#define _GNU_SOURCE
+#include "trace.h"
+#include "output.h"
+#include "hoststat.h"
+#include "json.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+// How often the counters are sampled, in microseconds
+#define SAMPLE_INTERVAL (500 * 1000)
+// rusage counts block I/O in 512 byte units
+#define BLOCK_SIZE 512
+
+static struct
+{
+	GMutex lock; // Guards the file and stopping
+	GCond cond;
+	FILE *file; // NULL if not tracing
+	gint64 start;
+	bool stopping;
+	GThread *sampler;
+} T;
+
+static pid_t gettid_(void)
+{
+	return syscall(SYS_gettid);
+}
+
+// Writes an event (a JSON object), after the ones before it
+static void write_event(GString *event)
+{
+	g_mutex_lock(&T.lock);
+	if(T.file)
+		fprintf(T.file, ",\n%s", event->str);
+	g_mutex_unlock(&T.lock);
+}
+
+static gint64 timestamp(gint64 time)
+{
+	return MAX(time - T.start, 0);
+}
+
+static void write_counter(const char *name, gint64 time, const char *series1, double value1, const char *series2, double value2)
+{
+	GString *event = g_string_new("{\"ph\":\"C\",\"pid\":1,\"name\":");
+	json_append_string(event, name);
+	g_string_append_printf(event, ",\"ts\":%" G_GINT64_FORMAT ",\"args\":{\"%s\":%.0f,\"%s\":%.0f}}",
+		timestamp(time), series1, value1, series2, value2);
+	write_event(event);
+	g_string_free(event, TRUE);
+}
+
+// Samples the counters until trace_close, as rates in bytes per second
+static gpointer thread_sample(UNUSED gpointer data)
+{
+	guint64 rx = 0, tx = 0, read = 0, written = 0;
+	bool network = hoststat_network(&rx, &tx);
+	bool disks = hoststat_disks(&read, &written);
+	gint64 last = g_get_monotonic_time();
+
+	g_mutex_lock(&T.lock);
+	while(!T.stopping)
+	{
+		g_cond_wait_until(&T.cond, &T.lock, last + SAMPLE_INTERVAL);
+		if(T.stopping)
+			break;
+		g_mutex_unlock(&T.lock);
+
+		gint64 now = g_get_monotonic_time();
+		double seconds = (now - last) / (double)G_USEC_PER_SEC;
+		guint64 rx2, tx2, read2, written2;
+		if(network && seconds > 0 && hoststat_network(&rx2, &tx2))
+		{
+			write_counter("Network", now, "received", (rx2 - rx) / seconds, "sent", (tx2 - tx) / seconds);
+			rx = rx2;
+			tx = tx2;
+		}
+		if(disks && seconds > 0 && hoststat_disks(&read2, &written2))
+		{
+			write_counter("Disk", now, "read", (read2 - read) / seconds, "written", (written2 - written) / seconds);
+			read = read2;
+			written = written2;
+		}
+		last = now;
+
+		g_mutex_lock(&T.lock);
+	}
+	g_mutex_unlock(&T.lock);
+	return NULL;
+}
+
+gboolean trace_open(const char *path)
+{
+	g_return_val_if_fail(path, FALSE);
+	FILE *file = fopen(path, "we");
+	if(!file)
+		return FALSE;
+
+	g_mutex_init(&T.lock);
+	g_cond_init(&T.cond);
+	T.start = g_get_monotonic_time();
+	T.stopping = false;
+	// Starts with the process's name, so every event after it can
+	// start with a comma
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+		"{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"vos-install-cli\"}}");
+	T.file = file;
+	T.sampler = g_thread_new("trace", thread_sample, NULL);
+	return TRUE;
+}
+
+void trace_close(void)
+{
+	if(!T.file)
+		return;
+
+	g_mutex_lock(&T.lock);
+	T.stopping = true;
+	g_cond_signal(&T.cond);
+	g_mutex_unlock(&T.lock);
+	g_thread_join(T.sampler);
+	T.sampler = NULL;
+
+	g_mutex_lock(&T.lock);
+	fprintf(T.file, "\n]}\n");
+	if(fclose(T.file))
+		output_println("Warning: Failed to write the trace");
+	T.file = NULL;
+	g_mutex_unlock(&T.lock);
+}
+
+void trace_step(const char *name, gint64 start, gint64 end, int status)
+{
+	if(!T.file)
+		return;
+
+	// Names the step's thread after it, too
+	pid_t tid = gettid_();
+	GString *event = g_string_new(NULL);
+	g_string_append_printf(event, "{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":", tid);
+	json_append_string(event, name);
+	g_string_append_printf(event, "}},\n{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"cat\":\"step\",\"name\":", tid);
+	json_append_string(event, name);
+	g_string_append_printf(event, ",\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT ",\"args\":{\"status\":%d}}",
+		timestamp(start), end - start, status);
+	write_event(event);
+	g_string_free(event, TRUE);
+}
+
+void trace_process(const char * const *args, gint64 start, gint64 end, int status, const struct rusage *usage)
+{
+	if(!T.file || !args || !args[0])
+		return;
+
+	GString *event = g_string_new(NULL);
+	g_string_append_printf(event, "{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"cat\":\"process\",\"name\":", gettid_());
+	json_append_string(event, args[0]);
+	g_string_append_printf(event, ",\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT ",\"args\":{\"argv\":[",
+		timestamp(start), end - start);
+	for(size_t i=0; args[i]!=NULL; ++i)
+	{
+		if(i > 0)
+			g_string_append_c(event, ',');
+		json_append_string(event, args[i]);
+	}
+	g_string_append_c(event, ']');
+	if(WIFEXITED(status))
+		g_string_append_printf(event, ",\"exit\":%d", WEXITSTATUS(status));
+	else if(WIFSIGNALED(status))
+		g_string_append_printf(event, ",\"signal\":%d", WTERMSIG(status));
+	if(usage)
+	{
+		g_string_append_printf(event, ",\"user_ms\":%.1f,\"sys_ms\":%.1f,\"read_bytes\":%ld,\"written_bytes\":%ld",
+			usage->ru_utime.tv_sec * 1000.0 + usage->ru_utime.tv_usec / 1000.0,
+			usage->ru_stime.tv_sec * 1000.0 + usage->ru_stime.tv_usec / 1000.0,
+			usage->ru_inblock * BLOCK_SIZE, usage->ru_oublock * BLOCK_SIZE);
+	}
+	g_string_append(event, "}}");
+	write_event(event);
+	g_string_free(event, TRUE);
+}
@@ -0,0 +1,38 @@
+/*
+ * This file is part of vos-installer.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Writes a timeline of the install in the Chrome trace event format (for
+ * Perfetto or chrome://tracing): a span for each step and each process
+ * it ran, on the step's thread, and counter tracks of the host's network
+ * and disk throughput, sampled while the install runs.
+ */
+
+#include <glib.h>
+#include <sys/resource.h>
+
+/*
+ * Opens the trace file at path, and starts sampling the counters.
+ * Until then, the rest do nothing. Returns FALSE on failure.
+ */
+gboolean trace_open(const char *path);
+
+/*
+ * Stops sampling, and finishes and closes the trace file.
+ */
+void trace_close(void);
+
+/*
+ * Adds a span for a step that ran from start to end (in
+ * g_get_monotonic_time's clock) and returned status. Call from the
+ * step's thread.
+ */
+void trace_step(const char *name, gint64 start, gint64 end, int status);
+
+/*
+ * Adds a span for a process run with args from start to end, with its
+ * wait status, and its resource usage (if non-NULL). Call from the
+ * thread of the step that ran it.
+ */
+void trace_process(const char * const *args, gint64 start, gint64 end, int status, const struct rusage *usage);